@@ -0,0 +1,259 @@
+/*
+    A small software rasterizer for debug drawing into 8 bit images (e.g. the voronoi cells)
+
+    #define JC_DRAW_IMPLEMENTATION
+    #include "jc_draw.h"
+
+    The images are stored row by row, with nchannels bytes per pixel. Everything is clipped against the image,
+    or against a clip rectangle in the _clip versions of the functions. Drawing with a clip rectangle writes
+    exactly the pixels inside it that the unclipped call would write, so an image can be drawn in tiles
+    (e.g. in parallel).
+
+    A pixel is covered by a polygon if its center (x+0.5, y+0.5) is inside the polygon, so polygons that
+    share an edge don't overlap (e.g. the cells of a voronoi diagram).
+*/
+
+#ifndef JC_DRAW_H
+#define JC_DRAW_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JCD_FUNDEF extern
+
+typedef struct _jcd_point
+{
+    float x;
+    float y;
+} jcd_point;
+
+// The pixels [x0, x1) x [y0, y1). Must be inside the image
+typedef struct _jcd_rect
+{
+    int x0, y0;
+    int x1, y1;
+} jcd_rect;
+
+JCD_FUNDEF void jcd_draw_point(int x, int y, uint8_t* image, int width, int height, int nchannels, const uint8_t* color);
+JCD_FUNDEF void jcd_draw_line(int x0, int y0, int x1, int y1, uint8_t* image, int width, int height, int nchannels, const uint8_t* color);
+
+// Draws the pixels [x0, x1) on row y
+JCD_FUNDEF void jcd_draw_span(int x0, int x1, int y, uint8_t* image, int width, int height, int nchannels, const uint8_t* color);
+
+// Fills a convex polygon (in either winding order)
+JCD_FUNDEF void jcd_fill_convex_polygon(int count, const jcd_point* points, uint8_t* image, int width, int height, int nchannels, const uint8_t* color);
+
+JCD_FUNDEF void jcd_draw_point_clip(int x, int y, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color);
+JCD_FUNDEF void jcd_draw_line_clip(int x0, int y0, int x1, int y1, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color);
+JCD_FUNDEF void jcd_draw_span_clip(int x0, int x1, int y, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color);
+JCD_FUNDEF void jcd_fill_convex_polygon_clip(int count, const jcd_point* points, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // JC_DRAW_H
+
+#ifdef JC_DRAW_IMPLEMENTATION
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void jcd_draw_point_clip(int x, int y, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color)
+{
+    if( x < clip->x0 || y < clip->y0 || x >= clip->x1 || y >= clip->y1 )
+        return;
+    uint8_t* pixel = image + ((size_t)y * width + x) * nchannels;
+    for( int i = 0; i < nchannels; ++i )
+        pixel[i] = color[i];
+}
+
+// http://members.chello.at/~easyfilter/bresenham.html
+void jcd_draw_line_clip(int x0, int y0, int x1, int y1, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color)
+{
+    // Lines completely outside of the clip rect are skipped
+    if( (x0 < clip->x0 && x1 < clip->x0) || (y0 < clip->y0 && y1 < clip->y0) || (x0 >= clip->x1 && x1 >= clip->x1) || (y0 >= clip->y1 && y1 >= clip->y1) )
+        return;
+
+    int dx =  abs(x1-x0), sx = x0<x1 ? 1 : -1;
+    int dy = -abs(y1-y0), sy = y0<y1 ? 1 : -1;
+    int err = dx+dy, e2; // error value e_xy
+
+    for(;;)
+    {
+        jcd_draw_point_clip(x0,y0, clip, image, width, nchannels, color);
+        if (x0==x1 && y0==y1) break;
+        e2 = 2*err;
+        if (e2 >= dy) { err += dy; x0 += sx; } // e_xy+e_x > 0
+        if (e2 <= dx) { err += dx; y0 += sy; } // e_xy+e_y < 0
+    }
+}
+
+void jcd_draw_span_clip(int x0, int x1, int y, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color)
+{
+    if( y < clip->y0 || y >= clip->y1 )
+        return;
+    if( x0 < clip->x0 )
+        x0 = clip->x0;
+    if( x1 > clip->x1 )
+        x1 = clip->x1;
+    if( x0 >= x1 )
+        return;
+
+    uint8_t* pixel = image + ((size_t)y * width + x0) * nchannels;
+    int count = x1 - x0;
+    if( nchannels == 4 )
+    {
+        uint32_t c;
+        memcpy(&c, color, sizeof(c));
+        for( int i = 0; i < count; ++i )
+            memcpy(pixel + i * 4, &c, sizeof(c)); // a single 32 bit store
+    }
+    else if( nchannels == 1 )
+    {
+        memset(pixel, color[0], (size_t)count);
+    }
+    else
+    {
+        for( int i = 0; i < count; ++i, pixel += nchannels )
+            for( int c = 0; c < nchannels; ++c )
+                pixel[c] = color[c];
+    }
+}
+
+// ceilf() is a function call on some targets
+static inline int jcd_ceil_to_int(float v)
+{
+    int i = (int)v;
+    return i + (v > (float)i ? 1 : 0);
+}
+
+// Steps along one side of the polygon, from the top vertex down to the bottom vertex
+typedef struct _jcd_edge_walker
+{
+    const jcd_point*    points;
+    int                 count;
+    int                 step;   // +1 or -1 (count-1), the direction around the polygon
+    int                 index;  // the start vertex of the current edge
+    int                 bottom;
+    float               x;      // x at the current row center
+    float               dxdy;
+    float               end_y;  // y of the end vertex of the current edge
+} jcd_edge_walker;
+
+// Moves to the edge that contains the row center yc (if any), and computes x at yc
+static void jcd_edge_walker_advance(jcd_edge_walker* w, float yc)
+{
+    while( w->index != w->bottom )
+    {
+        int next = (w->index + w->step) % w->count;
+        const jcd_point* p0 = &w->points[w->index];
+        const jcd_point* p1 = &w->points[next];
+        if( yc < p1->y )
+        {
+            w->dxdy = (p1->x - p0->x) / (p1->y - p0->y);
+            w->x = p0->x + (yc - p0->y) * w->dxdy;
+            w->end_y = p1->y;
+            return;
+        }
+        w->index = next;
+    }
+    w->end_y = yc; // at the bottom
+}
+
+void jcd_fill_convex_polygon_clip(int count, const jcd_point* points, const jcd_rect* clip, uint8_t* image, int width, int nchannels, const uint8_t* color)
+{
+    if( count < 3 )
+        return;
+
+    int top = 0;
+    int bottom = 0;
+    for( int i = 1; i < count; ++i )
+    {
+        if( points[i].y < points[top].y )
+            top = i;
+        if( points[i].y > points[bottom].y )
+            bottom = i;
+    }
+
+    // The rows whose centers are inside [top, bottom)
+    int y0 = jcd_ceil_to_int(points[top].y - 0.5f);
+    int y1 = jcd_ceil_to_int(points[bottom].y - 0.5f);
+    if( y1 > clip->y1 )
+        y1 = clip->y1;
+    if( y0 >= y1 || y1 <= clip->y0 )
+        return;
+
+    // The rows above the clip rect are stepped over like the other rows, so the x positions are
+    // exactly the same as when drawing without a clip rect
+    jcd_edge_walker a = { points, count, 1, top, bottom, 0, 0, 0 };
+    jcd_edge_walker b = { points, count, count - 1, top, bottom, 0, 0, 0 };
+    float yc = y0 + 0.5f;
+    jcd_edge_walker_advance(&a, yc);
+    jcd_edge_walker_advance(&b, yc);
+
+    for( int y = y0; y < y1; ++y, yc += 1.0f )
+    {
+        if( yc >= a.end_y )
+            jcd_edge_walker_advance(&a, yc);
+        if( yc >= b.end_y )
+            jcd_edge_walker_advance(&b, yc);
+
+        if( y >= clip->y0 )
+        {
+            float left = a.x < b.x ? a.x : b.x;
+            float right = a.x < b.x ? b.x : a.x;
+            // The pixels whose centers are inside [left, right)
+            int x0 = jcd_ceil_to_int(left - 0.5f);
+            int x1 = jcd_ceil_to_int(right - 0.5f);
+            jcd_draw_span_clip(x0, x1, y, clip, image, width, nchannels, color);
+        }
+
+        a.x += a.dxdy;
+        b.x += b.dxdy;
+    }
+}
+
+static inline jcd_rect jcd_image_rect(int width, int height)
+{
+    jcd_rect rect = { 0, 0, width, height };
+    return rect;
+}
+
+void jcd_draw_point(int x, int y, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
+{
+    jcd_rect clip = jcd_image_rect(width, height);
+    jcd_draw_point_clip(x, y, &clip, image, width, nchannels, color);
+}
+
+void jcd_draw_line(int x0, int y0, int x1, int y1, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
+{
+    jcd_rect clip = jcd_image_rect(width, height);
+    jcd_draw_line_clip(x0, y0, x1, y1, &clip, image, width, nchannels, color);
+}
+
+void jcd_draw_span(int x0, int x1, int y, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
+{
+    jcd_rect clip = jcd_image_rect(width, height);
+    jcd_draw_span_clip(x0, x1, y, &clip, image, width, nchannels, color);
+}
+
+void jcd_fill_convex_polygon(int count, const jcd_point* points, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
+{
+    jcd_rect clip = jcd_image_rect(width, height);
+    jcd_fill_convex_polygon_clip(count, points, &clip, image, width, nchannels, color);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // JC_DRAW_IMPLEMENTATION
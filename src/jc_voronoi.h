@@ -6,6 +6,13 @@ ABOUT:
 
 HISTORY:
 
+	0.5     2026-10-19  - Added jcv_diagram_regenerate() to reuse the memory between generations
+	                    - Fixed the circle events of almost collinear sites in float, which could break the diagram
+	                    - Sites are sorted with a radix sort (define JCV_DISABLE_RADIX_SORT to use qsort)
+	                    - Faster beach line lookup, using a hash of x coordinate buckets (define JCV_DISABLE_BEACHLINE_HASH to walk from the last inserted edge)
+	                    - The graph edges are sorted once per site, using a pseudo angle (jcv_graphedge::angle is now in [0,4) instead of [0,2*pi))
+	                    - Added JCV_FLOOR and JCV_CEIL, so the bounds are not rounded in float when JCV_REAL_TYPE is double
+	                    - Added JCV_EDGE_INTERSECT_THRESHOLD, to detect the nearly parallel edges (sites with almost the same y coordinate) when using doubles
 	0.4     2017-06-03	- Increased the max number of events that are preallocated
     0.3     2017-04-16	- Added clipping box as input argument (Automatically calcuated if needed)
                         - Input points are pruned based on bounding box
@@ -57,6 +64,7 @@ USAGE:
 
 	void jcv_diagram_generate( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* diagram );
 	void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* diagram );
+	void jcv_diagram_regenerate( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* diagram );
 	void jcv_diagram_free( jcv_diagram* diagram );
 
 	const jcv_site* jcv_diagram_get_sites( const jcv_diagram* diagram );
@@ -69,6 +77,13 @@ USAGE:
 	//#define JCV_REAL_TYPE double
 	//#define JCV_FABS fabs
 	//#define JCV_ATAN2 atan2
+	//#define JCV_SQRT sqrt
+	//#define JCV_FLOOR floor
+	//#define JCV_CEIL ceil
+	//#define JCV_EDGE_INTERSECT_THRESHOLD 0	// With doubles, only exactly parallel edges need to be skipped
+	//#define JCV_DISABLE_RADIX_SORT			// Use qsort for sorting the sites
+	//#define JCV_DISABLE_BEACHLINE_HASH		// Walk the beach line from the last inserted edge, instead of using the x buckets
+	//#define JCV_RADIX_SORT_THRESHOLD 256		// Fewer points than this are sorted with qsort
 	#include "jc_voronoi.h"
 
 	void draw_edges(const jcv_diagram* diagram);
@@ -171,6 +186,18 @@ extern "C" {
 	#define JCV_FABS(_X_)		fabsf(_X_)
 #endif
 
+#ifndef JCV_FLOOR
+	#define JCV_FLOOR(_X_)		floorf(_X_)
+#endif
+
+#ifndef JCV_CEIL
+	#define JCV_CEIL(_X_)		ceilf(_X_)
+#endif
+
+#ifndef JCV_EDGE_INTERSECT_THRESHOLD
+	#define JCV_EDGE_INTERSECT_THRESHOLD ((jcv_real)0.00001f)	// Edges closer to parallel than this don't intersect
+#endif
+
 #ifndef JCV_PI
 	#define JCV_PI 3.14159265358979323846264338327950288f
 #endif
@@ -191,7 +218,7 @@ typedef struct _jcv_graphedge
 	struct _jcv_edge*		edge;
 	struct _jcv_site*		neighbor;
 	jcv_point				pos[2];
-	jcv_real				angle;
+	jcv_real				angle;	// Pseudo angle [0,4) around the site, used for sorting (not radians)
 } jcv_graphedge;
 
 typedef struct _jcv_site
@@ -245,6 +272,13 @@ typedef void (*FJCVFreeFn)(void* userctx, void* p);
 extern void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* diagram );
 
 
+/** Generates the diagram again, reusing the memory from the previous generation of the same diagram.
+ * The memory is kept until jcv_diagram_free() is called, so repeated generations (e.g. when relaxing the points)
+ * don't allocate any more memory after the first one (unless the number of points increases).
+ * If the diagram hasn't been generated before, it behaves like jcv_diagram_generate()
+ */
+extern void jcv_diagram_regenerate( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* diagram );
+
 /** Uses free (or the registered custom free function)
  */
 extern void jcv_diagram_free( jcv_diagram* diagram );
@@ -268,6 +302,10 @@ extern const jcv_edge* jcv_diagram_get_edges( const jcv_diagram* diagram );
 
 #include <memory.h>
 
+#ifndef JCV_RADIX_SORT_THRESHOLD
+	#define JCV_RADIX_SORT_THRESHOLD 256
+#endif
+
 // INTERNAL FUNCTIONS
 
 #if defined(_MSC_VER) && !defined(__cplusplus)
@@ -323,11 +361,13 @@ typedef struct _jcv_halfedge
 	jcv_real				y;
 	int 					direction; // 0=left, 1=right
 	int						pqpos;
+	int						hashbucket;	// The beach line hash bucket pointing to this half edge, or -1
 } jcv_halfedge;
 
 typedef struct _jcv_memoryblock
 {
 	size_t sizefree;
+	size_t size;	// Total size, including this header
 	struct _jcv_memoryblock* next;
 	char*  memory;
 } jcv_memoryblock;
@@ -356,17 +396,22 @@ typedef struct _jcv_context_internal
 	jcv_edge*			edges;
 	jcv_halfedge*		beachline_start;
 	jcv_halfedge*		beachline_end;
-	jcv_halfedge*		last_inserted;
+	jcv_halfedge**		beachline_hash;		// Buckets along the x axis, each pointing into the beach line
+	int					beachline_hashsize;
+	int					beachline_hashcapacity;
+	jcv_halfedge*		last_inserted;		// Only used with JCV_DISABLE_BEACHLINE_HASH
 	jcv_priorityqueue* 	eventqueue;
 
 	jcv_site*			sites;
+	jcv_site*			sitesscratch;	// Temp buffer for sorting the sites
 	jcv_site*			bottomsite;
 	int					numsites;
 	int					numsites_sqrt;
 	int					currentsite;
-	int					_padding;
+	int					maxnumsites;	// Capacity of the sites and event arrays
 
 	jcv_memoryblock*	memblocks;
+	jcv_memoryblock*	freeblocks;		// Blocks kept from a previous generation
 	jcv_edge*			edgepool;
 	jcv_halfedge*		halfedgepool;
 	void**				eventmem;
@@ -387,17 +432,25 @@ static const int JCV_DIRECTION_RIGHT = 1;
 static const jcv_real JCV_INVALID_VALUE = (jcv_real)-1;
 
 
+static void jcv_free_memblocks( jcv_context_internal* internal, jcv_memoryblock* block )
+{
+	while( block )
+	{
+		jcv_memoryblock* p = block;
+		block = block->next;
+		internal->free( internal->memctx, p );
+	}
+}
+
 void jcv_diagram_free( jcv_diagram* d )
 {
 	jcv_context_internal* internal = d->internal;
 	void* memctx = internal->memctx;
 	FJCVFreeFn freefn = internal->free;
-	while(internal->memblocks)
-	{
-		jcv_memoryblock* p = internal->memblocks;
-		internal->memblocks = internal->memblocks->next;
-		freefn( memctx, p );
-	}
+	jcv_free_memblocks(internal, internal->memblocks);
+	jcv_free_memblocks(internal, internal->freeblocks);
+	internal->memblocks = 0;
+	internal->freeblocks = 0;
 
 	freefn( memctx, internal->mem );
 }
@@ -416,13 +469,23 @@ static void* jcv_alloc(jcv_context_internal* internal, size_t size)
 {
 	if( !internal->memblocks || internal->memblocks->sizefree < size )
 	{
-		size_t blocksize = 16 * 1024;
-		if( size + sizeof(jcv_memoryblock) > blocksize )
-			blocksize = size + sizeof(jcv_memoryblock);
-
-		jcv_memoryblock* block = (jcv_memoryblock*)internal->alloc( internal->memctx, blocksize );
 		size_t offset = sizeof(jcv_memoryblock);
-		block->sizefree = blocksize - offset;
+		jcv_memoryblock* block = internal->freeblocks;
+		if( block && block->size - offset >= size )
+		{
+			// Reuse a block from a previous generation
+			internal->freeblocks = block->next;
+		}
+		else
+		{
+			size_t blocksize = 16 * 1024;
+			if( size + offset > blocksize )
+				blocksize = size + offset;
+
+			block = (jcv_memoryblock*)internal->alloc( internal->memctx, blocksize );
+			block->size = blocksize;
+		}
+		block->sizefree = block->size - offset;
 		block->next = internal->memblocks;
 		block->memory = ((char*)block) + offset;
 		internal->memblocks = block;
@@ -679,6 +742,7 @@ static void jcv_halfedge_create(jcv_halfedge* he, jcv_edge* e, int dir)
 	he->direction	= dir;
 	he->pqpos		= 0;
 	he->y			= 0;
+	he->hashbucket	= -1;
 	//he->vertex is initialized outside
 }
 
@@ -787,7 +851,7 @@ static int jcv_halfedge_intersect(const jcv_halfedge* he1, const jcv_halfedge* h
 	}
 
 	jcv_real d = e1->a * e2->b - e1->b * e2->a;
-	if( JCV_FABS(d) < (jcv_real)0.00001f )
+	if( JCV_FABS(d) <= JCV_EDGE_INTERSECT_THRESHOLD )
 	{
 		return 0;
 	}
@@ -931,19 +995,67 @@ static inline jcv_site* jcv_nextsite(jcv_context_internal* internal)
 	return (internal->currentsite < internal->numsites) ? &internal->sites[internal->currentsite++] : 0;
 }
 
+#if !defined(JCV_DISABLE_BEACHLINE_HASH)
+
+// A half edge is in at most one bucket, so the bucket can be cleared as soon as the half edge leaves the beach line
+static void jcv_set_hash_edge(jcv_context_internal* internal, int bucket, jcv_halfedge* he)
+{
+	jcv_halfedge* old = internal->beachline_hash[bucket];
+	if( old == he )
+		return;
+	if( old )
+		old->hashbucket = -1;
+	if( he->hashbucket >= 0 )
+		internal->beachline_hash[he->hashbucket] = 0;
+	he->hashbucket = bucket;
+	internal->beachline_hash[bucket] = he;
+}
+
+static void jcv_remove_hash_edge(jcv_context_internal* internal, jcv_halfedge* he)
+{
+	if( he->hashbucket >= 0 )
+	{
+		internal->beachline_hash[he->hashbucket] = 0;
+		he->hashbucket = -1;
+	}
+}
+
+#endif
+
 static jcv_halfedge* jcv_get_edge_above_x(jcv_context_internal* internal, const jcv_point* p)
 {
 	// Gets the arc on the beach line at the x coordinate (i.e. right above the new site event)
 
-	// A good guess it's close by (Can be optimized)
+#if !defined(JCV_DISABLE_BEACHLINE_HASH)
+	// Start the search from a half edge close by, using the bucket of the x coordinate
+	int hashsize = internal->beachline_hashsize;
+	jcv_real width = internal->max.x - internal->min.x;
+	int bucket = width > 0 ? (int)( (p->x - internal->min.x) / width * (jcv_real)hashsize ) : 0;
+	if( bucket < 0 )
+		bucket = 0;
+	if( bucket >= hashsize )
+		bucket = hashsize - 1;
+
+	// The first and last buckets always point to the start and end of the beach line
+	jcv_halfedge* he = internal->beachline_hash[bucket];
+	for( int i = 1; he == 0; ++i )
+	{
+		if( bucket - i >= 0 && (he = internal->beachline_hash[bucket - i]) != 0 )
+			break;
+		if( bucket + i < hashsize && (he = internal->beachline_hash[bucket + i]) != 0 )
+			break;
+	}
+#else
+	// A good guess it's close by
 	jcv_halfedge* he = internal->last_inserted;
-    if( !he )
-    {
-        if( p->x < (internal->max.x - internal->min.x) / 2 )
-            he = internal->beachline_start;
-        else
-            he = internal->beachline_end;
-    }
+	if( !he )
+	{
+		if( p->x < (internal->max.x - internal->min.x) / 2 )
+			he = internal->beachline_start;
+		else
+			he = internal->beachline_end;
+	}
+#endif
 
 	//
 	if( he == internal->beachline_start || (he != internal->beachline_end && jcv_halfedge_rightof(he, p)) )
@@ -963,9 +1075,27 @@ static jcv_halfedge* jcv_get_edge_above_x(jcv_context_internal* internal, const
 		while( he != internal->beachline_start && !jcv_halfedge_rightof(he, p) );
 	}
 
+#if !defined(JCV_DISABLE_BEACHLINE_HASH)
+	if( bucket > 0 && bucket < hashsize - 1 )
+		jcv_set_hash_edge(internal, bucket, he);
+#endif
+
 	return he;
 }
 
+// The y of the sweep line when the circle through the site and the vertex is done, i.e. vertex.y + radius.
+// For almost collinear sites the vertex is far below them, and both terms are large and cancel out
+// (with floats, the event could then end up before one of the site events), so it's site.y + dx^2 / (radius + dy) instead
+static inline jcv_real jcv_circle_event_y(const jcv_point* site, const jcv_point* vertex)
+{
+	jcv_real dx = site->x - vertex->x;
+	jcv_real dy = site->y - vertex->y;
+	jcv_real radius = JCV_SQRT(dx*dx + dy*dy);
+	if( dy > 0 )
+		return site->y + dx * dx / (radius + dy);
+	return vertex->y + radius;
+}
+
 static int jcv_check_circle_event(jcv_halfedge* he1, jcv_halfedge* he2, jcv_point* vertex)
 {
 	jcv_edge* e1 = he1->edge;
@@ -996,20 +1126,22 @@ static void jcv_site_event(jcv_context_internal* internal, jcv_site* site)
 	jcv_halfedge_link(left, edge1);
 	jcv_halfedge_link(edge1, edge2);
 
+#if defined(JCV_DISABLE_BEACHLINE_HASH)
 	internal->last_inserted = edge1;
+#endif
 
 	jcv_point p;
 	if( jcv_check_circle_event( left, edge1, &p ) )
 	{
 		jcv_pq_remove(internal->eventqueue, left);
 		left->vertex 	= p;
-		left->y		 	= p.y + jcv_point_dist(&site->p, &p);
+		left->y		 	= jcv_circle_event_y(&site->p, &p);
 		jcv_pq_push(internal->eventqueue, left);
 	}
 	if( jcv_check_circle_event( edge2, right, &p ) )
 	{
 		edge2->vertex	= p;
-		edge2->y		= p.y + jcv_point_dist(&site->p, &p);
+		edge2->y		= jcv_circle_event_y(&site->p, &p);
 		jcv_pq_push(internal->eventqueue, edge2);
 	}
 }
@@ -1022,34 +1154,77 @@ static inline jcv_real jcv_determinant(const jcv_point* a, const jcv_point* b, c
 static inline jcv_real jcv_calc_sort_metric(const jcv_site* site, const jcv_graphedge* edge)
 {
 	// We take the average of the two points, since we can better distinguish between very small edges
-	float x = (edge->pos[0].x + edge->pos[1].x) * 0.5f;
-	float y = (edge->pos[0].y + edge->pos[1].y) * 0.5f;
-	jcv_real diffy = y - site->p.y;
-	jcv_real angle = JCV_ATAN2( diffy, x - site->p.x );
-	if( diffy < 0 )
-		angle = angle + 2 * JCV_PI;
-	return (jcv_real)angle;
-}
-
-static void jcv_sortedges_insert(jcv_site* site, jcv_graphedge* edge)
-{
-    // Special case for the head end
-    if (site->edges == 0 || site->edges->angle >= edge->angle)
-    {
-        edge->next = site->edges;
-        site->edges = edge;
-    }
-    else
-    {
-        // Locate the node before the point of insertion
-    	jcv_graphedge* current = site->edges;
-        while(current->next != 0 && current->next->angle < edge->angle)
-        {
-            current = current->next;
-        }
-        edge->next = current->next;
-        current->next = edge;
-    }
+	// (Twice the average, since the scale doesn't affect the metric)
+	jcv_real diffx = edge->pos[0].x + edge->pos[1].x - 2 * site->p.x;
+	jcv_real diffy = edge->pos[0].y + edge->pos[1].y - 2 * site->p.y;
+
+	// A pseudo angle, monotonic with the atan2 angle in [0, 2*pi): [0,2] for diffy >= 0, (2,4) for diffy < 0
+	jcv_real sum = JCV_FABS(diffx) + JCV_FABS(diffy);
+	if( sum == 0 )
+		return 0;
+	jcv_real p = diffx / sum;
+	return diffy < 0 ? 3 + p : 1 - p;
+}
+
+static jcv_graphedge* jcv_sortedges_merge(jcv_graphedge* a, jcv_graphedge* b)
+{
+	jcv_graphedge head;
+	jcv_graphedge* tail = &head;
+	while( a && b )
+	{
+		// Stable: for equal angles, keep the order of the list
+		if( b->angle < a->angle )
+		{
+			tail->next = b;
+			b = b->next;
+		}
+		else
+		{
+			tail->next = a;
+			a = a->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = a ? a : b;
+	return head.next;
+}
+
+// Merge sort of the linked list, by angle
+static jcv_graphedge* jcv_sortedges(jcv_graphedge* list)
+{
+	if( !list || !list->next )
+		return list;
+
+	jcv_graphedge* slow = list;
+	jcv_graphedge* fast = list->next;
+	while( fast && fast->next )
+	{
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	jcv_graphedge* second = slow->next;
+	slow->next = 0;
+
+	return jcv_sortedges_merge(jcv_sortedges(list), jcv_sortedges(second));
+}
+
+// The graph edges are added unsorted, so we sort them once all edges are done
+static void jcv_sortedges_all(jcv_context_internal* internal)
+{
+	for( int i = 0; i < internal->numsites; ++i )
+	{
+		jcv_site* site = &internal->sites[i];
+		site->edges = jcv_sortedges(site->edges);
+
+		// check that we didn't accidentally add a duplicate (rare), then remove it
+		for( jcv_graphedge* ge = site->edges; ge && ge->next; ge = ge->next )
+		{
+			if( ge->angle == ge->next->angle && jcv_point_eq( &ge->pos[0], &ge->next->pos[0] ) && jcv_point_eq( &ge->pos[1], &ge->next->pos[1] ) )
+			{
+				ge->next = ge->next->next; // Throw it away, they're so few anyways
+			}
+		}
+	}
 }
 
 static void jcv_finishline(jcv_context_internal* internal, jcv_edge* e)
@@ -1068,22 +1243,14 @@ static void jcv_finishline(jcv_context_internal* internal, jcv_edge* e)
         jcv_graphedge* ge = jcv_alloc_graphedge(internal);
 
 		ge->edge = e;
-		ge->next = 0;
 		ge->neighbor = e->sites[1-i];
 		ge->pos[flip] = e->pos[i];
 		ge->pos[1-flip] = e->pos[1-i];
 		ge->angle = jcv_calc_sort_metric(e->sites[i], ge);
 
-		jcv_sortedges_insert( e->sites[i], ge );
-
-		// check that we didn't accidentally add a duplicate (rare), then remove it
-		if( ge->next && ge->angle == ge->next->angle )
-		{
-			if( jcv_point_eq( &ge->pos[0], &ge->next->pos[0] ) && jcv_point_eq( &ge->pos[1], &ge->next->pos[1] ) )
-			{
-				ge->next = ge->next->next; // Throw it away, they're so few anyways
-			}
-		}
+		// Sorted later, in jcv_sortedges_all()
+		ge->next = e->sites[i]->edges;
+		e->sites[i]->edges = ge;
 	}
 }
 
@@ -1228,16 +1395,21 @@ static void jcv_circle_event(jcv_context_internal* internal)
 	jcv_endpos(internal, left->edge, &vertex, left->direction);
 	jcv_endpos(internal, right->edge, &vertex, right->direction);
 
+#if defined(JCV_DISABLE_BEACHLINE_HASH)
 	if( internal->last_inserted == left )
 		internal->last_inserted = leftleft;
 	else if( internal->last_inserted == right )
 		internal->last_inserted = rightright;
+#else
+	jcv_remove_hash_edge(internal, left);
+	jcv_remove_hash_edge(internal, right);
+#endif
 
 	jcv_pq_remove(internal->eventqueue, right);
 	jcv_halfedge_unlink(left);
 	jcv_halfedge_unlink(right);
-    jcv_halfedge_delete(internal, left);
-    jcv_halfedge_delete(internal, right);
+	jcv_halfedge_delete(internal, left);
+	jcv_halfedge_delete(internal, right);
 
 	int direction = JCV_DIRECTION_LEFT;
 	if( bottom->p.y > top->p.y )
@@ -1261,13 +1433,13 @@ static void jcv_circle_event(jcv_context_internal* internal)
 	{
 		jcv_pq_remove(internal->eventqueue, leftleft);
 		leftleft->vertex 	= p;
-		leftleft->y		 	= p.y + jcv_point_dist(&bottom->p, &p);
+		leftleft->y		 	= jcv_circle_event_y(&bottom->p, &p);
 		jcv_pq_push(internal->eventqueue, leftleft);
 	}
 	if( jcv_check_circle_event( he, rightright, &p ) )
 	{
 		he->vertex 		= p;
-		he->y		 	= p.y + jcv_point_dist(&bottom->p, &p);
+		he->y		 	= jcv_circle_event_y(&bottom->p, &p);
 		jcv_pq_push(internal->eventqueue, he);
 	}
 }
@@ -1288,10 +1460,10 @@ static inline void _jcv_calc_bounds(int num_points, const jcv_point* points, jcv
 		else if( points[i].y > _max.y )
 			_max.y = points[i].y;
 	}
-	min->x = floorf(_min.x);
-	min->y = floorf(_min.y);
-	max->x = ceilf(_max.x);
-	max->y = ceilf(_max.y);
+	min->x = JCV_FLOOR(_min.x);
+	min->y = JCV_FLOOR(_min.y);
+	max->x = JCV_CEIL(_max.x);
+	max->y = JCV_CEIL(_max.y);
 }
 
 void jcv_diagram_generate( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* d )
@@ -1305,14 +1477,104 @@ typedef union _jcv_cast_align_struct
 	void**	voidpp;
 } jcv_cast_align_struct;
 
-void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* d )
+#if !defined(JCV_DISABLE_RADIX_SORT)
+
+// Maps the bits of a jcv_real to an unsigned key with the same ordering (negative values get all bits flipped, positive values get the sign bit flipped)
+static inline unsigned long long jcv_radix_key( jcv_real v )
 {
-	if( d->internal )
-		jcv_diagram_free( d );
+	if( sizeof(jcv_real) == 4 )
+	{
+		unsigned int bits;
+		memcpy(&bits, &v, sizeof(bits));
+		unsigned int mask = (bits & 0x80000000u) ? 0xFFFFFFFFu : 0x80000000u;
+		return bits ^ mask;
+	}
+	else
+	{
+		unsigned long long bits;
+		memcpy(&bits, &v, sizeof(bits));
+		unsigned long long mask = (bits & 0x8000000000000000ull) ? 0xFFFFFFFFFFFFFFFFull : 0x8000000000000000ull;
+		return bits ^ mask;
+	}
+}
+
+#define JCV_RADIX_NUM_KEY_BYTES (int)(2*sizeof(jcv_real))
+
+static inline unsigned int jcv_radix_digit( const jcv_site* site, int pass )
+{
+	// The first passes use x, the last passes use y, since y is the most significant
+	int shift = 8 * (pass % (int)sizeof(jcv_real));
+	jcv_real v = pass < (int)sizeof(jcv_real) ? site->p.x : site->p.y;
+	return (unsigned int)(jcv_radix_key(v) >> shift) & 0xFF;
+}
+
+// LSD radix sort on (y, x), using 8 bit digits. Gives the same order as qsort() with jcv_point_cmp
+static void jcv_radix_sort_sites( jcv_site* sites, jcv_site* scratch, int num_sites )
+{
+	int counts[JCV_RADIX_NUM_KEY_BYTES][256];
+	memset(counts, 0, sizeof(counts));
+
+	for( int i = 0; i < num_sites; ++i )
+	{
+		for( int pass = 0; pass < JCV_RADIX_NUM_KEY_BYTES; ++pass )
+			counts[pass][jcv_radix_digit(&sites[i], pass)]++;
+	}
+
+	jcv_site* src = sites;
+	jcv_site* dst = scratch;
+	for( int pass = 0; pass < JCV_RADIX_NUM_KEY_BYTES; ++pass )
+	{
+		int* count = counts[pass];
+
+		// Skip the passes where all the keys have the same digit
+		if( count[jcv_radix_digit(&src[0], pass)] == num_sites )
+			continue;
+
+		int offset = 0;
+		for( int i = 0; i < 256; ++i )
+		{
+			int c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+
+		for( int i = 0; i < num_sites; ++i )
+			dst[count[jcv_radix_digit(&src[i], pass)]++] = src[i];
 
+		jcv_site* tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if( src != sites )
+		memcpy(sites, src, sizeof(jcv_site) * (size_t)num_sites);
+}
+
+#endif
+
+static void jcv_sort_sites( jcv_context_internal* internal, int num_points )
+{
+#if !defined(JCV_DISABLE_RADIX_SORT)
+	if( num_points >= JCV_RADIX_SORT_THRESHOLD )
+	{
+		jcv_radix_sort_sites(internal->sites, internal->sitesscratch, num_points);
+		return;
+	}
+#endif
+	qsort(internal->sites, (size_t)num_points, sizeof(jcv_site), jcv_point_cmp);
+}
+
+static jcv_context_internal* jcv_alloc_internal( int num_points, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn )
+{
 	int max_num_events = num_points*2; // beachline can have max 2*n-5 parabolas
 	size_t sitessize = (size_t)num_points * sizeof(jcv_site);
-	size_t memsize = 8u + (size_t)max_num_events * sizeof(void*) + sizeof(jcv_priorityqueue) + sitessize + sizeof(jcv_context_internal);
+	size_t scratchsize = 0;
+#if !defined(JCV_DISABLE_RADIX_SORT)
+	if( num_points >= JCV_RADIX_SORT_THRESHOLD )
+		scratchsize = sitessize;
+#endif
+	int hashcapacity = 2 * (int)JCV_SQRT((jcv_real)num_points) + 2;
+	size_t memsize = 8u + (size_t)max_num_events * sizeof(void*) + (size_t)hashcapacity * sizeof(void*) + sizeof(jcv_priorityqueue) + sitessize + scratchsize + sizeof(jcv_context_internal);
 
 	char* originalmem = (char*)allocfn(userallocctx, memsize);
 	memset(originalmem, 0, memsize);
@@ -1327,6 +1589,48 @@ void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, co
 	internal->memctx = userallocctx;
 	internal->alloc  = allocfn;
 	internal->free   = freefn;
+	internal->maxnumsites = num_points;
+
+	internal->sites = (jcv_site*) mem;
+	mem += sitessize;
+
+	internal->sitesscratch = scratchsize ? (jcv_site*) mem : 0;
+	mem += scratchsize;
+
+	internal->eventqueue = (jcv_priorityqueue*)mem;
+	mem += sizeof(jcv_priorityqueue);
+
+	jcv_cast_align_struct tmp;
+	tmp.charp = mem;
+	internal->eventmem = tmp.voidpp;
+	mem += (size_t)max_num_events * sizeof(void*);
+
+	tmp.charp = mem;
+	internal->beachline_hash = (jcv_halfedge**)tmp.voidpp;
+	internal->beachline_hashcapacity = hashcapacity;
+
+	return internal;
+}
+
+// Makes all the memory blocks available for the next generation
+static void jcv_reset_internal( jcv_context_internal* internal )
+{
+	while( internal->memblocks )
+	{
+		jcv_memoryblock* block = internal->memblocks;
+		internal->memblocks = block->next;
+		block->next = internal->freeblocks;
+		internal->freeblocks = block;
+	}
+
+	internal->edges			= 0;
+	internal->edgepool		= 0;
+	internal->halfedgepool	= 0;
+}
+
+static void jcv_diagram_generate_internal( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* d )
+{
+	jcv_context_internal* internal = d->internal;
 
 	internal->beachline_start = jcv_alloc_halfedge(internal);
 	internal->beachline_end	= jcv_alloc_halfedge(internal);
@@ -1340,16 +1644,7 @@ void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, co
 
 	internal->last_inserted = 0;
 
-	internal->sites = (jcv_site*) mem;
-	mem += sitessize;
-
-	internal->eventqueue = (jcv_priorityqueue*)mem;
-	mem += sizeof(jcv_priorityqueue);
-
-	jcv_cast_align_struct tmp;
-	tmp.charp = mem;
-	internal->eventmem = tmp.voidpp;
-
+	int max_num_events = num_points*2; // beachline can have max 2*n-5 parabolas
 	jcv_pq_create(internal->eventqueue, max_num_events, (void**)internal->eventmem,
 						(FJCVPriorityQueueCompare)jcv_halfedge_compare,
 						(FJCVPriorityQueueSetpos)jcv_halfedge_setpos,
@@ -1362,7 +1657,7 @@ void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, co
 		internal->sites[i].index	= i;
 	}
 
-	qsort(internal->sites, (size_t)num_points, sizeof(jcv_site), jcv_point_cmp);
+	jcv_sort_sites(internal, num_points);
 
 	int offset = 0;
 	for (int i = 0; i < num_points; i++)
@@ -1412,6 +1707,12 @@ void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, co
 	internal->numsites_sqrt	= (int)(JCV_SQRT((jcv_real)num_points));
 	internal->currentsite 	= 0;
 
+	internal->beachline_hashsize = 2 * internal->numsites_sqrt + 2;
+	assert( internal->beachline_hashsize <= internal->beachline_hashcapacity );
+	memset(internal->beachline_hash, 0, sizeof(jcv_halfedge*) * (size_t)internal->beachline_hashsize);
+	internal->beachline_hash[0] = internal->beachline_start;
+	internal->beachline_hash[internal->beachline_hashsize - 1] = internal->beachline_end;
+
 	internal->bottomsite = jcv_nextsite(internal);
 
 	jcv_site* site = jcv_nextsite(internal);
@@ -1447,9 +1748,43 @@ void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, co
 		jcv_finishline(internal, he->edge);
 	}
 
+	jcv_sortedges_all(internal);
 	jcv_fillgaps(d);
 }
 
+void jcv_diagram_generate_useralloc( int num_points, const jcv_point* points, const jcv_rect* rect, void* userallocctx, FJCVAllocFn allocfn, FJCVFreeFn freefn, jcv_diagram* d )
+{
+	if( d->internal )
+		jcv_diagram_free( d );
+
+	d->internal = jcv_alloc_internal(num_points, userallocctx, allocfn, freefn);
+	jcv_diagram_generate_internal(num_points, points, rect, d);
+}
+
+void jcv_diagram_regenerate( int num_points, const jcv_point* points, const jcv_rect* rect, jcv_diagram* d )
+{
+	jcv_context_internal* internal = d->internal;
+	if( !internal )
+	{
+		jcv_diagram_generate(num_points, points, rect, d);
+		return;
+	}
+
+	jcv_reset_internal(internal);
+
+	if( internal->maxnumsites < num_points )
+	{
+		// The sites and events need a larger block, but we keep the memory blocks
+		jcv_context_internal* newinternal = jcv_alloc_internal(num_points, internal->memctx, internal->alloc, internal->free);
+		newinternal->freeblocks = internal->freeblocks;
+		internal->freeblocks = 0;
+		jcv_diagram_free(d);
+		d->internal = newinternal;
+	}
+
+	jcv_diagram_generate_internal(num_points, points, rect, d);
+}
+
 #endif // JC_VORONOI_IMPLEMENTATION
 
 
@@ -0,0 +1,173 @@
+// Tests and benchmarks the voronoi diagram generation.
+// Build it with different JCV_ defines (see test_voronoi.sh), the printed checksums should be the same as in the reference build with the same JCV_REAL_TYPE.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define JC_VORONOI_IMPLEMENTATION
+#include "jc_voronoi.h"
+
+static const float WIDTH = 4096.0f;
+static const float HEIGHT = 4096.0f;
+static const double ANGLE_EPSILON = 1e-4;   // The midpoints of nearly zero length edges are only float precise
+static const double CLOSED_EPSILON = 0.05;  // Nearly parallel edges in float are a few hundredths off at these coordinates
+
+static uint32_t g_Seed = 0;
+
+static uint32_t test_rand()
+{
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return g_Seed >> 8;
+}
+
+static float test_randf(float max)
+{
+    return (float)test_rand() / (float)(1 << 24) * max;
+}
+
+static double test_time()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+struct SStats
+{
+    uint64_t    checksum;
+    int         numsites;
+    int         open;       // Edges that don't end where the next edge of the cell starts
+    int         unsorted;   // Cells where the edges are not in CCW order (by their atan2 angle around the site)
+    double      area;       // The total area of the cells
+};
+
+static void check_diagram(const jcv_diagram* diagram, SStats* stats)
+{
+    memset(stats, 0, sizeof(SStats));
+    stats->checksum = 14695981039346656037ull;
+    stats->numsites = diagram->numsites;
+
+    const jcv_site* sites = jcv_diagram_get_sites(diagram);
+    for (int i = 0; i < diagram->numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        // Not the index, since the sorting may keep any of the duplicate points
+        stats->checksum = hash_bytes(stats->checksum, &site->p, sizeof(site->p));
+
+        double area = 0;
+        double first_angle = 0;
+        double prev_angle = 0;
+        int descents = 0;
+        for (const jcv_graphedge* e = site->edges; e; e = e->next)
+        {
+            // The edges are sorted with a pseudo angle, which should give the same order as the atan2 angle in [0, 2*pi).
+            // The border gaps are inserted after the sorting, between their neighbours, so the order is only CCW around the cell,
+            // i.e. the angle only goes down once (counting the step from the last edge back to the first)
+            double dx = ((double)e->pos[0].x + (double)e->pos[1].x) * 0.5 - (double)site->p.x;
+            double dy = ((double)e->pos[0].y + (double)e->pos[1].y) * 0.5 - (double)site->p.y;
+            double angle = atan2(dy, dx);
+            if (dy < 0)
+                angle += 2 * M_PI;
+            if (dx == 0 && dy == 0)
+                angle = prev_angle; // A border edge through a site on the border has no angle
+            if (e == site->edges)
+                first_angle = angle;
+            else if (angle < prev_angle - ANGLE_EPSILON)
+                descents++;
+            prev_angle = angle;
+
+            const jcv_graphedge* next = e->next ? e->next : site->edges;
+            // The clipping computes the end points from the line equation, so they aren't always bit exact
+            if (fabs((double)e->pos[1].x - (double)next->pos[0].x) > CLOSED_EPSILON || fabs((double)e->pos[1].y - (double)next->pos[0].y) > CLOSED_EPSILON)
+                stats->open++;
+
+            area += (double)e->pos[0].x * (double)e->pos[1].y - (double)e->pos[1].x * (double)e->pos[0].y;
+            stats->checksum = hash_bytes(stats->checksum, e->pos, sizeof(e->pos));
+        }
+        stats->area += area * 0.5;
+        if (site->edges && first_angle < prev_angle - ANGLE_EPSILON)
+            descents++;
+        if (descents > 1)
+            stats->unsorted++;
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    // The largest number of sites to test
+    int maxcount = argc > 1 ? atoi(argv[1]) : 100000;
+
+    jcv_rect rect = { { 0, 0 }, { WIDTH, HEIGHT } };
+    int failed = 0;
+    for (int count = 10000; count <= maxcount; count *= 10)
+    for (int integer = 0; integer < 2; ++integer)
+    {
+        // The integer points have many duplicates (which are removed by the sorting), and many cocircular points
+        jcv_point* points = (jcv_point*)malloc(sizeof(jcv_point) * (size_t)count);
+        g_Seed = (uint32_t)count;
+        for (int i = 0; i < count; ++i)
+        {
+            points[i].x = integer ? floorf(test_randf(WIDTH / 16)) * 16 : test_randf(WIDTH);
+            points[i].y = integer ? floorf(test_randf(HEIGHT / 16)) * 16 : test_randf(HEIGHT);
+        }
+
+        // The best of a few runs
+        int numruns = count >= 1000000 ? 2 : 5;
+        double best = 0;
+        jcv_diagram diagram;
+        memset(&diagram, 0, sizeof(jcv_diagram));
+        for (int run = 0; run < numruns; ++run)
+        {
+            double t = test_time();
+            jcv_diagram_generate(count, points, &rect, &diagram);
+            t = test_time() - t;
+            if (run == 0 || t < best)
+                best = t;
+        }
+
+        SStats stats;
+        check_diagram(&diagram, &stats);
+        double area = stats.area / (double)(WIDTH * HEIGHT);
+
+        printf("%8d %s sites  checksum %016llx  cells %d  open %d  unsorted %d  area %.6f  time %.2f ms\n", count, integer ? "integer" : "uniform",
+                (unsigned long long)stats.checksum, stats.numsites, stats.open, stats.unsorted, area, best * 1000.0);
+
+        if (stats.open != 0 || stats.unsorted != 0 || fabs(area - 1.0) > 1e-4)
+            failed = 1;
+
+        jcv_diagram_free(&diagram);
+        free(points);
+    }
+
+    // Three sites at almost the same y (from a relaxed 1024x1024 map), their circle event is far below the rect.
+    // It used to be computed after the next site event in float, which broke the beach line
+    {
+        jcv_point points[] = { {65.9846573f, 2.77719569f}, {42.0091209f, 572.004456f}, {346.287231f, 2.87834167f},
+                               {708.255371f, 2.77376938f}, {676.150879f, 2.77532125f} };
+        jcv_rect collinear_rect = { { 0, 0 }, { 1024, 1024 } };
+        jcv_diagram diagram;
+        memset(&diagram, 0, sizeof(jcv_diagram));
+        jcv_diagram_generate(5, points, &collinear_rect, &diagram);
+
+        SStats stats;
+        check_diagram(&diagram, &stats);
+        double area = stats.area / (1024.0 * 1024.0);
+        printf("%8d collinear sites  cells %d  open %d  unsorted %d  area %.6f\n", 5, stats.numsites, stats.open, stats.unsorted, area);
+        if (stats.open != 0 || stats.unsorted != 0 || fabs(area - 1.0) > 1e-4)
+            failed = 1;
+        jcv_diagram_free(&diagram);
+    }
+    return failed;
+}
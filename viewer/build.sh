@@ -17,6 +17,14 @@ LDFLAGS=""
 BUILDDIR="./build"
 TARGET="viewer"
 
+# VORONOI=double generates the voronoi diagram with doubles, VORONOI=snapped also snaps the sites
+# to a 1/256 pixel grid (see mapmaker.h)
+if [ "$VORONOI" == "double" ]; then
+    CCFLAGS="$CCFLAGS -DMAPMAKER_VORONOI_DOUBLE"
+elif [ "$VORONOI" == "snapped" ]; then
+    CCFLAGS="$CCFLAGS -DMAPMAKER_VORONOI_SNAP=256"
+fi
+
 mkdir -p $BUILDDIR
 
 if [ "$PLATFORM" == "darwin" ]; then
@@ -45,7 +53,8 @@ else
     echo "$LIBRARYHELP already Exists!"
 fi
 
+$CXX $OPT $CXXFLAGS $CCFLAGS jobs.cpp -o $BUILDDIR/jobs.o
 $CXX $OPT $CXXFLAGS $CCFLAGS mapmaker.cpp -o $BUILDDIR/mapmaker.o
 $CXX $OPT $CXXFLAGS $CCFLAGS viewer.cpp -o $BUILDDIR/viewer.o
 
-$CXX $OPT $LDFLAGS $FRAMEWORKS -o $BUILDDIR/$TARGET -L$BUILDDIR -lhelp_$PLATFORM $BUILDDIR/viewer.o $BUILDDIR/mapmaker.o
+$CXX $OPT $LDFLAGS $FRAMEWORKS -o $BUILDDIR/$TARGET -L$BUILDDIR -lhelp_$PLATFORM $BUILDDIR/viewer.o $BUILDDIR/mapmaker.o $BUILDDIR/jobs.o
@@ -0,0 +1,171 @@
+#include "jobs.h"
+#include <assert.h>
+
+#if defined(_WIN32) || (defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__))
+    #define JOBS_SERIAL
+#endif
+
+#if defined(JOBS_SERIAL)
+
+void JobsInit(int num_threads)
+{
+    (void)num_threads;
+}
+
+void JobsShutdown()
+{
+}
+
+int JobsNumThreads()
+{
+    return 1;
+}
+
+static bool g_JobsRunning = false;  // Inside JobsParallelFor, which isn't re-entrant
+
+void JobsParallelFor(int count, FJobFn fn, void* ctx)
+{
+    assert(!g_JobsRunning && "JobsParallelFor can't be called from a job");
+    g_JobsRunning = true;
+    for (int i = 0; i < count; ++i)
+        fn(ctx, i);
+    g_JobsRunning = false;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define JOBS_MAX_THREADS 64
+
+static pthread_t        g_JobsThreads[JOBS_MAX_THREADS];
+static int              g_JobsNumWorkers = 0;
+static pthread_mutex_t  g_JobsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_JobsWake = PTHREAD_COND_INITIALIZER;  // A new job, or quit
+static pthread_cond_t   g_JobsDone = PTHREAD_COND_INITIALIZER;  // A worker finished
+
+// The current job. Only changed when no worker is active
+static FJobFn           g_JobFn = 0;
+static void*            g_JobCtx = 0;
+static int              g_JobCount = 0;
+static volatile int     g_JobNext = 0;      // The next index to run
+static int              g_JobGeneration = 0;
+static int              g_JobsActive = 0;   // Workers currently running the job
+static bool             g_JobsQuit = false;
+static volatile bool    g_JobsRunning = false;  // Inside JobsParallelFor, which isn't re-entrant
+
+// Runs indices of the current job until there are no more left
+static void RunJobs(FJobFn fn, void* ctx, int count)
+{
+    while (true)
+    {
+        int index = __sync_fetch_and_add(&g_JobNext, 1);
+        if (index >= count)
+            break;
+        fn(ctx, index);
+    }
+}
+
+static void* WorkerThread(void*)
+{
+    int generation = 0;
+    pthread_mutex_lock(&g_JobsMutex);
+    while (true)
+    {
+        while (!g_JobsQuit && generation == g_JobGeneration)
+            pthread_cond_wait(&g_JobsWake, &g_JobsMutex);
+        if (g_JobsQuit)
+            break;
+
+        generation = g_JobGeneration;
+        FJobFn fn = g_JobFn;
+        void* ctx = g_JobCtx;
+        int count = g_JobCount;
+        g_JobsActive++;
+        pthread_mutex_unlock(&g_JobsMutex);
+
+        RunJobs(fn, ctx, count);
+
+        pthread_mutex_lock(&g_JobsMutex);
+        g_JobsActive--;
+        pthread_cond_signal(&g_JobsDone);
+    }
+    pthread_mutex_unlock(&g_JobsMutex);
+    return 0;
+}
+
+void JobsInit(int num_threads)
+{
+    JobsShutdown();
+
+    if (num_threads <= 0)
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > JOBS_MAX_THREADS + 1)
+        num_threads = JOBS_MAX_THREADS + 1;
+
+    g_JobsQuit = false;
+    for (int i = 0; i < num_threads - 1; ++i)
+    {
+        if (pthread_create(&g_JobsThreads[g_JobsNumWorkers], 0, WorkerThread, 0) != 0)
+            break;
+        g_JobsNumWorkers++;
+    }
+}
+
+void JobsShutdown()
+{
+    pthread_mutex_lock(&g_JobsMutex);
+    g_JobsQuit = true;
+    pthread_cond_broadcast(&g_JobsWake);
+    pthread_mutex_unlock(&g_JobsMutex);
+
+    for (int i = 0; i < g_JobsNumWorkers; ++i)
+        pthread_join(g_JobsThreads[i], 0);
+    g_JobsNumWorkers = 0;
+}
+
+int JobsNumThreads()
+{
+    return g_JobsNumWorkers + 1;
+}
+
+void JobsParallelFor(int count, FJobFn fn, void* ctx)
+{
+    // A nested call would replace the running job, and wait for the workers that are running it
+    assert(!g_JobsRunning && "JobsParallelFor can't be called from a job");
+    g_JobsRunning = true;
+
+    if (g_JobsNumWorkers == 0 || count <= 1)
+    {
+        for (int i = 0; i < count; ++i)
+            fn(ctx, i);
+        g_JobsRunning = false;
+        return;
+    }
+
+    pthread_mutex_lock(&g_JobsMutex);
+    // A worker that woke up late may still be looking at the previous job
+    while (g_JobsActive > 0)
+        pthread_cond_wait(&g_JobsDone, &g_JobsMutex);
+
+    g_JobFn = fn;
+    g_JobCtx = ctx;
+    g_JobCount = count;
+    g_JobNext = 0;
+    g_JobGeneration++;
+    pthread_cond_broadcast(&g_JobsWake);
+    pthread_mutex_unlock(&g_JobsMutex);
+
+    RunJobs(fn, ctx, count);
+
+    // All indices are taken, wait for the workers to finish theirs
+    pthread_mutex_lock(&g_JobsMutex);
+    while (g_JobsActive > 0)
+        pthread_cond_wait(&g_JobsDone, &g_JobsMutex);
+    pthread_mutex_unlock(&g_JobsMutex);
+
+    g_JobsRunning = false;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+// A small pool of worker threads, for splitting the map generation into parallel jobs.
+// If the platform has no threads (e.g. html5 built without pthreads), the jobs run on the calling thread.
+
+typedef void (*FJobFn)(void* ctx, int index);
+
+// Starts the worker threads. A num_threads of 0 uses one thread per core.
+// The calling thread also runs jobs, so num_threads == 1 starts no workers.
+void JobsInit(int num_threads);
+void JobsShutdown();
+
+// The number of threads running the jobs (including the calling thread)
+int JobsNumThreads();
+
+// Calls fn(ctx, i) for each i in [0, count), and returns when all calls are done.
+// The calls are made in any order, from any of the threads.
+// It is not re-entrant: it must only be called from one thread (e.g. the main thread), and not
+// from inside a job, since the pool runs one job at a time (this is asserted).
+void JobsParallelFor(int count, FJobFn fn, void* ctx);
@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 #include <stdio.h> // printf
+#include <float.h>
+#include <assert.h>
 
 #define JC_NOISE_IMPLEMENTATION
 #include "jc_noise.h"
@@ -12,19 +14,23 @@
 // #include "jc_mapmaker_noise.h"
 
 #include "mapmaker.h"
+#include "jobs.h"
+#include "jc_draw.h"
 
 SVoronoiParameters::SVoronoiParameters()
 {
     seed = 1337;
     generation_type = 0;
     border = 35;
-    num_cells = 1024;        // for random
+    num_cells = 1024;        // for random and poisson disc
     num_relaxations = 20;    // for random
+    relax_epsilon = 0.1f;    // for random
     hexagon_density = 26;
 }
 
 SNoiseParameters::SNoiseParameters()
 {
+    seed = 0;
     fbm_octaves = 5;
     fbm_frequency = 1.0f;
     fbm_lacunarity = 2.0f;
@@ -51,6 +57,7 @@ SNoiseParameters::SNoiseParameters()
     use_erosion = false;
     erode_type = 0;
     erode_iterations = 0;
+    erode_multigrid = false;
 
     // hydraulic
     erode_rain_amount = 0.15f;
@@ -61,6 +68,13 @@ SNoiseParameters::SNoiseParameters()
     // thermal
     erode_thermal_talus = 8;
 
+    // flow
+    erode_flow_carve = 0.1f;
+
+    // droplets
+    erode_droplets = 70000;
+    erode_droplet_radius = 3;
+
     apply_radial = true;
     radial_falloff = 0.20f;
 };
@@ -73,19 +87,49 @@ SMapParameters::SMapParameters()
     sea_level   = 110;
 
     use_shading = true;
-    light_dir[0]= 2;
+    // towards the light (top left), 30 degrees above the horizon
+    light_dir[0]= -1;
     light_dir[1]= -1;
-    light_dir[2]= 2;
+    light_dir[2]= 0.8165f;
 
-    shadow_step_length = 8;
+    shadow_step_length = 8;     // in steps along the light direction
     shadow_strength = 0.15f;
     shadow_strength_sea = 0.03f;
+
+    river_flow = 16;
+    shallow_distance = 2;
 };
 
+SVoronoiGraph::SVoronoiGraph()
+: num_cells(0)
+, num_edges(0)
+, num_open_edges(0)
+, offsets(0)
+, vertices(0)
+, neighbors(0)
+, capacity_cells(0)
+, capacity_edges(0)
+{
+}
+
 SMap::SMap()
 : points(0)
-, voronoi(0)
-, cells(0)
+, graph(0)
+, cell_ids(0)
+, elevation_min(0)
+, elevation_mean(0)
+, elevation_max(0)
+, is_border(0)
+, is_land(0)
+, is_shallow(0)
+, is_ocean(0)
+, is_river(0)
+, downslope(0)
+, coast_distance(0)
+, coast_distance_pixels(0)
+, flow(0)
+, moisture(0)
+, biome(0)
 , num_cells(0)
 {
 }
@@ -107,7 +151,7 @@ static SNoiseParameters     g_NoiseParams;
 static SMapParameters       g_MapParams;
 static jcn_context*         g_NoiseCtx = 0;
 
-static jcv_diagram* g_VoronoiDiagram = 0;
+static SVoronoiGraph g_VoronoiGraph;
 static jcv_point*   g_VoronoiPoints = 0;
 static int          g_VoronoiNumPoints = 0;
 
@@ -125,6 +169,21 @@ static inline int Clampi(int a, int b, int v)
     return v < a ? a : (v > b ? b : v);
 }
 
+// The noise values in [-1, 1] as fixed point heights (the plain noise is in [0, 1], the perturbed noise in [-1, 1])
+static inline height_t NoiseToHeight(float n)
+{
+    if (!(n > -1.0f)) // and NaN (e.g. a fractional power of a negative value)
+        n = -1.0f;
+    if (n > 1.0f)
+        n = 1.0f;
+    return (height_t)((n + 1.0f) * (0.5f * MAPMAKER_HEIGHT_MAX) + 0.5f);
+}
+
+static inline float HeightToNoise(height_t h)
+{
+    return h * (2.0f / MAPMAKER_HEIGHT_MAX) - 1.0f;
+}
+
 
 void UpdateParams(const SVoronoiParameters* voronoi, const SNoiseParameters* noise, const SMapParameters* map)
 {
@@ -193,42 +252,23 @@ static float ModifyValue(float n, int modify_type)
 // Noise generation ideas:
 // Voronoi: http://web.mit.edu/cesium/Public/terrain.pdf
 
-void GenerateNoise(float* noisef, int modify_type)
+static float SampleNoise(jcn_real x, jcn_real y, int modify_type)
 {
-    for( int y = 0; y < g_MapParams.height; ++y )
-    {
-        for( int x = 0; x < g_MapParams.width; ++x )
-        {
-            jcn_real n = fbm(x, y);
-            n = jcn_remap(n, -1.0f, 1.0f, 0.0f, 1.0f);
-
-            n = ModifyValue(n, modify_type);
-
-            noisef[y * g_MapParams.width + x] = n;
-        }
-    }
+    jcn_real n = fbm(x, y);
+    n = jcn_remap(n, -1.0f, 1.0f, 0.0f, 1.0f);
+    return ModifyValue(n, modify_type);
 }
 
-void Perturb1(int w, int h, float* noisef)
+static float SamplePerturb1(jcn_real x, jcn_real y, int modify_type)
 {
-    int modify_type = g_NoiseParams.noise_modify_type;
-    for( int y = 0; y < w; ++y )
-    {
-        for( int x = 0; x < h; ++x )
-        {
-            jcn_real qx = fbm( x, y );
-            jcn_real qy = fbm( x + g_NoiseParams.perturb1_a1, y + g_NoiseParams.perturb1_a2 );
-            float n = fbm(x + g_NoiseParams.perturb1_scale * qx, y + g_NoiseParams.perturb1_scale * qy );
-            noisef[y*w + x] = ModifyValue(n, modify_type);
-        }
-    }
+    jcn_real qx = fbm( x, y );
+    jcn_real qy = fbm( x + g_NoiseParams.perturb1_a1, y + g_NoiseParams.perturb1_a2 );
+    float n = fbm(x + g_NoiseParams.perturb1_scale * qx, y + g_NoiseParams.perturb1_scale * qy );
+    return ModifyValue(n, modify_type);
 }
 
-
-void Perturb2(int w, int h, float* noisef)
+static float SamplePerturb2(jcn_real x, jcn_real y, int modify_type)
 {
-    int modify_type = g_NoiseParams.noise_modify_type;
-
     float scale = g_NoiseParams.perturb2_scale;
     float qyx = g_NoiseParams.perturb2_qyx;
     float qyy = g_NoiseParams.perturb2_qyy;
@@ -236,15 +276,12 @@ void Perturb2(int w, int h, float* noisef)
     float rxy = g_NoiseParams.perturb2_rxy;
     float ryx = g_NoiseParams.perturb2_ryx;
     float ryy = g_NoiseParams.perturb2_ryy;
-    for( int y = 0; y < w; ++y )
-    {
-        for( int x = 0; x < h; ++x )
-        {
-            float qx = fbm( x, y );
-            float qy = fbm( x + qyx * scale, y + qyy * scale );
 
-            float rx = fbm( x + 4.0f * scale * qx + rxx * scale, y + 4.0f * scale * qy + rxy * scale );
-            float ry = fbm( x + 4.0f * scale * qx + ryx * scale, y + 4.0f * scale * qy + ryy * scale );
+    float qx = fbm( x, y );
+    float qy = fbm( x + qyx * scale, y + qyy * scale );
+
+    float rx = fbm( x + 4.0f * scale * qx + rxx * scale, y + 4.0f * scale * qy + rxy * scale );
+    float ry = fbm( x + 4.0f * scale * qx + ryx * scale, y + 4.0f * scale * qy + ryy * scale );
 
     // jcn_real qx = fbm( x, y );
     // jcn_real qy = fbm( x + 5.2f * scale, y + 1.3f * scale );
@@ -253,8 +290,42 @@ void Perturb2(int w, int h, float* noisef)
     // jcn_real ry = fbm( x + 4.0f * scale * qx + 8.3f * scale, y + 4.0f * scale * qy + 2.8f * scale );
 
     // return fbm(x + 4.0f * scale * rx, y + 4.0f * scale * ry );
-            float n = fbm(x + 4.0f * scale * rx, y + 4.0f * scale * ry );
-            noisef[y*w + x] = ModifyValue(n, modify_type);
+    float n = fbm(x + 4.0f * scale * rx, y + 4.0f * scale * ry );
+    return ModifyValue(n, modify_type);
+}
+
+void GenerateNoiseRows(height_t* heights, int y_start, int y_end, int step)
+{
+    int width = g_MapParams.width;
+    int height = g_MapParams.height;
+    int modify_type = g_NoiseParams.noise_modify_type;
+    if (step < 1)
+        step = 1;
+    if (y_end > height)
+        y_end = height;
+
+    for( int y = y_start; y < y_end; y += step )
+    {
+        int block_h = (y + step > y_end ? y_end : y + step) - y;
+        for( int x = 0; x < width; x += step )
+        {
+            // Sample the same function as the full resolution map, only at strided coordinates
+            float n;
+            if (g_NoiseParams.perturb_type == 1)
+                n = SamplePerturb1(x, y, modify_type);
+            else if (g_NoiseParams.perturb_type == 2)
+                n = SamplePerturb2(x, y, modify_type);
+            else
+                n = SampleNoise(x, y, modify_type);
+            height_t value = NoiseToHeight(n);
+
+            int block_w = (x + step > width ? width : x + step) - x;
+            for( int yy = 0; yy < block_h; ++yy )
+            {
+                height_t* row = &heights[(y + yy) * width + x];
+                for( int xx = 0; xx < block_w; ++xx )
+                    row[xx] = value;
+            }
         }
     }
 }
@@ -271,13 +342,22 @@ void Perturb2(int w, int h, float* noisef)
 //     return fbm(x + 4.0f * 512.0f * rx, y + 4.0f * 512.0f * ry );
 // }
 
-void ContrastNoise(float* noisef, float exponent)
+// With a table of the powers of all the heights, instead of a pow() per pixel
+void ContrastNoise(height_t* heights, float exponent)
 {
+    if (exponent == 1.0f)
+        return;
+
+    height_t* lut = (height_t*)malloc(sizeof(height_t) * (MAPMAKER_HEIGHT_MAX + 1));
+    for( int i = 0; i <= MAPMAKER_HEIGHT_MAX; ++i)
+        lut[i] = NoiseToHeight(powf(HeightToNoise((height_t)i), exponent));
+
     int size = g_MapParams.width * g_MapParams.height;
     for( int i = 0; i < size; ++i)
     {
-        noisef[i] = pow(noisef[i], exponent);
+        heights[i] = lut[heights[i]];
     }
+    free(lut);
 }
 
 static inline float Min(float a, float b)
@@ -286,10 +366,10 @@ static inline float Min(float a, float b)
 }
 
 // http://micsymposium.org/mics_2011_proceedings/mics2011_submission_30.pdf
-static void ErodeHydraulic(int w, int h, float* elevation, float* sediment, float* water)
+static void ErodeHydraulic(int w, int h, float* elevation, float* sediment, float* water, int iterations)
 {
     int size = w * h;
-    for (int it = 0; it < g_NoiseParams.erode_iterations; ++it)
+    for (int it = 0; it < iterations; ++it)
     {
         for( int i = 0; i < size; ++i)
         {
@@ -330,7 +410,7 @@ static void ErodeHydraulic(int w, int h, float* elevation, float* sediment, floa
 
                     int neighbor = i;
                     float neighbor_height = height;
-                    int offsets[] = { -w-1, -w -w+1, -1, 1, w-1, w, w+1 };
+                    int offsets[] = { -w-1, -w, -w+1, -1, 1, w-1, w, w+1 };
                     for( int j = 0; j < 8; ++j)
                     {
                         int ii = i + offsets[j];
@@ -384,11 +464,11 @@ static void ErodeHydraulic(int w, int h, float* elevation, float* sediment, floa
     }
 }
 
-static void ErodeThermal(int w, int h, float* elevation)
+static void ErodeThermal(int w, int h, float* elevation, int iterations)
 {
     float talus = g_NoiseParams.erode_thermal_talus / w;
 
-    for (int it = 0; it < g_NoiseParams.erode_iterations; ++it)
+    for (int it = 0; it < iterations; ++it)
     {
         for( int y = 0; y < h; ++y)
         {
@@ -467,369 +547,3107 @@ static void ErodeThermal(int w, int h, float* elevation)
     }
 }
 
-void Erode(int w, int h, float* elevation, float* sediment, float* water)
+// Priority flood (Barnes et al, "Priority-Flood: An Optimal Depression-Filling and Watershed-Labeling
+// Algorithm for Digital Elevation Models"). The map border drains everything, and the pixels are visited
+// from the border inwards, lowest first. A pixel that is lower than the pixel it was reached from is in a
+// depression, and is raised up to the spill level. The elevations are quantized into buckets, which makes
+// it linear in the number of pixels.
+// The pixel each one was reached from is where it drains to, and the visiting order is a topological order
+// of that drainage tree, so the flow accumulation is a single pass in the reverse order.
+// The rivers are then carved into the filled heightfield, deeper with more upstream pixels (but not below
+// the pixel downstream).
+// Outputs the filled depth as the sediment, and the (log scaled) flow accumulation as the water.
+#define FLOW_LEVELS 65536
+
+static inline void FlowPush(int* heads, int* tails, int* next, int level, int index)
 {
-    switch(g_NoiseParams.erode_type)
-    {
-    case 0: ErodeThermal(w, h, elevation); break;
-    case 1: ErodeHydraulic(w, h, elevation, sediment, water); break;
-    default: break;
-    }
+    next[index] = -1;
+    if (heads[level] < 0)
+        heads[level] = index;
+    else
+        next[tails[level]] = index;
+    tails[level] = index;
 }
 
-void NoiseRadial(int width, int height, float falloff, float* noisef)
+static void ErodeFlow(int w, int h, float* elevation, float* sediment, float* water)
 {
-    float halfwidth = width * 0.5f;
-    float halfheight = height * 0.5f;
-    for (int y = 0; y < height; ++y)
+    int size = w * h;
+    float min_elevation = FLT_MAX;
+    float max_elevation = -FLT_MAX;
+    for( int i = 0; i < size; ++i)
     {
-        for (int x = 0; x < width; ++x)
-        {
-            float xx = x - halfwidth;
-            float yy = y - halfheight;
-            float dx = xx / halfwidth;
-            float dy = yy / halfheight;
-            // 1.0 in the middle, 0 at the edge
-            float d = 1.0f - sqrtf(dx*dx + dy*dy);
-            if (d < 0)
-                d = 0;
+        min_elevation = elevation[i] < min_elevation ? elevation[i] : min_elevation;
+        max_elevation = elevation[i] > max_elevation ? elevation[i] : max_elevation;
+    }
+    float range = max_elevation - min_elevation;
+    if (range <= 0.0f)
+        return;
+    float scale = (FLOW_LEVELS - 1) / range;
+
+    // A FIFO queue per level, so the flat areas are visited breadth first (and drain along the shortest path)
+    int* heads = (int*)malloc(sizeof(int) * FLOW_LEVELS * 2);
+    int* tails = heads + FLOW_LEVELS;
+    int* next = (int*)malloc(sizeof(int) * size);
+    int* receivers = (int*)malloc(sizeof(int) * size); // -1 for the border, -2 if not visited yet
+    int* order = (int*)malloc(sizeof(int) * size);
+    memset(heads, 0xFF, sizeof(int) * FLOW_LEVELS);
 
-            int i = y * width + x;
-            //noisef[i] *= d;
-            noisef[i] *= d / pow(d, falloff);
-            //noisef[i] = d * pow(d, falloff);
-            //float f = pow(d, falloff)
+    for( int i = 0; i < size; ++i)
+        receivers[i] = -2;
+    for( int y = 0; y < h; ++y)
+    {
+        for( int x = 0; x < w; ++x)
+        {
+            if (x != 0 && y != 0 && x != w - 1 && y != h - 1)
+                continue;
+            int i = y * w + x;
+            receivers[i] = -1;
+            FlowPush(heads, tails, next, (int)((elevation[i] - min_elevation) * scale), i);
         }
     }
-}
-
-void Blur(int w, int h, float* noisef, float threshold)
-{
-    size_t size = w * h;
-    float* tmp = (float*)malloc(size * sizeof(float));
-
-    int kernelsize = 3;
-    float kernel[] = {  1, 2, 1,
-                        2, 4, 2,
-                        1, 2, 1 };
-    /*
-    int kernelsize = 5;
-    float kernel[] = {  1,2, 4,2,1,
-                        2,4, 8,4,2,
-                        4,8,16,8,4,
-                        2,4, 8,4,2,
-                        1,2, 4,2,1  };
-                        */
-
-    int halfkernelsize = kernelsize/2;
-    // Normalize kernel
-    float sum = 0;
-    for( int i = 0; i < kernelsize*kernelsize; ++i )
-        sum += kernel[i];
-    const float oneoversum = 1.0f/sum;
-    for( int i = 0; i < kernelsize*kernelsize; ++i )
-        kernel[i] *= oneoversum;
 
-    for( int y = 0; y < h; ++y )
+    int num_visited = 0;
+    for( int level = 0; level < FLOW_LEVELS; ++level)
     {
-        for( int x = 0; x < w; ++x )
+        while (heads[level] >= 0)
         {
-            int index = y * w + x;
-            if (noisef[index] > threshold)
-            {
-                tmp[index] = noisef[index];
-                continue;
-            }
+            int i = heads[level];
+            heads[level] = next[i];
+            order[num_visited++] = i;
 
-            float sum = 0;
-            for( int ky = -halfkernelsize; ky <= halfkernelsize; ++ky )
+            int x = i % w;
+            int y = i / w;
+            for( int dy = -1; dy <= 1; ++dy)
             {
-                for( int kx = -halfkernelsize; kx <= halfkernelsize; ++kx )
+                for( int dx = -1; dx <= 1; ++dx)
                 {
-                    int xx = Clampi(0, w-1, x + kx);
-                    int yy = Clampi(0, h-1, y + ky);
-                    sum += kernel[(ky+halfkernelsize) * kernelsize + (kx+halfkernelsize)] * noisef[yy * w + xx];
+                    int nx = x + dx;
+                    int ny = y + dy;
+                    if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+                        continue;
+                    int n = ny * w + nx;
+                    if (receivers[n] != -2)
+                        continue;
+                    receivers[n] = i;
+
+                    if (elevation[n] <= elevation[i])
+                    {
+                        // In a depression, fill it up to the spill level
+                        sediment[n] += elevation[i] - elevation[n];
+                        elevation[n] = elevation[i];
+                        FlowPush(heads, tails, next, level, n);
+                    }
+                    else
+                    {
+                        int n_level = (int)((elevation[n] - min_elevation) * scale);
+                        FlowPush(heads, tails, next, n_level > level ? n_level : level, n);
+                    }
                 }
             }
-            tmp[index] = sum;
         }
     }
 
-    memcpy(noisef, tmp, size * sizeof(float));
-    free(tmp);
-}
-
-void Normalize(int w, int h, float* elevation)
-{
-    int size = w * h;
-    float max = 0.0f;
-    float min = 1.0f;
-    for (int i = 0; i < size; ++i)
+    // The flow accumulation, upstream pixels first
+    for( int i = 0; i < size; ++i)
+        water[i] = 1.0f;
+    for( int k = num_visited - 1; k >= 0; --k)
     {
-        if (elevation[i] > max)
-            max = elevation[i];
-
-        if (elevation[i] < min)
-            min = elevation[i];
+        int i = order[k];
+        if (receivers[i] >= 0)
+            water[receivers[i]] += water[i];
     }
 
-    float f = 1.0f / max;
-    for (int i = 0; i < size; ++i)
+    float max_flow = 1.0f;
+    for( int i = 0; i < size; ++i)
+        max_flow = water[i] > max_flow ? water[i] : max_flow;
+
+    // The filled depressions are lakes, and aren't carved. A pixel is never carved below the pixel it drains
+    // to (visited before it), so the heightfield stays drained.
+    float carve = g_NoiseParams.erode_flow_carve * range;
+    for( int k = 0; k < num_visited; ++k)
     {
-        elevation[i] = jcn_remap(elevation[i], min, max, 0.0f, 1.0f);
+        int i = order[k];
+        if (sediment[i] > 0.0f)
+            continue;
+        float carved = elevation[i] - carve * sqrtf(water[i] / max_flow);
+        if (receivers[i] >= 0 && carved < elevation[receivers[i]])
+            carved = elevation[receivers[i]];
+        elevation[i] = carved;
     }
+
+    float log_max_flow = logf(max_flow + 1.0f);
+    for( int i = 0; i < size; ++i)
+        water[i] = logf(water[i] + 1.0f) / log_max_flow;
+
+    free(order);
+    free(receivers);
+    free(next);
+    free(heads);
 }
 
+// Droplet erosion (Hans Theobald Beyer, "Implementation of a method for hydraulic erosion").
+// Each droplet runs down the (bilinear) gradient, erodes the pixels within a radius while it can carry
+// more sediment, and deposits it where it slows down or runs uphill.
+// The droplets are split into batches, and each batch into DROPLET_JOBS jobs, with fixed droplet counts and
+// seeds, which are spread over the threads. So the result doesn't depend on the number of threads.
+// Each job writes its changes into its own tiles, and sees the heights from the start of the batch plus its
+// own changes. A job only allocates the tiles its droplets touch (from a pool that is reused between the
+// batches), and after each batch the touched tiles are added to the heights. The cost depends on the number
+// of droplets, not the map size (apart from a scan of the tile tables in the merges).
+
+#define DROPLET_BATCHES         8
+#define DROPLET_JOBS            16      // Per batch, whatever the number of threads
+#define DROPLET_TILE_SHIFT      5
+#define DROPLET_TILE_SIZE       (1 << DROPLET_TILE_SHIFT)
+#define DROPLET_TILE_MASK       (DROPLET_TILE_SIZE - 1)
+#define DROPLET_TILE_AREA       (DROPLET_TILE_SIZE * DROPLET_TILE_SIZE)
+#define DROPLET_MAX_LIFETIME    30
+#define DROPLET_INERTIA         0.05f   // How much the droplet keeps its direction
+#define DROPLET_CAPACITY        4.0f    // The sediment capacity per unit of speed, water and slope
+#define DROPLET_MIN_CAPACITY    0.01f
+#define DROPLET_DEPOSIT_SPEED   0.3f
+#define DROPLET_ERODE_SPEED     0.3f
+#define DROPLET_EVAPORATION     0.01f
+#define DROPLET_GRAVITY         4.0f
+
+// The changes of one job, in the current batch
+struct SDropletTiles
+{
+    int*            slots;      // The pool slot of each tile, or -1 if it's untouched
+    float*          pool;       // capacity tiles
+    int             num_used;
+    int             capacity;
+};
 
-// VORONOI
+struct SDropletContext
+{
+    float*          elevation;
+    SDropletTiles   tiles[DROPLET_JOBS];
+    int             width;
+    int             height;
+    int             tiles_x;
+    int             tiles_y;
+    int             batch;
+    int             num_droplets;               // In total, split over the batches and jobs
+    int             brush_radius;
+    int             brush_size;
+    const int*      brush_offsets;              // The pixels within the radius, and their weights
+    const int*      brush_tile_offsets;         // The offsets within a tile
+    const int*      brush_dx;
+    const int*      brush_dy;
+    const float*    brush_weights;
+};
 
-static void relax_points(const jcv_diagram* diagram, jcv_point* points)
+static inline float GetDropletDelta(const SDropletTiles* tiles, int tiles_x, int x, int y)
 {
-    const jcv_site* sites = jcv_diagram_get_sites(diagram);
-    for( int i = 0; i < diagram->numsites; ++i )
+    int slot = tiles->slots[(y >> DROPLET_TILE_SHIFT) * tiles_x + (x >> DROPLET_TILE_SHIFT)];
+    if (slot < 0)
+        return 0.0f;
+    return tiles->pool[slot * DROPLET_TILE_AREA + (y & DROPLET_TILE_MASK) * DROPLET_TILE_SIZE + (x & DROPLET_TILE_MASK)];
+}
+
+static int AllocDropletTile(SDropletTiles* tiles)
+{
+    if (tiles->num_used == tiles->capacity)
     {
-        const jcv_site* site = &sites[i];
-        jcv_point sum = site->p;
-        int count = 1;
-        const jcv_graphedge* edge = site->edges;
-        while( edge )
-        {
-            sum.x += edge->pos[0].x;
-            sum.y += edge->pos[0].y;
-            ++count;
-            edge = edge->next;
-        }
-        points[site->index].x = sum.x / count;
-        points[site->index].y = sum.y / count;
+        tiles->capacity = tiles->capacity ? tiles->capacity * 2 : 64;
+        tiles->pool = (float*)realloc(tiles->pool, sizeof(float) * DROPLET_TILE_AREA * tiles->capacity);
     }
+    int slot = tiles->num_used++;
+    memset(tiles->pool + slot * DROPLET_TILE_AREA, 0, sizeof(float) * DROPLET_TILE_AREA);
+    return slot;
 }
 
-static void GenerateVoronoiCellPoints()
+// The change at (x, y), allocating the (cleared) tile if it's untouched
+static inline float* GetDropletDeltaPtr(SDropletTiles* tiles, int tiles_x, int x, int y)
 {
-    if (g_VoronoiPoints)
-        free(g_VoronoiPoints);
+    int* slot = &tiles->slots[(y >> DROPLET_TILE_SHIFT) * tiles_x + (x >> DROPLET_TILE_SHIFT)];
+    if (*slot < 0)
+        *slot = AllocDropletTile(tiles);
+    return &tiles->pool[*slot * DROPLET_TILE_AREA + (y & DROPLET_TILE_MASK) * DROPLET_TILE_SIZE + (x & DROPLET_TILE_MASK)];
+}
 
-    int border = 0;//g_VoronoiParams.border;
-    int width = g_MapParams.width;
-    int height = g_MapParams.height;
-    if (g_VoronoiParams.generation_type == 0) // random
+// The bilinear height and gradient at (x, y), which is inside [0, width-1) x [0, height-1)
+static inline float DropletHeight(const float* elevation, const SDropletTiles* tiles, int width, int tiles_x, float x, float y, float* gx, float* gy)
+{
+    int ix = (int)x;
+    int iy = (int)y;
+    float u = x - ix;
+    float v = y - iy;
+    int i = iy * width + ix;
+    float h00 = elevation[i];
+    float h10 = elevation[i + 1];
+    float h01 = elevation[i + width];
+    float h11 = elevation[i + width + 1];
+    if ((ix & DROPLET_TILE_MASK) != DROPLET_TILE_MASK && (iy & DROPLET_TILE_MASK) != DROPLET_TILE_MASK)
     {
-        g_VoronoiNumPoints = g_VoronoiParams.num_cells;
-        g_VoronoiPoints = (jcv_point*)malloc(g_VoronoiParams.num_cells * sizeof(jcv_point));
-
-        int max_x_range = width - 2 * border;
-        int max_y_range = height - 2 * border;
-        for ( int i = 0; i < g_VoronoiParams.num_cells; ++i )
+        // All four in the same tile
+        int slot = tiles->slots[(iy >> DROPLET_TILE_SHIFT) * tiles_x + (ix >> DROPLET_TILE_SHIFT)];
+        if (slot >= 0)
         {
-            g_VoronoiPoints[i].x = (int)(border + rand_r(&g_RandVoronoi) % max_x_range);
-            g_VoronoiPoints[i].y = (int)(border + rand_r(&g_RandVoronoi) % max_y_range);
+            const float* delta = tiles->pool + slot * DROPLET_TILE_AREA + (iy & DROPLET_TILE_MASK) * DROPLET_TILE_SIZE + (ix & DROPLET_TILE_MASK);
+            h00 += delta[0];
+            h10 += delta[1];
+            h01 += delta[DROPLET_TILE_SIZE];
+            h11 += delta[DROPLET_TILE_SIZE + 1];
         }
     }
-    else if (g_VoronoiParams.generation_type == 1) // hexagonal
+    else
     {
-        int size = (width < height ? width : height) / (g_VoronoiParams.hexagon_density * 2);
-        float w = size * sqrtf(3.0f);
-        float h = size * 2.0f;
-
-        int xsteps = width / w + 1;
-        int ysteps = height / (0.75f * h) + 1;
+        h00 += GetDropletDelta(tiles, tiles_x, ix, iy);
+        h10 += GetDropletDelta(tiles, tiles_x, ix + 1, iy);
+        h01 += GetDropletDelta(tiles, tiles_x, ix, iy + 1);
+        h11 += GetDropletDelta(tiles, tiles_x, ix + 1, iy + 1);
+    }
+    *gx = (h10 - h00) * (1 - v) + (h11 - h01) * v;
+    *gy = (h01 - h00) * (1 - u) + (h11 - h10) * u;
+    return h00 * (1 - u) * (1 - v) + h10 * u * (1 - v) + h01 * (1 - u) * v + h11 * u * v;
+}
 
-// printf("size: %d\n", size);
-// printf("w, h: %f %f\n", w, h);
-// printf("xs, ys: %d %d\n", xsteps, ysteps);
-// printf("num: %d\n", g_VoronoiNumPoints);
+static void RunDroplets(void* _ctx, int job)
+{
+    SDropletContext* ctx = (SDropletContext*)_ctx;
+    const float* elevation = ctx->elevation;
+    SDropletTiles* tiles = &ctx->tiles[job];
+    int width = ctx->width;
+    int height = ctx->height;
+    int tiles_x = ctx->tiles_x;
+    int part = ctx->batch * DROPLET_JOBS + job;
+    unsigned int seed = (unsigned int)(g_NoiseParams.seed * 7919 + part);
+
+    // The first jobs get one more droplet each, for the remainder
+    int num_parts = DROPLET_BATCHES * DROPLET_JOBS;
+    int num_droplets = ctx->num_droplets / num_parts + (part < ctx->num_droplets % num_parts ? 1 : 0);
+    for (int d = 0; d < num_droplets; ++d)
+    {
+        float x = rand_r(&seed) / (float)RAND_MAX * (width - 1.001f);
+        float y = rand_r(&seed) / (float)RAND_MAX * (height - 1.001f);
+        float dir_x = 0.0f;
+        float dir_y = 0.0f;
+        float speed = 1.0f;
+        float water = 1.0f;
+        float sediment = 0.0f;
+
+        for (int lifetime = 0; lifetime < DROPLET_MAX_LIFETIME; ++lifetime)
+        {
+            int ix = (int)x;
+            int iy = (int)y;
+            float u = x - ix;
+            float v = y - iy;
+            float gx, gy;
+            float h = DropletHeight(elevation, tiles, width, tiles_x, x, y, &gx, &gy);
+
+            dir_x = dir_x * DROPLET_INERTIA - gx * (1 - DROPLET_INERTIA);
+            dir_y = dir_y * DROPLET_INERTIA - gy * (1 - DROPLET_INERTIA);
+            float len = sqrtf(dir_x * dir_x + dir_y * dir_y);
+            if (len == 0.0f)
+                break;
+            dir_x /= len;
+            dir_y /= len;
+            float new_x = x + dir_x;
+            float new_y = y + dir_y;
+            if (new_x < 0 || new_y < 0 || new_x >= width - 1 || new_y >= height - 1)
+                break;
 
-        border = 0; // apply border on the cells instead
+            float new_h = DropletHeight(elevation, tiles, width, tiles_x, new_x, new_y, &gx, &gy);
+            float delta_h = new_h - h;
+            float capacity = -delta_h * speed * water * DROPLET_CAPACITY;
+            if (capacity < DROPLET_MIN_CAPACITY)
+                capacity = DROPLET_MIN_CAPACITY;
 
-        // 2 passes: count points + allocate, fill in points
-        for (int i = 0; i < 2; ++i)
-        {
-            int count = 0;
-            for (int iy = 0; iy < ysteps; ++iy)
+            int i = iy * width + ix;
+            if (sediment > capacity || delta_h > 0)
             {
-                float y = iy * (h * 0.75f);
-                if (y < border || (height - y) < border)
-                    continue;
-                for (int ix = 0; ix < xsteps; ++ix)
+                // Uphill: fill up the pit behind it. Otherwise drop what it can't carry
+                float amount = delta_h > 0 ? Min(delta_h, sediment) : (sediment - capacity) * DROPLET_DEPOSIT_SPEED;
+                sediment -= amount;
+                *GetDropletDeltaPtr(tiles, tiles_x, ix, iy) += amount * (1 - u) * (1 - v);
+                *GetDropletDeltaPtr(tiles, tiles_x, ix + 1, iy) += amount * u * (1 - v);
+                *GetDropletDeltaPtr(tiles, tiles_x, ix, iy + 1) += amount * (1 - u) * v;
+                *GetDropletDeltaPtr(tiles, tiles_x, ix + 1, iy + 1) += amount * u * v;
+            }
+            else
+            {
+                float amount = Min((capacity - sediment) * DROPLET_ERODE_SPEED, -delta_h);
+                // Most of the time the brush is inside one tile
+                int lx = ix & DROPLET_TILE_MASK;
+                int ly = iy & DROPLET_TILE_MASK;
+                float* tile_delta = 0;
+                if (lx >= ctx->brush_radius && lx + ctx->brush_radius < DROPLET_TILE_SIZE &&
+                    ly >= ctx->brush_radius && ly + ctx->brush_radius < DROPLET_TILE_SIZE)
+                    tile_delta = GetDropletDeltaPtr(tiles, tiles_x, ix, iy);
+                for (int b = 0; b < ctx->brush_size; ++b)
                 {
-                    float x = w * (iy&1 ? 0.5f : 0.0f) + ix * w;
-                    if (x < border || (width - x) < border)
+                    int bx = ix + ctx->brush_dx[b];
+                    int by = iy + ctx->brush_dy[b];
+                    if (bx < 0 || by < 0 || bx >= width || by >= height)
                         continue;
-
-                    if (i)
-                    {
-                        g_VoronoiPoints[count].x = (int)x;
-                        g_VoronoiPoints[count].y = (int)y;
-            //printf("%d: x, y:  %f %f\n", count, x, y);
-                    }
-                    ++count;
+                    float* delta = tile_delta ? tile_delta + ctx->brush_tile_offsets[b] : GetDropletDeltaPtr(tiles, tiles_x, bx, by);
+                    float h_b = elevation[i + ctx->brush_offsets[b]] + *delta;
+                    float erode = amount * ctx->brush_weights[b];
+                    if (erode > h_b)
+                        erode = h_b > 0 ? h_b : 0;
+                    *delta -= erode;
+                    sediment += erode;
                 }
             }
 
-            if (i == 0)
+            float speed_sq = speed * speed - delta_h * DROPLET_GRAVITY;
+            speed = speed_sq > 0 ? sqrtf(speed_sq) : 0.0f;
+            water *= 1.0f - DROPLET_EVAPORATION;
+            x = new_x;
+            y = new_y;
+        }
+    }
+}
+
+// Adds the touched tiles of the jobs to the heights, for a row of tiles. The jobs are added in order,
+// so the sums don't depend on which thread ran which job
+static void MergeDroplets(void* _ctx, int tile_y)
+{
+    SDropletContext* ctx = (SDropletContext*)_ctx;
+    int y0 = tile_y * DROPLET_TILE_SIZE;
+    int y1 = y0 + DROPLET_TILE_SIZE < ctx->height ? y0 + DROPLET_TILE_SIZE : ctx->height;
+    for (int tile_x = 0; tile_x < ctx->tiles_x; ++tile_x)
+    {
+        int x0 = tile_x * DROPLET_TILE_SIZE;
+        int x1 = x0 + DROPLET_TILE_SIZE < ctx->width ? x0 + DROPLET_TILE_SIZE : ctx->width;
+        int t = tile_y * ctx->tiles_x + tile_x;
+        for (int j = 0; j < DROPLET_JOBS; ++j)
+        {
+            SDropletTiles* tiles = &ctx->tiles[j];
+            int slot = tiles->slots[t];
+            if (slot < 0)
+                continue;
+            tiles->slots[t] = -1;
+            const float* delta = tiles->pool + slot * DROPLET_TILE_AREA;
+            for (int y = y0; y < y1; ++y)
             {
-                g_VoronoiNumPoints = count;
-                g_VoronoiPoints = (jcv_point*)malloc(g_VoronoiNumPoints * sizeof(jcv_point));
+                float* row = ctx->elevation + y * ctx->width;
+                const float* delta_row = delta + (y - y0) * DROPLET_TILE_SIZE - x0;
+                for (int x = x0; x < x1; ++x)
+                    row[x] += delta_row[x];
             }
-
-            //printf("%d  vs %d\n", g_VoronoiNumPoints, count);
         }
-
     }
-
 }
 
-void GenerateVoronoi()
+// Runs the batches [batch_begin, batch_end), out of DROPLET_BATCHES
+static void ErodeDroplets(int w, int h, float* elevation, int batch_begin, int batch_end)
 {
-    g_RandVoronoi = g_VoronoiParams.seed;
-    GenerateVoronoiCellPoints();
-
-    if (g_VoronoiDiagram == 0)
+    if (w < 2 || h < 2)
+        return;
+
+    int radius = g_NoiseParams.erode_droplet_radius;
+    if (radius < 1)
+        radius = 1;
+    int brush_capacity = (2 * radius + 1) * (2 * radius + 1);
+    int* brush_offsets = (int*)malloc(sizeof(int) * 4 * brush_capacity);
+    int* brush_tile_offsets = brush_offsets + brush_capacity;
+    int* brush_dx = brush_tile_offsets + brush_capacity;
+    int* brush_dy = brush_dx + brush_capacity;
+    float* brush_weights = (float*)malloc(sizeof(float) * brush_capacity);
+    int brush_size = 0;
+    float weight_sum = 0.0f;
+    for (int dy = -radius; dy <= radius; ++dy)
     {
-        g_VoronoiDiagram = (jcv_diagram*)malloc(sizeof(jcv_diagram));
+        for (int dx = -radius; dx <= radius; ++dx)
+        {
+            float weight = radius - sqrtf((float)(dx * dx + dy * dy));
+            if (weight <= 0.0f)
+                continue;
+            brush_offsets[brush_size] = dy * w + dx;
+            brush_tile_offsets[brush_size] = dy * DROPLET_TILE_SIZE + dx;
+            brush_dx[brush_size] = dx;
+            brush_dy[brush_size] = dy;
+            brush_weights[brush_size] = weight;
+            weight_sum += weight;
+            brush_size++;
+        }
     }
-    else
+    for (int b = 0; b < brush_size; ++b)
+        brush_weights[b] /= weight_sum;
+
+    SDropletContext ctx;
+    ctx.elevation = elevation;
+    ctx.width = w;
+    ctx.height = h;
+    ctx.tiles_x = (w + DROPLET_TILE_SIZE - 1) / DROPLET_TILE_SIZE;
+    ctx.tiles_y = (h + DROPLET_TILE_SIZE - 1) / DROPLET_TILE_SIZE;
+    ctx.num_droplets = g_NoiseParams.erode_droplets > 0 ? g_NoiseParams.erode_droplets : 0;
+    ctx.brush_radius = radius;
+    ctx.brush_size = brush_size;
+    ctx.brush_offsets = brush_offsets;
+    ctx.brush_tile_offsets = brush_tile_offsets;
+    ctx.brush_dx = brush_dx;
+    ctx.brush_dy = brush_dy;
+    ctx.brush_weights = brush_weights;
+    int num_tiles = ctx.tiles_x * ctx.tiles_y;
+    for (int j = 0; j < DROPLET_JOBS; ++j)
     {
-        jcv_diagram_free(g_VoronoiDiagram);
+        SDropletTiles* tiles = &ctx.tiles[j];
+        tiles->slots = (int*)malloc(sizeof(int) * num_tiles);
+        memset(tiles->slots, 0xFF, sizeof(int) * num_tiles);
+        tiles->pool = 0;
+        tiles->num_used = 0;
+        tiles->capacity = 0;
     }
 
-    jcv_rect rect = {0, 0, g_MapParams.width, g_MapParams.height};
-
-    if (g_VoronoiParams.generation_type == 0) // random
+    for (int batch = batch_begin; batch < batch_end; ++batch)
     {
-        for (int i = 0; i < g_VoronoiParams.num_relaxations; ++i)
-        {
-            memset(g_VoronoiDiagram, 0, sizeof(jcv_diagram));
-            jcv_diagram_generate(g_VoronoiNumPoints, g_VoronoiPoints, &rect, g_VoronoiDiagram);
-            relax_points(g_VoronoiDiagram, g_VoronoiPoints);
-            jcv_diagram_free(g_VoronoiDiagram);
-        }
+        ctx.batch = batch;
+        JobsParallelFor(DROPLET_JOBS, RunDroplets, &ctx);
+        JobsParallelFor(ctx.tiles_y, MergeDroplets, &ctx);
+        for (int j = 0; j < DROPLET_JOBS; ++j)
+            ctx.tiles[j].num_used = 0;
     }
 
-    memset(g_VoronoiDiagram, 0, sizeof(jcv_diagram));
-    jcv_diagram_generate(g_VoronoiNumPoints, g_VoronoiPoints, &rect, g_VoronoiDiagram);
+    for (int j = 0; j < DROPLET_JOBS; ++j)
+    {
+        free(ctx.tiles[j].pool);
+        free(ctx.tiles[j].slots);
+    }
+    free(brush_weights);
+    free(brush_offsets);
 }
 
-// MAP - COLORS
+// Multigrid erosion. The thermal erosion moves the material one pixel per iteration, so a larger map needs
+// more iterations for the same result. Instead, the map is downsampled (2x2 averages) into a pyramid, and
+// erode_iterations are run on the smallest level. Going back up, the change from the erosion is upsampled
+// (bilinear) and added to the next level, which then runs half as many iterations (at least
+// MULTIGRID_MIN_ITERATIONS) to erode the details at that scale. So the full resolution level runs
+// erode_iterations >> (num_levels - 1) iterations.
+// The hydraulic erosion isn't scale independent (the rain and the solubility are per pixel), and it
+// already settles in a few iterations at the full resolution, so it doesn't use the pyramid.
 
-static inline void LightenColor(uint8_t* color, float percent)
-{
-    color[0] = (uint8_t)Clampf(0.0f, 255.0f, color[0] + color[0] * percent);
-    color[1] = (uint8_t)Clampf(0.0f, 255.0f, color[1] + color[1] * percent);
-    color[2] = (uint8_t)Clampf(0.0f, 255.0f, color[2] + color[2] * percent);
-}
+#define MULTIGRID_MIN_SIZE          64  // The smallest level is at least this wide and high
+#define MULTIGRID_MAX_LEVELS        8
+#define MULTIGRID_MIN_ITERATIONS    2   // For the finer levels
 
-static inline void DarkenColor(uint8_t* color, float percent)
+static void Downsample(int w, int h, const float* src, int dw, int dh, float* dst)
 {
-    color[0] = (uint8_t)Clampf(0.0f, 255.0f, color[0] - color[0] * percent);
-    color[1] = (uint8_t)Clampf(0.0f, 255.0f, color[1] - color[1] * percent);
-    color[2] = (uint8_t)Clampf(0.0f, 255.0f, color[2] - color[2] * percent);
+    for (int y = 0; y < dh; ++y)
+    {
+        const float* row0 = src + (2 * y) * w;
+        const float* row1 = src + (2 * y + 1 < h ? 2 * y + 1 : 2 * y) * w;
+        for (int x = 0; x < dw; ++x)
+        {
+            int x0 = 2 * x;
+            int x1 = x0 + 1 < w ? x0 + 1 : x0;
+            dst[y * dw + x] = (row0[x0] + row0[x1] + row1[x0] + row1[x1]) * 0.25f;
+        }
+    }
 }
 
-static void ColorizeMapInternal(int width, int height, uint8_t* heights, int num_limits, uint8_t* height_limits, uint8_t* height_colors, uint8_t* out_colors)
+// Adds the bilinear upsampling of (src - src_original), which is half the size of dst
+static void UpsampleAddDifference(int sw, int sh, const float* src, const float* src_original, int dw, int dh, float* dst)
 {
-    const float lighten_percent = 0.2f;
-    size_t size = width * height;
-    for( size_t i = 0; i < size; ++i )
+    for (int y = 0; y < dh; ++y)
     {
-        for( int l = 0; l < num_limits; ++l )
+        // The pixel centers of the coarse level are at the centers of the 2x2 blocks
+        float fy = Clampf(0.0f, (float)(sh - 1), (y + 0.5f) * 0.5f - 0.5f);
+        int y0 = (int)fy;
+        int y1 = y0 + 1 < sh ? y0 + 1 : y0;
+        float v = fy - y0;
+        for (int x = 0; x < dw; ++x)
         {
-            uint8_t value = heights[i];
-            if( value <= height_limits[l] )
-            {
-                out_colors[i*3+0] = height_colors[l*3+0];
-                out_colors[i*3+1] = height_colors[l*3+1];
-                out_colors[i*3+2] = height_colors[l*3+2];
-
-                // make the height variations visible in the color
-                {
-                    const float maxlimit = float(height_limits[l]);
-                    const float minlimit = float(l == 0 ? 0 : height_limits[l-1]);
-                    const float scale = (float(value) - minlimit) / (maxlimit - minlimit);
-
-                    LightenColor( &out_colors[i*3], lighten_percent * scale );
-                }
-                break;
-            }
+            float fx = Clampf(0.0f, (float)(sw - 1), (x + 0.5f) * 0.5f - 0.5f);
+            int x0 = (int)fx;
+            int x1 = x0 + 1 < sw ? x0 + 1 : x0;
+            float u = fx - x0;
+            float d00 = src[y0 * sw + x0] - src_original[y0 * sw + x0];
+            float d10 = src[y0 * sw + x1] - src_original[y0 * sw + x1];
+            float d01 = src[y1 * sw + x0] - src_original[y1 * sw + x0];
+            float d11 = src[y1 * sw + x1] - src_original[y1 * sw + x1];
+            dst[y * dw + x] += (d00 * (1 - u) + d10 * u) * (1 - v) + (d01 * (1 - u) + d11 * u) * v;
         }
     }
 }
 
-static void ShadeMap(int width, int height,
-                    float light_dir_x, float light_dir_y, float sun_angle,
-                    uint8_t sea_level, float strength, float strength_sea_level,
-                    uint8_t* heights, uint8_t* out_colors)
+static void ErodeMultigrid(int w, int h, float* elevation)
 {
-    // currently unused
-    (void)light_dir_x;
-    (void)light_dir_y;
-
-    int half_width = width / 2;
-    int half_height = height / 2;
-    int numsteps = g_MapParams.shadow_step_length;
-    for( int y = 1; y < height; ++y )
+    int widths[MULTIGRID_MAX_LEVELS];
+    int heights[MULTIGRID_MAX_LEVELS];
+    float* levels[MULTIGRID_MAX_LEVELS];    // The coarser levels own their buffers
+    float* originals[MULTIGRID_MAX_LEVELS]; // The levels before the erosion
+
+    widths[0] = w;
+    heights[0] = h;
+    levels[0] = elevation;
+    int num_levels = 1;
+    while (num_levels < MULTIGRID_MAX_LEVELS &&
+            widths[num_levels-1] / 2 >= MULTIGRID_MIN_SIZE && heights[num_levels-1] / 2 >= MULTIGRID_MIN_SIZE)
     {
-        for( int x = 1; x < width; ++x )
-        {
-            int current = heights[y * width + x];
-
-            // Current dir: top left
-            float step_dist = sqrtf(-1*-1 + -1*-1); // direction
+        int l = num_levels++;
+        widths[l] = (widths[l-1] + 1) / 2;
+        heights[l] = (heights[l-1] + 1) / 2;
+        int size = widths[l] * heights[l];
+        levels[l] = (float*)malloc(sizeof(float) * size * 2);
+        originals[l] = levels[l] + size;
+        Downsample(widths[l-1], heights[l-1], levels[l-1], widths[l], heights[l], levels[l]);
+        memcpy(originals[l], levels[l], sizeof(float) * size);
+    }
 
-            for( int n = 1; n <= numsteps && x >= n && y >= n; ++n)
-            {
-                int xx = x-n;
-                int yy = y-n;
-                int topleft = heights[yy * width + xx];
+    int iterations = g_NoiseParams.erode_iterations;
+    for (int l = num_levels - 1; l >= 0; --l)
+    {
+        if (l + 1 < num_levels)
+            UpsampleAddDifference(widths[l+1], heights[l+1], levels[l+1], originals[l+1], widths[l], heights[l], levels[l]);
 
-                float height_diff = topleft - current; // opposite side
-                if (height_diff > 0)
-                {
-                    float dist = n * step_dist; // adjacent side
-                    float angle = atan2f(height_diff, dist);
+        int level_iterations = iterations >> (num_levels - 1 - l);
+        if (l < num_levels - 1 && level_iterations < MULTIGRID_MIN_ITERATIONS)
+            level_iterations = MULTIGRID_MIN_ITERATIONS;
 
-                    if (angle >= sun_angle)
-                    {
-                        // Decrease strength further away
-                        float dist_factor = (numsteps - n) / float(numsteps);
-                        // Lerp between angles. High difference -> higher strength
-                        float angle_factor = Clampf(0.0f, 1.0f, (angle - sun_angle)/(PI_HALF - sun_angle) );
-                        float s = strength;
-                        if (current < sea_level)
-                        {
-                            int dx = x - half_width;
-                            int dy = y - half_height;
-                            float dist_from_center = Clampf(0.0f, 1.0f, 1.0f - sqrtf(dx*dx + dy*dy) / half_width);
-                            s = strength_sea_level * dist_from_center;
-                        }
-                        int index = y * width * 3 + x * 3;
-                        DarkenColor( &out_colors[index], Clampf(0.0f, 1.0f, s + s * angle_factor) * dist_factor);
-                        break;
-                    }
-                }
-            }
-        }
+        ErodeThermal(widths[l], heights[l], levels[l], level_iterations);
     }
-}
 
-static inline float DegToRad(float degrees)
-{
-    return (degrees * PI) / 180.0f;
+    for (int l = 1; l < num_levels; ++l)
+        free(levels[l]);
 }
 
-void ColorizeMap(uint8_t* heights, uint8_t* out_colors, int num_limits, uint8_t* height_limits, uint8_t* height_colors)
+// A step is an iteration of the thermal and hydraulic erosion, and a batch of droplets. Each step only keeps
+// its state in the elevation, sediment and water, so running the steps in several calls gives the same result.
+// The multigrid and the flow erosion are one step.
+int ErodeNumSteps()
 {
-    ColorizeMapInternal(g_MapParams.width, g_MapParams.height, heights, num_limits, height_limits, height_colors, out_colors);
+    if (g_NoiseParams.erode_multigrid && g_NoiseParams.erode_type == 0)
+        return 1;
 
-    if (g_MapParams.use_shading)
+    switch(g_NoiseParams.erode_type)
     {
-        float angle = DegToRad(30.0f);
-        ShadeMap(g_MapParams.width, g_MapParams.height,
+    case 0:
+    case 1: return g_NoiseParams.erode_iterations > 0 ? g_NoiseParams.erode_iterations : 0;
+    case 2: return 1;
+    case 3: return DROPLET_BATCHES;
+    default: return 0;
+    }
+}
+
+void ErodeSteps(int w, int h, float* elevation, float* sediment, float* water, int step_begin, int step_end)
+{
+    if (step_begin >= step_end)
+        return;
+
+    if (g_NoiseParams.erode_multigrid && g_NoiseParams.erode_type == 0)
+    {
+        ErodeMultigrid(w, h, elevation);
+        return;
+    }
+
+    switch(g_NoiseParams.erode_type)
+    {
+    case 0: ErodeThermal(w, h, elevation, step_end - step_begin); break;
+    case 1: ErodeHydraulic(w, h, elevation, sediment, water, step_end - step_begin); break;
+    case 2: ErodeFlow(w, h, elevation, sediment, water); break;
+    case 3: ErodeDroplets(w, h, elevation, step_begin, step_end); break;
+    default: break;
+    }
+}
+
+void Erode(int w, int h, float* elevation, float* sediment, float* water)
+{
+    ErodeSteps(w, h, elevation, sediment, water, 0, ErodeNumSteps());
+}
+
+void NoiseToElevation(int w, int h, const height_t* heights, float* elevation)
+{
+    int size = w * h;
+    for (int i = 0; i < size; ++i)
+        elevation[i] = HeightToNoise(heights[i]);
+}
+
+void Blur(int w, int h, height_t* heights, float threshold)
+{
+    size_t size = w * h;
+    height_t* tmp = (height_t*)malloc(size * sizeof(height_t));
+
+    // The heights above the threshold are kept as they are
+    int threshold_height = threshold >= 1.0f ? MAPMAKER_HEIGHT_MAX : NoiseToHeight(threshold);
+
+    const int kernelsize = 3;
+    const int kernelshift = 4; // The weights sum to 16
+    const int kernel[] = {  1, 2, 1,
+                            2, 4, 2,
+                            1, 2, 1 };
+
+    int halfkernelsize = kernelsize/2;
+    for( int y = 0; y < h; ++y )
+    {
+        for( int x = 0; x < w; ++x )
+        {
+            int index = y * w + x;
+            if (heights[index] > threshold_height)
+            {
+                tmp[index] = heights[index];
+                continue;
+            }
+
+            uint32_t sum = 0;
+            for( int ky = -halfkernelsize; ky <= halfkernelsize; ++ky )
+            {
+                for( int kx = -halfkernelsize; kx <= halfkernelsize; ++kx )
+                {
+                    int xx = Clampi(0, w-1, x + kx);
+                    int yy = Clampi(0, h-1, y + ky);
+                    sum += kernel[(ky+halfkernelsize) * kernelsize + (kx+halfkernelsize)] * heights[yy * w + xx];
+                }
+            }
+            tmp[index] = (height_t)((sum + (1 << (kernelshift - 1))) >> kernelshift);
+        }
+    }
+
+    memcpy(heights, tmp, size * sizeof(height_t));
+    free(tmp);
+}
+
+void NormalizeHeights(int w, int h, const float* elevation, bool apply_radial, float radial_falloff, height_t* heights)
+{
+    int size = w * h;
+    float min = FLT_MAX;
+    float max = -FLT_MAX;
+    for (int i = 0; i < size; ++i)
+    {
+        float v = elevation ? elevation[i] : HeightToNoise(heights[i]);
+        if (v > max)
+            max = v;
+        if (v < min)
+            min = v;
+    }
+    float scale = max > min ? MAPMAKER_HEIGHT_MAX / (max - min) : 0.0f;
+
+    if (!apply_radial)
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            float v = elevation ? elevation[i] : HeightToNoise(heights[i]);
+            heights[i] = (height_t)((v - min) * scale + 0.5f);
+        }
+        return;
+    }
+
+    // The falloff is 1 in the middle and 0 at the edge, i.e. d / pow(d, falloff) for the distance d from the edge
+    float halfwidth = w * 0.5f;
+    float halfheight = h * 0.5f;
+    float exponent = 1.0f - radial_falloff;
+    int max_height = 0;
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            float dx = (x - halfwidth) / halfwidth;
+            float dy = (y - halfheight) / halfheight;
+            float d = 1.0f - sqrtf(dx*dx + dy*dy);
+            float falloff = d > 0 ? powf(d, exponent) : 0.0f;
+
+            int i = y * w + x;
+            float v = elevation ? elevation[i] : HeightToNoise(heights[i]);
+            int height = (int)((v - min) * scale * falloff + 0.5f);
+            heights[i] = (height_t)height;
+            if (height > max_height)
+                max_height = height;
+        }
+    }
+
+    // The falloff is 0 in the corners, so only the max needs to be stretched back to the full range
+    if (max_height == 0 || max_height == MAPMAKER_HEIGHT_MAX)
+        return;
+    for (int i = 0; i < size; ++i)
+        heights[i] = (height_t)(((uint32_t)heights[i] * MAPMAKER_HEIGHT_MAX + max_height / 2) / max_height);
+}
+
+
+// VORONOI
+
+// The graph only stores the start vertex of each edge, so the end of each edge has to be the start of the next one.
+// The clipping recomputes the end points, so they may differ slightly. With floats on very large diagrams
+// (e.g. 1M cells) a few cells can be broken, use MAPMAKER_VORONOI_DOUBLE for those.
+// The broken cells are still closed (with the start of the next edge), and counted in SVoronoiGraph::num_open_edges.
+#define VORONOI_VERTEX_EPSILON  0.05f
+
+// Returns the number of edges that don't end where the next edge starts
+static int CheckVoronoiCell(const jcv_site* site)
+{
+    int num_open = 0;
+    for (const jcv_graphedge* e = site->edges; e; e = e->next)
+    {
+        const jcv_graphedge* next = e->next ? e->next : site->edges;
+        if (fabsf((float)(e->pos[1].x - next->pos[0].x)) > VORONOI_VERTEX_EPSILON ||
+            fabsf((float)(e->pos[1].y - next->pos[0].y)) > VORONOI_VERTEX_EPSILON)
+            ++num_open;
+    }
+    return num_open;
+}
+
+void FlattenVoronoi(const jcv_diagram* diagram, int num_cells, SVoronoiGraph* graph)
+{
+    if (graph->offsets == 0 || graph->capacity_cells < num_cells)
+    {
+        graph->offsets = (int*)realloc(graph->offsets, sizeof(int) * (num_cells + 1));
+        graph->capacity_cells = num_cells;
+    }
+    graph->num_cells = num_cells;
+
+    int* offsets = graph->offsets;
+    memset(offsets, 0, sizeof(int) * (num_cells + 1));
+
+    // Count the edges of each cell, and store them at the next cell's offset
+    const jcv_site* sites = jcv_diagram_get_sites(diagram);
+    int num_edges = 0;
+    for (int i = 0; i < diagram->numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        int count = 0;
+        for (const jcv_graphedge* e = site->edges; e; e = e->next)
+            ++count;
+        offsets[site->index + 1] = count;
+        num_edges += count;
+    }
+
+    for (int i = 0; i < num_cells; ++i)
+        offsets[i + 1] += offsets[i];
+
+    if (graph->capacity_edges < num_edges)
+    {
+        graph->vertices = (jcv_point*)realloc(graph->vertices, sizeof(jcv_point) * num_edges);
+        graph->neighbors = (int*)realloc(graph->neighbors, sizeof(int) * num_edges);
+        graph->capacity_edges = num_edges;
+    }
+    graph->num_edges = num_edges;
+
+    graph->num_open_edges = 0;
+    for (int i = 0; i < diagram->numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        graph->num_open_edges += CheckVoronoiCell(site);
+        int offset = offsets[site->index];
+        for (const jcv_graphedge* e = site->edges; e; e = e->next, ++offset)
+        {
+            graph->vertices[offset] = e->pos[0];
+            graph->neighbors[offset] = e->neighbor ? e->neighbor->index : -1;
+        }
+    }
+}
+
+void FreeVoronoiGraph(SVoronoiGraph* graph)
+{
+    free(graph->offsets);
+    free(graph->vertices);
+    free(graph->neighbors);
+    *graph = SVoronoiGraph();
+}
+
+// PARTITIONED VORONOI
+//
+// The rect is split into vertical strips, and each strip generates the diagram of its points plus
+// the points within a margin on each side. A cell is the same as in the full diagram if, for each of
+// its vertices, the circle through the cell's site (which is empty) is within the strip + margin,
+// since any missing point closer to the cell would have to be inside one of those circles.
+// If a cell in the strip fails that test, the strip is generated again with all the points within those circles.
+// The number of strips only depends on the number of points, so the result doesn't depend on the
+// number of threads.
+
+#define VORONOI_MAX_STRIPS          64
+#define VORONOI_POINTS_PER_STRIP    16384
+#define VORONOI_BUCKETS_PER_STRIP   8
+
+struct SVoronoiStrip
+{
+    jcv_diagram diagram;
+    jcv_point*  points;     // The points in the strip, including the margin
+    int*        indices;    // The index of each point in the original array
+    int         capacity;
+    int         num_points;
+    int         num_edges;  // The number of edges of the cells owned by the strip
+    int         num_open_edges;
+    int         num_retries;
+};
+
+struct SVoronoiPartition
+{
+    int                 num_points;
+    const jcv_point*    points;
+    jcv_rect            rect;
+    int                 num_strips;
+    int                 num_buckets;
+    float               bucket_width;
+    int*                bucket_offsets; // num_buckets + 1 offsets into bucket_points
+    int*                bucket_points;  // The indices of the points, sorted by bucket
+    int*                point_bucket;   // The bucket of each point, -1 if outside the rect
+    float               margin;         // The initial margin
+    SVoronoiGraph*      graph;
+};
+
+static SVoronoiStrip    g_VoronoiStrips[VORONOI_MAX_STRIPS];
+static int*             g_VoronoiBuckets = 0;
+static int              g_VoronoiBucketsCapacity = 0;
+
+static inline int GetVoronoiBucket(const SVoronoiPartition* partition, float x)
+{
+    return Clampi(0, partition->num_buckets - 1, (int)((x - partition->rect.min.x) / partition->bucket_width));
+}
+
+// Grows [left, right] to contain the circles around the cell's vertices that pass through its site.
+// Only points inside those circles can change the cell.
+static void GetVoronoiCellExtents(const jcv_site* site, float* left, float* right)
+{
+    for (const jcv_graphedge* e = site->edges; e; e = e->next)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            const jcv_point& v = e->pos[i];
+            float dx = v.x - site->p.x;
+            float dy = v.y - site->p.y;
+            float r = sqrtf(dx*dx + dy*dy) * 1.0001f; // a bit larger, for the precision
+            if (v.x - r < *left)
+                *left = v.x - r;
+            if (v.x + r > *right)
+                *right = v.x + r;
+        }
+    }
+}
+
+static void GenerateVoronoiStrip(void* _ctx, int strip_index)
+{
+    const SVoronoiPartition* partition = (const SVoronoiPartition*)_ctx;
+    SVoronoiStrip* strip = &g_VoronoiStrips[strip_index];
+
+    int bucket_first = strip_index * VORONOI_BUCKETS_PER_STRIP;
+    int bucket_last = bucket_first + VORONOI_BUCKETS_PER_STRIP - 1;
+    float x0 = partition->rect.min.x + bucket_first * partition->bucket_width;
+    float x1 = x0 + VORONOI_BUCKETS_PER_STRIP * partition->bucket_width;
+
+    strip->num_retries = 0;
+    float left = x0 - partition->margin;
+    float right = x1 + partition->margin;
+    while (true)
+    {
+        // Points outside of the rect are culled anyway, so there's no need for a margin there
+        bool whole_left = left <= partition->rect.min.x;
+        bool whole_right = right >= partition->rect.max.x;
+        if (whole_left)
+            left = -FLT_MAX;
+        if (whole_right)
+            right = FLT_MAX;
+        int bucket_begin = whole_left ? 0 : GetVoronoiBucket(partition, left);
+        int bucket_end = whole_right ? partition->num_buckets : GetVoronoiBucket(partition, right) + 1;
+
+        int count = partition->bucket_offsets[bucket_end] - partition->bucket_offsets[bucket_begin];
+        if (strip->capacity < count)
+        {
+            strip->points = (jcv_point*)realloc(strip->points, sizeof(jcv_point) * count);
+            strip->indices = (int*)realloc(strip->indices, sizeof(int) * count);
+            strip->capacity = count;
+        }
+
+        // Keep the original order of the points, for the same duplicate removal as the full diagram
+        int num_points = 0;
+        for (int b = bucket_begin; b < bucket_end; ++b)
+        {
+            for (int i = partition->bucket_offsets[b]; i < partition->bucket_offsets[b+1]; ++i)
+            {
+                int index = partition->bucket_points[i];
+                const jcv_point& p = partition->points[index];
+                if (p.x < left || p.x > right)
+                    continue;
+                strip->points[num_points] = p;
+                strip->indices[num_points] = index;
+                ++num_points;
+            }
+        }
+        strip->num_points = num_points;
+
+        jcv_diagram_regenerate(num_points, strip->points, &partition->rect, &strip->diagram);
+
+        if (whole_left && whole_right)
+            break; // All points were used
+
+        // The owned cells are the same as in the full diagram if all the points that could change them were used
+        float needed_left = left;
+        float needed_right = right;
+        const jcv_site* sites = jcv_diagram_get_sites(&strip->diagram);
+        for (int i = 0; i < strip->diagram.numsites; ++i)
+        {
+            int bucket = partition->point_bucket[strip->indices[sites[i].index]];
+            if (bucket < bucket_first || bucket > bucket_last)
+                continue;
+            GetVoronoiCellExtents(&sites[i], &needed_left, &needed_right);
+        }
+        if (needed_left >= left && needed_right <= right)
+            break;
+
+        // The cells only shrink with more points, so the new range is usually enough on the next try
+        left = needed_left;
+        right = needed_right;
+        strip->num_retries++;
+    }
+
+    // Store the edge count of the owned cells, for the offsets
+    int* offsets = partition->graph->offsets;
+    int num_edges = 0;
+    const jcv_site* sites = jcv_diagram_get_sites(&strip->diagram);
+    for (int i = 0; i < strip->diagram.numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        int index = strip->indices[site->index];
+        int bucket = partition->point_bucket[index];
+        if (bucket < bucket_first || bucket > bucket_last)
+            continue;
+
+        int count = 0;
+        for (const jcv_graphedge* e = site->edges; e; e = e->next)
+            ++count;
+        offsets[index + 1] = count;
+        num_edges += count;
+    }
+    strip->num_edges = num_edges;
+}
+
+static void WriteVoronoiStrip(void* _ctx, int strip_index)
+{
+    const SVoronoiPartition* partition = (const SVoronoiPartition*)_ctx;
+    SVoronoiStrip* strip = &g_VoronoiStrips[strip_index];
+    SVoronoiGraph* graph = partition->graph;
+
+    int bucket_first = strip_index * VORONOI_BUCKETS_PER_STRIP;
+    int bucket_last = bucket_first + VORONOI_BUCKETS_PER_STRIP - 1;
+
+    strip->num_open_edges = 0;
+    const jcv_site* sites = jcv_diagram_get_sites(&strip->diagram);
+    for (int i = 0; i < strip->diagram.numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        int index = strip->indices[site->index];
+        int bucket = partition->point_bucket[index];
+        if (bucket < bucket_first || bucket > bucket_last)
+            continue;
+
+        strip->num_open_edges += CheckVoronoiCell(site);
+        int offset = graph->offsets[index];
+        for (const jcv_graphedge* e = site->edges; e; e = e->next, ++offset)
+        {
+            graph->vertices[offset] = e->pos[0];
+            graph->neighbors[offset] = e->neighbor ? strip->indices[e->neighbor->index] : -1;
+        }
+    }
+}
+
+void GenerateVoronoiPartitioned(int num_points, const jcv_point* points, const jcv_rect* rect, SVoronoiGraph* graph)
+{
+    SVoronoiPartition partition;
+    partition.num_points = num_points;
+    partition.points = points;
+    partition.rect = *rect;
+    partition.num_strips = Clampi(1, VORONOI_MAX_STRIPS, num_points / VORONOI_POINTS_PER_STRIP);
+    partition.num_buckets = partition.num_strips * VORONOI_BUCKETS_PER_STRIP;
+    partition.bucket_width = (rect->max.x - rect->min.x) / partition.num_buckets;
+    partition.graph = graph;
+
+    // Start with a margin of a few times the average distance between the points
+    float area = (rect->max.x - rect->min.x) * (rect->max.y - rect->min.y);
+    partition.margin = 4.0f * sqrtf(area / (num_points > 0 ? num_points : 1));
+
+    int num_ints = (partition.num_buckets + 1) + num_points * 2;
+    if (g_VoronoiBucketsCapacity < num_ints)
+    {
+        g_VoronoiBuckets = (int*)realloc(g_VoronoiBuckets, sizeof(int) * num_ints);
+        g_VoronoiBucketsCapacity = num_ints;
+    }
+    partition.bucket_offsets = g_VoronoiBuckets;
+    partition.bucket_points = partition.bucket_offsets + partition.num_buckets + 1;
+    partition.point_bucket = partition.bucket_points + num_points;
+
+    // Counting sort of the points into the buckets along x
+    int* bucket_offsets = partition.bucket_offsets;
+    memset(bucket_offsets, 0, sizeof(int) * (partition.num_buckets + 1));
+    for (int i = 0; i < num_points; ++i)
+    {
+        const jcv_point& p = points[i];
+        int bucket = -1;
+        if (p.x >= rect->min.x && p.x <= rect->max.x && p.y >= rect->min.y && p.y <= rect->max.y)
+        {
+            bucket = GetVoronoiBucket(&partition, p.x);
+            bucket_offsets[bucket + 1]++;
+        }
+        partition.point_bucket[i] = bucket;
+    }
+    for (int i = 0; i < partition.num_buckets; ++i)
+        bucket_offsets[i + 1] += bucket_offsets[i];
+    for (int i = 0; i < num_points; ++i)
+    {
+        int bucket = partition.point_bucket[i];
+        if (bucket >= 0)
+            partition.bucket_points[bucket_offsets[bucket]++] = i;
+    }
+    for (int i = partition.num_buckets; i > 0; --i)
+        bucket_offsets[i] = bucket_offsets[i - 1];
+    bucket_offsets[0] = 0;
+
+    if (graph->offsets == 0 || graph->capacity_cells < num_points)
+    {
+        graph->offsets = (int*)realloc(graph->offsets, sizeof(int) * (num_points + 1));
+        graph->capacity_cells = num_points;
+    }
+    graph->num_cells = num_points;
+    memset(graph->offsets, 0, sizeof(int) * (num_points + 1));
+
+    JobsParallelFor(partition.num_strips, GenerateVoronoiStrip, &partition);
+
+    int num_edges = 0;
+    for (int i = 0; i < partition.num_strips; ++i)
+        num_edges += g_VoronoiStrips[i].num_edges;
+    for (int i = 0; i < num_points; ++i)
+        graph->offsets[i + 1] += graph->offsets[i];
+
+    if (graph->capacity_edges < num_edges)
+    {
+        graph->vertices = (jcv_point*)realloc(graph->vertices, sizeof(jcv_point) * num_edges);
+        graph->neighbors = (int*)realloc(graph->neighbors, sizeof(int) * num_edges);
+        graph->capacity_edges = num_edges;
+    }
+    graph->num_edges = num_edges;
+
+    JobsParallelFor(partition.num_strips, WriteVoronoiStrip, &partition);
+
+    graph->num_open_edges = 0;
+    for (int i = 0; i < partition.num_strips; ++i)
+        graph->num_open_edges += g_VoronoiStrips[i].num_open_edges;
+}
+
+// DELAUNAY (RELAXATION)
+//
+// The relaxation moves the points only a little in the later iterations, so instead of generating the
+// voronoi diagram each time, we keep its dual, the Delaunay triangulation, and move its points.
+// A point is moved as long as no triangle around it is flipped over, and then edge flips (Lawson)
+// restore the Delaunay property, so only the triangles around the points that moved are touched.
+// The voronoi cells are the circumcenters of the triangles around each point, clipped to the rect.
+// Four points far outside of the rect enclose all the other points, so that every cell is closed.
+
+#define DELAUNAY_NUM_FRAME_POINTS   4
+
+struct STriangle
+{
+    int v[3];   // The points, in CCW order
+    int n[3];   // The triangle on the other side of the edge opposite v[i], or -1
+};
+
+struct SDelaunay
+{
+    int         num_points;     // Not counting the frame points
+    jcv_point*  points;         // num_points + the frame points
+    int*        point_triangle; // A triangle touching each point, or -1 if the point isn't in the triangulation (e.g. a duplicate)
+    STriangle*  triangles;
+    int         num_triangles;
+    int         capacity_points;
+    int         capacity_triangles;
+    int*        order;          // The points in the order they were inserted (spatially coherent)
+    int*        stack;          // The edges to check (triangle * 3 + edge)
+    int         stack_size;
+    int         capacity_stack;
+    int         last_triangle;  // Where the next point location starts
+    int         num_flips;      // Stats for the last build/move
+    int         num_rebuilds;
+};
+
+static SDelaunay g_Delaunay;
+static jcv_point* g_DelaunayPolygon = 0;  // Scratch space for clipping the cells
+static int*       g_DelaunayPolygonNeighbors = 0;
+static int        g_DelaunayPolygonCapacity = 0;
+
+static inline double Orient2D(const jcv_point& a, const jcv_point& b, const jcv_point& c)
+{
+    return ((double)b.x - a.x) * ((double)c.y - a.y) - ((double)b.y - a.y) * ((double)c.x - a.x);
+}
+
+// > 0 if d is inside the circumcircle of the CCW triangle a, b, c.
+// If the result is smaller than the error bound, the sign may be wrong (i.e. almost cocircular points)
+static inline double InCircleDet(const jcv_point& a, const jcv_point& b, const jcv_point& c, const jcv_point& d, double* error_bound)
+{
+    double adx = (double)a.x - d.x, ady = (double)a.y - d.y;
+    double bdx = (double)b.x - d.x, bdy = (double)b.y - d.y;
+    double cdx = (double)c.x - d.x, cdy = (double)c.y - d.y;
+    double alift = adx * adx + ady * ady;
+    double blift = bdx * bdx + bdy * bdy;
+    double clift = cdx * cdx + cdy * cdy;
+    double bc = bdx * cdy - cdx * bdy;
+    double ca = cdx * ady - adx * cdy;
+    double ab = adx * bdy - bdx * ady;
+    double permanent = (fabs(bdx * cdy) + fabs(cdx * bdy)) * alift
+                     + (fabs(cdx * ady) + fabs(adx * cdy)) * blift
+                     + (fabs(adx * bdy) + fabs(bdx * ady)) * clift;
+    *error_bound = 1.2e-15 * permanent;
+    return alift * bc + blift * ca + clift * ab;
+}
+
+// InCircle of the points with these indices. When the points are almost cocircular, the determinant is
+// computed with the points in the same order, so the test gives the same answer for both ways of
+// triangulating the four points, and the edge flips can't go back and forth
+static double InCircle(const jcv_point* points, int a, int b, int c, int d)
+{
+    double error_bound;
+    double det = InCircleDet(points[a], points[b], points[c], points[d], &error_bound);
+    if (det > error_bound || det < -error_bound)
+        return det;
+
+    int v[4] = { a, b, c, d };
+    double sign = 1.0;
+    for (int i = 1; i < 4; ++i)
+    {
+        for (int j = i; j > 0 && v[j-1] > v[j]; --j)
+        {
+            int tmp = v[j]; v[j] = v[j-1]; v[j-1] = tmp;
+            sign = -sign;
+        }
+    }
+    return sign * InCircleDet(points[v[0]], points[v[1]], points[v[2]], points[v[3]], &error_bound);
+}
+
+static inline int TriangleEdgeTo(const STriangle& t, int neighbor)
+{
+    return t.n[0] == neighbor ? 0 : (t.n[1] == neighbor ? 1 : 2);
+}
+
+static inline void DelaunayReplaceNeighbor(SDelaunay* d, int t, int old_neighbor, int new_neighbor)
+{
+    if (t < 0)
+        return;
+    STriangle& tri = d->triangles[t];
+    tri.n[TriangleEdgeTo(tri, old_neighbor)] = new_neighbor;
+}
+
+static inline void DelaunayPushEdge(SDelaunay* d, int t, int edge)
+{
+    if (d->stack_size == d->capacity_stack)
+    {
+        d->capacity_stack = d->capacity_stack ? d->capacity_stack * 2 : 1024;
+        d->stack = (int*)realloc(d->stack, sizeof(int) * d->capacity_stack);
+    }
+    d->stack[d->stack_size++] = t * 3 + edge;
+}
+
+static inline int DelaunayNewTriangle(SDelaunay* d, int a, int b, int c, int na, int nb, int nc)
+{
+    int t = d->num_triangles++;
+    STriangle& tri = d->triangles[t];
+    tri.v[0] = a; tri.v[1] = b; tri.v[2] = c;
+    tri.n[0] = na; tri.n[1] = nb; tri.n[2] = nc;
+    d->point_triangle[a] = t;
+    d->point_triangle[b] = t;
+    d->point_triangle[c] = t;
+    return t;
+}
+
+// Flips the edge opposite v[edge] in triangle t, and pushes the edges around the new quad
+static void DelaunayFlip(SDelaunay* d, int t, int edge)
+{
+    STriangle& tri = d->triangles[t];
+    int u = tri.n[edge];
+    STriangle& utri = d->triangles[u];
+    int uedge = TriangleEdgeTo(utri, t);
+
+    int a = tri.v[edge];
+    int b = tri.v[(edge + 1) % 3];
+    int c = tri.v[(edge + 2) % 3];
+    int p = utri.v[uedge];
+    int n_ca = tri.n[(edge + 1) % 3];
+    int n_ab = tri.n[(edge + 2) % 3];
+    int n_bp = utri.n[(uedge + 1) % 3];
+    int n_pc = utri.n[(uedge + 2) % 3];
+
+    // t becomes (a, b, p) and u becomes (a, p, c)
+    tri.v[0] = a; tri.v[1] = b; tri.v[2] = p;
+    tri.n[0] = n_bp; tri.n[1] = u; tri.n[2] = n_ab;
+    utri.v[0] = a; utri.v[1] = p; utri.v[2] = c;
+    utri.n[0] = n_pc; utri.n[1] = n_ca; utri.n[2] = t;
+
+    DelaunayReplaceNeighbor(d, n_bp, u, t);
+    DelaunayReplaceNeighbor(d, n_ca, t, u);
+    d->point_triangle[b] = t;
+    d->point_triangle[c] = u;
+    d->num_flips++;
+
+    DelaunayPushEdge(d, t, 0);
+    DelaunayPushEdge(d, t, 2);
+    DelaunayPushEdge(d, u, 0);
+    DelaunayPushEdge(d, u, 1);
+}
+
+// Flips edges until all the pushed edges (and the ones around the flips) are locally Delaunay
+static void DelaunayLegalize(SDelaunay* d)
+{
+    while (d->stack_size > 0)
+    {
+        int item = d->stack[--d->stack_size];
+        int t = item / 3;
+        int edge = item % 3;
+        const STriangle& tri = d->triangles[t];
+        int u = tri.n[edge];
+        if (u < 0)
+            continue;
+        const STriangle& utri = d->triangles[u];
+        int p = utri.v[TriangleEdgeTo(utri, t)];
+        if (InCircle(d->points, tri.v[0], tri.v[1], tri.v[2], p) > 0)
+            DelaunayFlip(d, t, edge);
+    }
+}
+
+// Walks from the last found triangle towards the point.
+// Returns the triangle containing the point, and the edge the point is on (or -1).
+// Returns -1 if the point is already in the triangulation.
+static int DelaunayLocate(SDelaunay* d, const jcv_point& p, int* out_edge)
+{
+    const jcv_point* points = d->points;
+    int t = d->last_triangle;
+    int start = 0;
+    while (true)
+    {
+        const STriangle& tri = d->triangles[t];
+        int next = -1;
+        int on_edge = -1;
+        // Alternate the first edge to test, so the walk cannot cycle on degenerate input
+        for (int k = 0; k < 3; ++k)
+        {
+            int i = (start + k) % 3;
+            double o = Orient2D(points[tri.v[(i + 1) % 3]], points[tri.v[(i + 2) % 3]], p);
+            if (o < 0)
+            {
+                next = tri.n[i];
+                break;
+            }
+            if (o == 0)
+                on_edge = i;
+        }
+        start = (start + 1) % 3;
+        if (next < 0)
+        {
+            d->last_triangle = t;
+            for (int i = 0; i < 3; ++i)
+            {
+                const jcv_point& v = points[tri.v[i]];
+                if (v.x == p.x && v.y == p.y)
+                    return -1;
+            }
+            *out_edge = on_edge;
+            return t;
+        }
+        t = next;
+    }
+}
+
+static void DelaunayInsert(SDelaunay* d, int index)
+{
+    const jcv_point& p = d->points[index];
+    int edge;
+    int t = DelaunayLocate(d, p, &edge);
+    if (t < 0)
+        return; // duplicate
+
+    STriangle tri = d->triangles[t];
+    if (edge < 0)
+    {
+        // Split the triangle into three: t = (p, b, c), t1 = (a, p, c), t2 = (a, b, p)
+        int a = tri.v[0], b = tri.v[1], c = tri.v[2];
+        int t1 = d->num_triangles;
+        int t2 = t1 + 1;
+        DelaunayNewTriangle(d, a, index, c, t, tri.n[1], t2);
+        DelaunayNewTriangle(d, a, b, index, t, t1, tri.n[2]);
+        STriangle& nt = d->triangles[t];
+        nt.v[0] = index;
+        nt.n[1] = t1;
+        nt.n[2] = t2;
+        d->point_triangle[index] = t;
+        d->point_triangle[b] = t;
+        d->point_triangle[c] = t;
+        DelaunayReplaceNeighbor(d, tri.n[1], t, t1);
+        DelaunayReplaceNeighbor(d, tri.n[2], t, t2);
+
+        DelaunayPushEdge(d, t, 0);
+        DelaunayPushEdge(d, t1, 1);
+        DelaunayPushEdge(d, t2, 2);
+    }
+    else
+    {
+        // The point is on the edge between t = (a, b, c) and u = (q, c, b): split both into two
+        int a = tri.v[edge], b = tri.v[(edge + 1) % 3], c = tri.v[(edge + 2) % 3];
+        int n_ca = tri.n[(edge + 1) % 3];
+        int n_ab = tri.n[(edge + 2) % 3];
+        int u = tri.n[edge];
+        STriangle utri = d->triangles[u];
+        int uedge = TriangleEdgeTo(utri, t);
+        int q = utri.v[uedge];
+        int n_bq = utri.n[(uedge + 1) % 3];
+        int n_qc = utri.n[(uedge + 2) % 3];
+
+        int t1 = d->num_triangles;
+        int u1 = t1 + 1;
+        // t = (a, b, p), t1 = (a, p, c), u = (q, c, p), u1 = (q, p, b)
+        STriangle& nt = d->triangles[t];
+        nt.v[0] = a; nt.v[1] = b; nt.v[2] = index;
+        nt.n[0] = u1; nt.n[1] = t1; nt.n[2] = n_ab;
+        STriangle& nu = d->triangles[u];
+        nu.v[0] = q; nu.v[1] = c; nu.v[2] = index;
+        nu.n[0] = t1; nu.n[1] = u1; nu.n[2] = n_qc;
+        DelaunayNewTriangle(d, a, index, c, u, n_ca, t);
+        DelaunayNewTriangle(d, q, index, b, t, n_bq, u);
+        d->point_triangle[a] = t;
+        d->point_triangle[q] = u;
+        DelaunayReplaceNeighbor(d, n_ca, t, t1);
+        DelaunayReplaceNeighbor(d, n_bq, u, u1);
+
+        DelaunayPushEdge(d, t, 2);
+        DelaunayPushEdge(d, t1, 1);
+        DelaunayPushEdge(d, u, 2);
+        DelaunayPushEdge(d, u1, 1);
+    }
+    DelaunayLegalize(d);
+}
+
+static inline int DelaunayGridKey(const jcv_point& p, const jcv_rect* rect, int grid_size)
+{
+    int x = Clampi(0, grid_size - 1, (int)((p.x - rect->min.x) / (rect->max.x - rect->min.x) * grid_size));
+    int y = Clampi(0, grid_size - 1, (int)((p.y - rect->min.y) / (rect->max.y - rect->min.y) * grid_size));
+    return y * grid_size + ((y & 1) ? grid_size - 1 - x : x);
+}
+
+// Inserts the points in the order of a coarse grid, row by row (alternating the direction),
+// so that the walk from the last inserted point is short
+static void DelaunayInsertAll(SDelaunay* d, const jcv_rect* rect)
+{
+    int num_points = d->num_points;
+    int grid_size = (int)sqrtf((float)num_points * 0.5f) + 1;
+    int num_keys = grid_size * grid_size;
+    int* counts = (int*)calloc(num_keys + 1, sizeof(int));
+    int* order = d->order;
+    for (int i = 0; i < num_points; ++i)
+        counts[DelaunayGridKey(d->points[i], rect, grid_size) + 1]++;
+    for (int i = 0; i < num_keys; ++i)
+        counts[i + 1] += counts[i];
+    for (int i = 0; i < num_points; ++i)
+        order[counts[DelaunayGridKey(d->points[i], rect, grid_size)]++] = i;
+
+    for (int i = 0; i < num_points; ++i)
+        DelaunayInsert(d, order[i]);
+    free(counts);
+}
+
+static void DelaunayBuild(SDelaunay* d, int num_points, const jcv_point* points, const jcv_rect* rect)
+{
+    int total = num_points + DELAUNAY_NUM_FRAME_POINTS;
+    if (d->capacity_points < total)
+    {
+        d->points = (jcv_point*)realloc(d->points, sizeof(jcv_point) * total);
+        d->point_triangle = (int*)realloc(d->point_triangle, sizeof(int) * total);
+        d->order = (int*)realloc(d->order, sizeof(int) * total);
+        d->capacity_points = total;
+    }
+    int max_triangles = 2 * total;
+    if (d->capacity_triangles < max_triangles)
+    {
+        d->triangles = (STriangle*)realloc(d->triangles, sizeof(STriangle) * max_triangles);
+        d->capacity_triangles = max_triangles;
+    }
+    d->num_points = num_points;
+    d->num_triangles = 0;
+    d->num_flips = 0;
+    d->stack_size = 0;
+    memcpy(d->points, points, sizeof(jcv_point) * num_points);
+    for (int i = 0; i < num_points; ++i)
+        d->point_triangle[i] = -1;
+
+    // A square around the rect, far enough that the frame points never own a part of the rect
+    float cx = (rect->min.x + rect->max.x) * 0.5f;
+    float cy = (rect->min.y + rect->max.y) * 0.5f;
+    float w = rect->max.x - rect->min.x;
+    float h = rect->max.y - rect->min.y;
+    float size = 16.0f * (w > h ? w : h);
+    jcv_point* frame = d->points + num_points;
+    frame[0].x = cx - size; frame[0].y = cy - size;
+    frame[1].x = cx + size; frame[1].y = cy - size;
+    frame[2].x = cx + size; frame[2].y = cy + size;
+    frame[3].x = cx - size; frame[3].y = cy + size;
+    int f = num_points;
+    DelaunayNewTriangle(d, f + 0, f + 1, f + 2, -1, 1, -1);
+    DelaunayNewTriangle(d, f + 0, f + 2, f + 3, -1, -1, 0);
+    d->last_triangle = 0;
+
+    DelaunayInsertAll(d, rect);
+}
+
+// Tests if the triangles around the point would keep their orientation, with the point at p
+static bool DelaunayIsStarValid(const SDelaunay* d, int index, const jcv_point& p)
+{
+    int t0 = d->point_triangle[index];
+    int t = t0;
+    do
+    {
+        const STriangle& tri = d->triangles[t];
+        int k = tri.v[0] == index ? 0 : (tri.v[1] == index ? 1 : 2);
+        if (Orient2D(p, d->points[tri.v[(k + 1) % 3]], d->points[tri.v[(k + 2) % 3]]) <= 0)
+            return false;
+        t = tri.n[(k + 1) % 3];
+    } while (t != t0);
+    return true;
+}
+
+static void DelaunayPushStar(SDelaunay* d, int index)
+{
+    int t0 = d->point_triangle[index];
+    int t = t0;
+    do
+    {
+        // The edge opposite the point, and the edge to the next triangle (each edge around the point once)
+        const STriangle& tri = d->triangles[t];
+        int k = tri.v[0] == index ? 0 : (tri.v[1] == index ? 1 : 2);
+        DelaunayPushEdge(d, t, k);
+        DelaunayPushEdge(d, t, (k + 1) % 3);
+        t = tri.n[(k + 1) % 3];
+    } while (t != t0);
+}
+
+// Moves the point towards the target, as far as the triangles around it stay the right way up,
+// and restores the Delaunay property around it. The flips give it a new neighborhood, so it usually
+// reaches the target after a few steps. Returns false if it got stuck.
+static bool DelaunayMovePoint(SDelaunay* d, int index, const jcv_point& target)
+{
+    for (int step = 0; step < 16; ++step)
+    {
+        jcv_point from = d->points[index];
+        jcv_point p = target;
+        float f = 1.0f;
+        while (!DelaunayIsStarValid(d, index, p))
+        {
+            f *= 0.5f;
+            if (f < 1.0f / 256.0f)
+                return false;
+            p.x = from.x + (target.x - from.x) * f;
+            p.y = from.y + (target.y - from.y) * f;
+        }
+        d->points[index] = p;
+        DelaunayPushStar(d, index);
+        DelaunayLegalize(d);
+        if (f == 1.0f)
+            return true;
+    }
+    return false;
+}
+
+// Moves the points to the new positions, keeping the triangulation Delaunay.
+// If a point can't be moved with flips, the triangulation is built again.
+static void DelaunayMove(SDelaunay* d, const jcv_point* points, const jcv_rect* rect)
+{
+    d->num_flips = 0;
+    d->stack_size = 0;
+    int num_points = d->num_points;
+    bool missing = false;
+    for (int o = 0; o < num_points; ++o)
+    {
+        int i = d->order[o];
+        if (d->point_triangle[i] < 0)
+        {
+            d->points[i] = points[i];
+            missing = true;
+            continue;
+        }
+        if (d->points[i].x == points[i].x && d->points[i].y == points[i].y)
+            continue;
+        if (!DelaunayMovePoint(d, i, points[i]))
+        {
+            d->num_rebuilds++;
+            DelaunayBuild(d, num_points, points, rect);
+            return;
+        }
+    }
+
+    // Points that were duplicates may not be anymore
+    if (missing)
+    {
+        for (int i = 0; i < num_points; ++i)
+        {
+            if (d->point_triangle[i] < 0)
+                DelaunayInsert(d, i);
+        }
+    }
+}
+
+static inline jcv_point Circumcenter(const jcv_point& a, const jcv_point& b, const jcv_point& c)
+{
+    double bx = (double)b.x - a.x, by = (double)b.y - a.y;
+    double cx = (double)c.x - a.x, cy = (double)c.y - a.y;
+    double det = 2.0 * (bx * cy - by * cx);
+    jcv_point p;
+    if (det == 0)
+    {
+        p.x = (a.x + b.x + c.x) / 3.0f;
+        p.y = (a.y + b.y + c.y) / 3.0f;
+        return p;
+    }
+    double b2 = bx * bx + by * by;
+    double c2 = cx * cx + cy * cy;
+    p.x = (jcv_real)(a.x + (cy * b2 - by * c2) / det);
+    p.y = (jcv_real)(a.y + (bx * c2 - cx * b2) / det);
+    return p;
+}
+
+// Clips the polygon against one side of the rect (Sutherland-Hodgman). The neighbor of each vertex is the one of
+// the edge starting at it, and edges along the clip line get -1 (the map border)
+static int ClipPolygon(int count, const jcv_point* in, const int* in_neighbors, jcv_point* out, int* out_neighbors, int axis, float limit, float sign)
+{
+    int num_out = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const jcv_point& p = in[i];
+        const jcv_point& q = in[i + 1 < count ? i + 1 : 0];
+        float dp = ((axis ? p.y : p.x) - limit) * sign;
+        float dq = ((axis ? q.y : q.x) - limit) * sign;
+        bool inside_p = dp >= 0;
+        bool inside_q = dq >= 0;
+        if (inside_p)
+        {
+            out[num_out] = p;
+            out_neighbors[num_out++] = in_neighbors[i];
+        }
+        if (inside_p != inside_q)
+        {
+            float t = dp / (dp - dq);
+            jcv_point x;
+            x.x = p.x + (q.x - p.x) * t;
+            x.y = p.y + (q.y - p.y) * t;
+            if (axis)
+                x.y = limit;
+            else
+                x.x = limit;
+            out[num_out] = x;
+            out_neighbors[num_out++] = inside_p ? -1 : in_neighbors[i];
+        }
+    }
+    return num_out;
+}
+
+// Writes the voronoi cells (the dual of the triangulation) into the graph, clipped to the rect
+static void DelaunayToVoronoi(const SDelaunay* d, const jcv_rect* rect, SVoronoiGraph* graph)
+{
+    int num_cells = d->num_points;
+    if (graph->offsets == 0 || graph->capacity_cells < num_cells)
+    {
+        graph->offsets = (int*)realloc(graph->offsets, sizeof(int) * (num_cells + 1));
+        graph->capacity_cells = num_cells;
+    }
+    graph->num_cells = num_cells;
+    graph->num_open_edges = 0; // The cells are built closed
+
+    int num_edges = 0;
+    graph->offsets[0] = 0;
+    for (int i = 0; i < num_cells; ++i)
+    {
+        int t0 = d->point_triangle[i];
+        if (t0 < 0)
+        {
+            graph->offsets[i + 1] = num_edges;
+            continue;
+        }
+
+        // Walk CCW around the point. The voronoi edge from the circumcenter of t to the one of the next
+        // triangle is the dual of the edge (i, c), where t = (i, b, c)
+        int count = 0;
+        bool clip = false;
+        int t = t0;
+        do
+        {
+            const STriangle& tri = d->triangles[t];
+            int k = tri.v[0] == i ? 0 : (tri.v[1] == i ? 1 : 2);
+            int c = tri.v[(k + 2) % 3];
+
+            if (count + 4 >= g_DelaunayPolygonCapacity / 2)
+            {
+                g_DelaunayPolygonCapacity = g_DelaunayPolygonCapacity ? g_DelaunayPolygonCapacity * 2 : 64;
+                g_DelaunayPolygon = (jcv_point*)realloc(g_DelaunayPolygon, sizeof(jcv_point) * g_DelaunayPolygonCapacity);
+                g_DelaunayPolygonNeighbors = (int*)realloc(g_DelaunayPolygonNeighbors, sizeof(int) * g_DelaunayPolygonCapacity);
+            }
+            jcv_point v = Circumcenter(d->points[tri.v[0]], d->points[tri.v[1]], d->points[tri.v[2]]);
+            if (v.x < rect->min.x || v.x > rect->max.x || v.y < rect->min.y || v.y > rect->max.y)
+                clip = true;
+            g_DelaunayPolygon[count] = v;
+            g_DelaunayPolygonNeighbors[count] = c < num_cells ? c : -1;
+            ++count;
+            t = tri.n[(k + 1) % 3];
+        } while (t != t0);
+
+        jcv_point* polygon = g_DelaunayPolygon;
+        int* neighbors = g_DelaunayPolygonNeighbors;
+        if (clip)
+        {
+            // Each clip adds at most one vertex, ping pong between the two halves of the scratch space
+            int half = g_DelaunayPolygonCapacity / 2;
+            jcv_point* a = g_DelaunayPolygon;
+            int* na = g_DelaunayPolygonNeighbors;
+            jcv_point* b = g_DelaunayPolygon + half;
+            int* nb = g_DelaunayPolygonNeighbors + half;
+            count = ClipPolygon(count, a, na, b, nb, 0, rect->min.x, 1.0f);
+            count = ClipPolygon(count, b, nb, a, na, 0, rect->max.x, -1.0f);
+            count = ClipPolygon(count, a, na, b, nb, 1, rect->min.y, 1.0f);
+            count = ClipPolygon(count, b, nb, a, na, 1, rect->max.y, -1.0f);
+        }
+
+        if (graph->capacity_edges < num_edges + count)
+        {
+            int capacity = (num_edges + count) * 2 > num_cells * 8 ? (num_edges + count) * 2 : num_cells * 8;
+            graph->vertices = (jcv_point*)realloc(graph->vertices, sizeof(jcv_point) * capacity);
+            graph->neighbors = (int*)realloc(graph->neighbors, sizeof(int) * capacity);
+            graph->capacity_edges = capacity;
+        }
+        memcpy(graph->vertices + num_edges, polygon, sizeof(jcv_point) * count);
+        memcpy(graph->neighbors + num_edges, neighbors, sizeof(int) * count);
+        num_edges += count;
+        graph->offsets[i + 1] = num_edges;
+    }
+    graph->num_edges = num_edges;
+}
+
+// RELAXATION
+//
+// Each point is moved to the centroid of its cell (Lloyd). The centroid is the area weighted one
+// (shoelace formula), which converges in fewer iterations than the average of the vertices.
+// The vertices are made relative to the site, for the float precision.
+
+// Moves each point to the centroid of its cell. Returns the largest distance a point moved
+static float relax_points(const SVoronoiGraph* graph, jcv_point* points)
+{
+    float max_dist_sq = 0;
+    const jcv_point* vertices = graph->vertices;
+    for (int i = 0; i < graph->num_cells; ++i)
+    {
+        int begin = graph->offsets[i];
+        int end = graph->offsets[i + 1];
+        if (end - begin < 3)
+            continue; // no cell (e.g. a duplicate point)
+
+        float px = points[i].x;
+        float py = points[i].y;
+        float x0 = vertices[end - 1].x - px;
+        float y0 = vertices[end - 1].y - py;
+        float area = 0; // twice the area
+        float sum_x = 0;
+        float sum_y = 0;
+        for (int e = begin; e < end; ++e)
+        {
+            float x1 = vertices[e].x - px;
+            float y1 = vertices[e].y - py;
+            float cross = x0 * y1 - x1 * y0;
+            area += cross;
+            sum_x += (x0 + x1) * cross;
+            sum_y += (y0 + y1) * cross;
+            x0 = x1;
+            y0 = y1;
+        }
+        if (area <= 0)
+            continue;
+
+        float dx = sum_x / (3.0f * area);
+        float dy = sum_y / (3.0f * area);
+        if (dx*dx + dy*dy > max_dist_sq)
+            max_dist_sq = dx*dx + dy*dy;
+        points[i].x = px + dx;
+        points[i].y = py + dy;
+    }
+    return sqrtf(max_dist_sq);
+}
+
+// POISSON DISC
+//
+// Bridson's algorithm: new points are tried around a random active point, and the background grid
+// (cell size r/sqrt(2), so at most one point per cell) tells if a point is too close to another one.
+// A point is no longer active when all its tries have failed.
+// The tries are placed just outside the radius, evenly spaced around the point (as suggested by
+// Martin Roberts), instead of at random in the annulus [r, 2r]. It packs the points tighter and
+// needs fewer tries. The points are evenly spaced without any relaxation.
+
+#define POISSON_NUM_TRIES   12
+#define POISSON_DENSITY     0.82f   // The area per point, in r^2. Measured, it depends on POISSON_NUM_TRIES
+
+static inline float RandVoronoi01()
+{
+    return rand_r(&g_RandVoronoi) / (float)RAND_MAX;
+}
+
+// Allocates the points in [border, width-border) x [border, height-border), and returns the number of points
+static int GeneratePoissonPoints(int width, int height, int border, float radius, jcv_point** out_points)
+{
+    // The points are generated in the inner rect, and moved into place at the end
+    width -= 2 * border;
+    height -= 2 * border;
+
+    float cell_size = radius * 0.70710678f; // r / sqrt(2)
+    float inv_cell_size = 1.0f / cell_size;
+    float radius_sq = radius * radius;
+    float dist = radius * 1.0001f;
+    float step_cos = cosf(2.0f * PI / POISSON_NUM_TRIES);
+    float step_sin = sinf(2.0f * PI / POISSON_NUM_TRIES);
+    int grid_width = (int)ceilf(width * inv_cell_size);
+    int grid_height = (int)ceilf(height * inv_cell_size);
+
+    jcv_point* points = (jcv_point*)malloc(sizeof(jcv_point) * grid_width * grid_height);
+    int* grid = (int*)malloc(sizeof(int) * grid_width * grid_height);
+    int* active = (int*)malloc(sizeof(int) * grid_width * grid_height);
+    memset(grid, 0xFF, sizeof(int) * grid_width * grid_height);
+
+    int num_points = 0;
+    int num_active = 0;
+
+    jcv_point first;
+    first.x = RandVoronoi01() * width;
+    first.y = RandVoronoi01() * height;
+    points[num_points] = first;
+    grid[Clampi(0, grid_height-1, (int)(first.y * inv_cell_size)) * grid_width + Clampi(0, grid_width-1, (int)(first.x * inv_cell_size))] = num_points;
+    active[num_active++] = num_points++;
+
+    while (num_active > 0)
+    {
+        int active_index = rand_r(&g_RandVoronoi) % num_active;
+        jcv_point center = points[active[active_index]];
+
+        // The tries are evenly spaced around the circle, starting at a random angle
+        float angle = RandVoronoi01() * 2.0f * PI;
+        float dir_x = cosf(angle) * dist;
+        float dir_y = sinf(angle) * dist;
+
+        bool found = false;
+        for (int t = 0; t < POISSON_NUM_TRIES; ++t)
+        {
+            jcv_point p;
+            p.x = center.x + dir_x;
+            p.y = center.y + dir_y;
+            float x = dir_x * step_cos - dir_y * step_sin;
+            dir_y = dir_x * step_sin + dir_y * step_cos;
+            dir_x = x;
+            if (p.x < 0 || p.y < 0 || p.x >= width || p.y >= height)
+                continue;
+
+            int gx = (int)(p.x * inv_cell_size);
+            int gy = (int)(p.y * inv_cell_size);
+            if (gx >= grid_width || gy >= grid_height || grid[gy * grid_width + gx] >= 0)
+                continue;
+
+            // A point within r is at most 2 cells away
+            bool too_close = false;
+            int y0 = gy - 2 < 0 ? 0 : gy - 2;
+            int y1 = gy + 2 >= grid_height ? grid_height - 1 : gy + 2;
+            int x0 = gx - 2 < 0 ? 0 : gx - 2;
+            int x1 = gx + 2 >= grid_width ? grid_width - 1 : gx + 2;
+            for (int y = y0; y <= y1 && !too_close; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    int index = grid[y * grid_width + x];
+                    if (index < 0)
+                        continue;
+                    float dx = points[index].x - p.x;
+                    float dy = points[index].y - p.y;
+                    if (dx*dx + dy*dy < radius_sq)
+                    {
+                        too_close = true;
+                        break;
+                    }
+                }
+            }
+            if (too_close)
+                continue;
+
+            points[num_points] = p;
+            grid[gy * grid_width + gx] = num_points;
+            active[num_active++] = num_points++;
+            found = true;
+            break;
+        }
+
+        if (!found)
+            active[active_index] = active[--num_active];
+    }
+
+    for (int i = 0; i < num_points; ++i)
+    {
+        points[i].x += border;
+        points[i].y += border;
+    }
+
+    free(active);
+    free(grid);
+    *out_points = points;
+    return num_points;
+}
+
+#if defined(MAPMAKER_VORONOI_SNAP)
+// Rounds the points to the nearest 1/MAPMAKER_VORONOI_SNAP pixel
+static void SnapVoronoiPoints(int num_points, jcv_point* points)
+{
+    const double scale = MAPMAKER_VORONOI_SNAP;
+    for (int i = 0; i < num_points; ++i)
+    {
+        points[i].x = floor(points[i].x * scale + 0.5) / scale;
+        points[i].y = floor(points[i].y * scale + 0.5) / scale;
+    }
+}
+#else
+static inline void SnapVoronoiPoints(int, jcv_point*)
+{
+}
+#endif
+
+static void GenerateVoronoiCellPoints()
+{
+    if (g_VoronoiPoints)
+        free(g_VoronoiPoints);
+
+    int border = 0;//g_VoronoiParams.border;
+    int width = g_MapParams.width;
+    int height = g_MapParams.height;
+    if (g_VoronoiParams.generation_type == 0) // random
+    {
+        g_VoronoiNumPoints = g_VoronoiParams.num_cells;
+        g_VoronoiPoints = (jcv_point*)malloc(g_VoronoiParams.num_cells * sizeof(jcv_point));
+
+        int max_x_range = width - 2 * border;
+        int max_y_range = height - 2 * border;
+        for ( int i = 0; i < g_VoronoiParams.num_cells; ++i )
+        {
+            g_VoronoiPoints[i].x = (int)(border + rand_r(&g_RandVoronoi) % max_x_range);
+            g_VoronoiPoints[i].y = (int)(border + rand_r(&g_RandVoronoi) % max_y_range);
+        }
+    }
+    else if (g_VoronoiParams.generation_type == 1) // hexagonal
+    {
+        int size = (width < height ? width : height) / (g_VoronoiParams.hexagon_density * 2);
+        float w = size * sqrtf(3.0f);
+        float h = size * 2.0f;
+
+        int xsteps = width / w + 1;
+        int ysteps = height / (0.75f * h) + 1;
+
+// printf("size: %d\n", size);
+// printf("w, h: %f %f\n", w, h);
+// printf("xs, ys: %d %d\n", xsteps, ysteps);
+// printf("num: %d\n", g_VoronoiNumPoints);
+
+        border = 0; // apply border on the cells instead
+
+        // 2 passes: count points + allocate, fill in points
+        for (int i = 0; i < 2; ++i)
+        {
+            int count = 0;
+            for (int iy = 0; iy < ysteps; ++iy)
+            {
+                float y = iy * (h * 0.75f);
+                if (y < border || (height - y) < border)
+                    continue;
+                for (int ix = 0; ix < xsteps; ++ix)
+                {
+                    float x = w * (iy&1 ? 0.5f : 0.0f) + ix * w;
+                    if (x < border || (width - x) < border)
+                        continue;
+
+                    if (i)
+                    {
+                        g_VoronoiPoints[count].x = (int)x;
+                        g_VoronoiPoints[count].y = (int)y;
+            //printf("%d: x, y:  %f %f\n", count, x, y);
+                    }
+                    ++count;
+                }
+            }
+
+            if (i == 0)
+            {
+                g_VoronoiNumPoints = count;
+                g_VoronoiPoints = (jcv_point*)malloc(g_VoronoiNumPoints * sizeof(jcv_point));
+            }
+
+            //printf("%d  vs %d\n", g_VoronoiNumPoints, count);
+        }
+
+    }
+    else if (g_VoronoiParams.generation_type == 2) // poisson disc
+    {
+        // Leave at least one pixel to sample in
+        border = Clampi(0, ((width < height ? width : height) - 1) / 2, g_VoronoiParams.border);
+
+        // The radius that gives roughly num_cells points in the rect inside the border
+        float radius = sqrtf(POISSON_DENSITY * (width - 2 * border) * (height - 2 * border) / (float)g_VoronoiParams.num_cells);
+        g_VoronoiNumPoints = GeneratePoissonPoints(width, height, border, radius, &g_VoronoiPoints);
+    }
+
+}
+
+// CELL ID RASTER
+//
+// The cell of each pixel, so the per pixel passes don't need to rasterize the cells again.
+// The cells are scan converted (the id is written as a 4 channel "color"), which covers a pixel if its
+// center is inside the cell. The vertices of two neighbouring cells can differ in the last bits,
+// which may leave a few pixels on the edges uncovered.
+//
+// It's done in bands of rows (as the viewer draws the diagram), each band fills the cells that overlap it,
+// in order and clipped to the band, so the ids are the same as when filling the whole image at once.
+// The uncovered pixels then get the nearest site of the covered pixels in the smallest square around them
+// that has any. They are marked while the other bands may still read them, and unmarked in a last pass,
+// so the result doesn't depend on the number of threads.
+
+#define CELL_IDS_BAND_HEIGHT    32
+#define CELL_IDS_GAP_BIT        0x80000000u // Set on the filled in gaps until the last pass (and on MAPMAKER_NO_CELL)
+
+struct SCellIdsContext
+{
+    const SVoronoiGraph*    graph;
+    const jcv_point*        points;
+    const jcd_point*        vertices;       // The graph vertices, as floats
+    const int*              band_offsets;   // num_bands + 1 offsets into band_cells
+    const int*              band_cells;
+    int*                    band_gaps;      // The number of uncovered pixels in each band
+    uint32_t*               ids;
+    int                     width;
+    int                     height;
+};
+
+static uint32_t*    g_CellIds = 0;
+static int          g_CellIdsSize = 0;
+static jcd_point*   g_CellIdsVertices = 0;
+static int          g_CellIdsVerticesCapacity = 0;
+static int*         g_CellIdsCellBands = 0;     // The first and last band of each cell
+static int          g_CellIdsCellBandsCapacity = 0;
+static int*         g_CellIdsBandOffsets = 0;
+static int*         g_CellIdsBandGaps = 0;
+static int          g_CellIdsBandsCapacity = 0;
+static int*         g_CellIdsBandCells = 0;
+static int          g_CellIdsBandCellsCapacity = 0;
+
+static inline float PixelDistSq(int x, int y, const jcv_point& p)
+{
+    float dx = p.x - (x + 0.5f);
+    float dy = p.y - (y + 0.5f);
+    return dx*dx + dy*dy;
+}
+
+static inline void GetCellIdsBandClip(const SCellIdsContext* ctx, int band, jcd_rect* clip)
+{
+    clip->x0 = 0;
+    clip->x1 = ctx->width;
+    clip->y0 = band * CELL_IDS_BAND_HEIGHT;
+    clip->y1 = clip->y0 + CELL_IDS_BAND_HEIGHT < ctx->height ? clip->y0 + CELL_IDS_BAND_HEIGHT : ctx->height;
+}
+
+static void FillCellIdsBand(void* _ctx, int band)
+{
+    const SCellIdsContext* ctx = (const SCellIdsContext*)_ctx;
+    jcd_rect clip;
+    GetCellIdsBandClip(ctx, band, &clip);
+    memset(ctx->ids + clip.y0 * ctx->width, 0xFF, sizeof(uint32_t) * (clip.y1 - clip.y0) * ctx->width);
+
+    for (int c = ctx->band_offsets[band]; c < ctx->band_offsets[band + 1]; ++c)
+    {
+        int i = ctx->band_cells[c];
+        int begin = ctx->graph->offsets[i];
+        int count = ctx->graph->offsets[i+1] - begin;
+        uint32_t id = (uint32_t)i;
+        jcd_fill_convex_polygon_clip(count, ctx->vertices + begin, &clip, (uint8_t*)ctx->ids, ctx->width, 4, (const uint8_t*)&id);
+    }
+
+    // Counted while the band is still in the cache, most bands have no gaps
+    const uint32_t* ids = ctx->ids + clip.y0 * ctx->width;
+    int num_pixels = (clip.y1 - clip.y0) * ctx->width;
+    int num_gaps = 0;
+    for (int p = 0; p < num_pixels; ++p)
+        num_gaps += ids[p] == MAPMAKER_NO_CELL ? 1 : 0;
+    ctx->band_gaps[band] = num_gaps;
+}
+
+// The nearest site of the covered pixels, in the smallest square around the pixel that has any
+static uint32_t FindNearestCellId(const SCellIdsContext* ctx, int x, int y)
+{
+    int width = ctx->width;
+    int height = ctx->height;
+    int max_radius = width > height ? width : height;
+    for (int r = 1; r < max_radius; ++r)
+    {
+        uint32_t best = MAPMAKER_NO_CELL;
+        float best_dist = FLT_MAX;
+        for (int ny = y - r; ny <= y + r; ++ny)
+        {
+            if (ny < 0 || ny >= height)
+                continue;
+            for (int nx = x - r; nx <= x + r; ++nx)
+            {
+                if (nx < 0 || nx >= width)
+                    continue;
+                uint32_t id = ctx->ids[ny * width + nx];
+                if (id & CELL_IDS_GAP_BIT)
+                    continue;
+                float dist = PixelDistSq(x, y, ctx->points[id]);
+                if (dist < best_dist)
+                {
+                    best_dist = dist;
+                    best = id;
+                }
+            }
+        }
+        if (best != MAPMAKER_NO_CELL)
+            return best;
+    }
+    return MAPMAKER_NO_CELL;
+}
+
+static void FillCellIdsBandGaps(void* _ctx, int band)
+{
+    const SCellIdsContext* ctx = (const SCellIdsContext*)_ctx;
+    if (ctx->band_gaps[band] == 0)
+        return;
+    jcd_rect clip;
+    GetCellIdsBandClip(ctx, band, &clip);
+
+    for (int y = clip.y0; y < clip.y1; ++y)
+    {
+        uint32_t* row = ctx->ids + y * ctx->width;
+        for (int x = 0; x < ctx->width; ++x)
+        {
+            if (row[x] != MAPMAKER_NO_CELL)
+                continue;
+            row[x] = FindNearestCellId(ctx, x, y) | CELL_IDS_GAP_BIT;
+        }
+    }
+}
+
+static void UnmarkCellIdsBandGaps(void* _ctx, int band)
+{
+    const SCellIdsContext* ctx = (const SCellIdsContext*)_ctx;
+    if (ctx->band_gaps[band] == 0)
+        return;
+    jcd_rect clip;
+    GetCellIdsBandClip(ctx, band, &clip);
+
+    uint32_t* ids = ctx->ids + clip.y0 * ctx->width;
+    int num_pixels = (clip.y1 - clip.y0) * ctx->width;
+    for (int p = 0; p < num_pixels; ++p)
+    {
+        if (ids[p] != MAPMAKER_NO_CELL)
+            ids[p] &= ~CELL_IDS_GAP_BIT;
+    }
+}
+
+void RasterizeCellIds(const SVoronoiGraph* graph, const jcv_point* points, int width, int height, uint32_t* ids)
+{
+    int num_bands = (height + CELL_IDS_BAND_HEIGHT - 1) / CELL_IDS_BAND_HEIGHT;
+    int num_cells = graph->num_cells;
+    int num_edges = graph->offsets[num_cells];
+    assert((uint32_t)num_cells < CELL_IDS_GAP_BIT);
+
+    if (g_CellIdsVerticesCapacity < num_edges)
+    {
+        g_CellIdsVertices = (jcd_point*)realloc(g_CellIdsVertices, sizeof(jcd_point) * num_edges);
+        g_CellIdsVerticesCapacity = num_edges;
+    }
+    if (g_CellIdsCellBandsCapacity < num_cells)
+    {
+        g_CellIdsCellBands = (int*)realloc(g_CellIdsCellBands, sizeof(int) * 2 * num_cells);
+        g_CellIdsCellBandsCapacity = num_cells;
+    }
+    if (g_CellIdsBandsCapacity < num_bands + 1)
+    {
+        g_CellIdsBandOffsets = (int*)realloc(g_CellIdsBandOffsets, sizeof(int) * (num_bands + 1));
+        g_CellIdsBandGaps = (int*)realloc(g_CellIdsBandGaps, sizeof(int) * (num_bands + 1));
+        g_CellIdsBandsCapacity = num_bands + 1;
+    }
+    int* band_offsets = g_CellIdsBandOffsets;
+    memset(band_offsets, 0, sizeof(int) * (num_bands + 1));
+
+    // The rows with their pixel centers inside the vertical extent of the cell
+    for (int i = 0; i < num_cells; ++i)
+    {
+        int begin = graph->offsets[i];
+        int end = graph->offsets[i+1];
+        int* bands = g_CellIdsCellBands + i * 2;
+        if (begin == end)
+        {
+            bands[0] = 0;
+            bands[1] = -1;
+            continue;
+        }
+
+        float min_y = FLT_MAX;
+        float max_y = -FLT_MAX;
+        for (int e = begin; e < end; ++e)
+        {
+            jcd_point& v = g_CellIdsVertices[e];
+            v.x = graph->vertices[e].x;
+            v.y = graph->vertices[e].y;
+            min_y = v.y < min_y ? v.y : min_y;
+            max_y = v.y > max_y ? v.y : max_y;
+        }
+        bands[0] = Clampi(0, num_bands - 1, (int)floorf(min_y) / CELL_IDS_BAND_HEIGHT);
+        bands[1] = Clampi(0, num_bands - 1, (int)max_y / CELL_IDS_BAND_HEIGHT);
+        for (int b = bands[0]; b <= bands[1]; ++b)
+            band_offsets[b + 1]++;
+    }
+
+    for (int b = 0; b < num_bands; ++b)
+        band_offsets[b + 1] += band_offsets[b];
+    if (g_CellIdsBandCellsCapacity < band_offsets[num_bands])
+    {
+        g_CellIdsBandCells = (int*)realloc(g_CellIdsBandCells, sizeof(int) * band_offsets[num_bands]);
+        g_CellIdsBandCellsCapacity = band_offsets[num_bands];
+    }
+
+    // The cells are added in order, which moves each offset to the start of the next band
+    for (int i = 0; i < num_cells; ++i)
+    {
+        const int* bands = g_CellIdsCellBands + i * 2;
+        for (int b = bands[0]; b <= bands[1]; ++b)
+            g_CellIdsBandCells[band_offsets[b]++] = i;
+    }
+    for (int b = num_bands; b > 0; --b)
+        band_offsets[b] = band_offsets[b - 1];
+    band_offsets[0] = 0;
+
+    SCellIdsContext ctx;
+    ctx.graph = graph;
+    ctx.points = points;
+    ctx.vertices = g_CellIdsVertices;
+    ctx.band_offsets = band_offsets;
+    ctx.band_cells = g_CellIdsBandCells;
+    ctx.band_gaps = g_CellIdsBandGaps;
+    ctx.ids = ids;
+    ctx.width = width;
+    ctx.height = height;
+    JobsParallelFor(num_bands, FillCellIdsBand, &ctx);
+    if (num_edges == 0) // Nothing to fill the gaps with
+        return;
+    JobsParallelFor(num_bands, FillCellIdsBandGaps, &ctx);
+    JobsParallelFor(num_bands, UnmarkCellIdsBandGaps, &ctx);
+}
+
+void GenerateVoronoi()
+{
+    g_RandVoronoi = g_VoronoiParams.seed;
+    GenerateVoronoiCellPoints();
+    SnapVoronoiPoints(g_VoronoiNumPoints, g_VoronoiPoints);
+
+    jcv_rect rect = {0, 0, g_MapParams.width, g_MapParams.height};
+
+    // The relaxation moves the points of the triangulation, instead of generating the diagram each time.
+    // It stops early when no point moves more than relax_epsilon.
+    if (g_VoronoiParams.generation_type == 0) // random
+    {
+        g_Delaunay.num_rebuilds = 0;
+        for (int i = 0; i < g_VoronoiParams.num_relaxations; ++i)
+        {
+            if (i == 0)
+                DelaunayBuild(&g_Delaunay, g_VoronoiNumPoints, g_VoronoiPoints, &rect);
+            else
+                DelaunayMove(&g_Delaunay, g_VoronoiPoints, &rect);
+            DelaunayToVoronoi(&g_Delaunay, &rect, &g_VoronoiGraph);
+            float max_dist = relax_points(&g_VoronoiGraph, g_VoronoiPoints);
+            SnapVoronoiPoints(g_VoronoiNumPoints, g_VoronoiPoints);
+            if (max_dist <= g_VoronoiParams.relax_epsilon)
+                break;
+        }
+    }
+
+    // The strip diagrams keep their memory between the generations (and between calls to GenerateVoronoi)
+    GenerateVoronoiPartitioned(g_VoronoiNumPoints, g_VoronoiPoints, &rect, &g_VoronoiGraph);
+
+    int size = g_MapParams.width * g_MapParams.height;
+    if (g_CellIdsSize != size)
+    {
+        g_CellIds = (uint32_t*)realloc(g_CellIds, sizeof(uint32_t) * size);
+        g_CellIdsSize = size;
+    }
+    RasterizeCellIds(&g_VoronoiGraph, g_VoronoiPoints, g_MapParams.width, g_MapParams.height, g_CellIds);
+}
+
+// MAP - COAST DISTANCE
+//
+// The distance (in pixels) from each pixel below the sea level to the nearest pixel above it (0 on land).
+// It's an exact euclidean distance transform (Felzenszwalb and Huttenlocher, "Distance Transforms of
+// Sampled Functions"), which is linear in the number of pixels:
+// First the distance to the nearest land pixel in the same row, with two scans per row. Then, per column,
+// the lower envelope of the parabolas (y - q)^2 + f(q), where f is the squared row distance.
+
+#define COAST_DISTANCE_BLOCK        16  // The columns per job, gathered together to read whole cache lines
+
+static float*   g_CoastDistance = 0;
+static int      g_CoastDistanceSize = 0;
+
+struct SCoastDistanceContext
+{
+    const height_t* heights;
+    int             sea_level_height;
+    int             width;
+    int             height;
+    int             rows_per_job;
+    float*          distances;  // The squared distances, until the last pass
+};
+
+static void CoastDistanceRows(void* _ctx, int job)
+{
+    const SCoastDistanceContext* ctx = (const SCoastDistanceContext*)_ctx;
+    int width = ctx->width;
+    int y0 = job * ctx->rows_per_job;
+    int y1 = y0 + ctx->rows_per_job;
+    if (y1 > ctx->height)
+        y1 = ctx->height;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const height_t* heights = ctx->heights + y * width;
+        float* d = ctx->distances + y * width;
+
+        int last = -1; // The last land pixel
+        for (int x = 0; x < width; ++x)
+        {
+            if (heights[x] >= ctx->sea_level_height)
+                last = x;
+            d[x] = last < 0 ? MAPMAKER_COAST_DISTANCE_INF : (float)(x - last);
+        }
+        last = -1;
+        for (int x = width - 1; x >= 0; --x)
+        {
+            if (heights[x] >= ctx->sea_level_height)
+                last = x;
+            if (last >= 0 && (float)(last - x) < d[x])
+                d[x] = (float)(last - x);
+            if (d[x] != MAPMAKER_COAST_DISTANCE_INF)
+                d[x] = d[x] * d[x];
+        }
+    }
+}
+
+// The squared distance transform of the sampled function f (n samples)
+// v and z are scratch space, n and n + 1 entries
+static void DistanceTransform1D(const float* f, int n, float* d, int* v, float* z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -MAPMAKER_COAST_DISTANCE_INF;
+    z[1] = MAPMAKER_COAST_DISTANCE_INF;
+    for (int q = 1; q < n; ++q)
+    {
+        // The intersection with the parabola of the rightmost envelope point
+        float s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+        while (s <= z[k])
+        {
+            --k;
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = MAPMAKER_COAST_DISTANCE_INF;
+    }
+
+    k = 0;
+    for (int q = 0; q < n; ++q)
+    {
+        while (z[k+1] < q)
+            ++k;
+        float dq = (float)(q - v[k]);
+        d[q] = dq * dq + f[v[k]];
+    }
+}
+
+static void CoastDistanceColumns(void* _ctx, int job)
+{
+    const SCoastDistanceContext* ctx = (const SCoastDistanceContext*)_ctx;
+    int width = ctx->width;
+    int height = ctx->height;
+    int x0 = job * COAST_DISTANCE_BLOCK;
+    int num_columns = width - x0 < COAST_DISTANCE_BLOCK ? width - x0 : COAST_DISTANCE_BLOCK;
+
+    float* columns = (float*)malloc(sizeof(float) * (COAST_DISTANCE_BLOCK + 2) * height + sizeof(float));
+    float* d = columns + COAST_DISTANCE_BLOCK * height;
+    float* z = d + height;  // height + 1
+    int* v = (int*)malloc(sizeof(int) * height);
+
+    for (int y = 0; y < height; ++y)
+    {
+        const float* row = ctx->distances + y * width + x0;
+        for (int c = 0; c < num_columns; ++c)
+            columns[c * height + y] = row[c];
+    }
+
+    for (int c = 0; c < num_columns; ++c)
+    {
+        float* f = columns + c * height;
+        DistanceTransform1D(f, height, d, v, z);
+        memcpy(f, d, sizeof(float) * height);
+    }
+
+    // Without any land in the column's parabolas, the distance stays at the sentinel (not its square root)
+    for (int y = 0; y < height; ++y)
+    {
+        float* row = ctx->distances + y * width + x0;
+        for (int c = 0; c < num_columns; ++c)
+        {
+            float d2 = columns[c * height + y];
+            row[c] = d2 >= MAPMAKER_COAST_DISTANCE_INF ? MAPMAKER_COAST_DISTANCE_INF : sqrtf(d2);
+        }
+    }
+
+    free(v);
+    free(columns);
+}
+
+void CalcCoastDistance(int width, int height, const height_t* heights, int sea_level, float* distances)
+{
+    SCoastDistanceContext ctx;
+    ctx.heights = heights;
+    ctx.sea_level_height = sea_level << MAPMAKER_HEIGHT_SHIFT;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.rows_per_job = 16;
+    ctx.distances = distances;
+    JobsParallelFor((height + ctx.rows_per_job - 1) / ctx.rows_per_job, CoastDistanceRows, &ctx);
+    JobsParallelFor((width + COAST_DISTANCE_BLOCK - 1) / COAST_DISTANCE_BLOCK, CoastDistanceColumns, &ctx);
+}
+
+// MAP - COLORS
+
+static inline void LightenColor(uint8_t* color, float percent)
+{
+    color[0] = (uint8_t)Clampf(0.0f, 255.0f, color[0] + color[0] * percent);
+    color[1] = (uint8_t)Clampf(0.0f, 255.0f, color[1] + color[1] * percent);
+    color[2] = (uint8_t)Clampf(0.0f, 255.0f, color[2] + color[2] * percent);
+}
+
+static inline void DarkenColor(uint8_t* color, float percent)
+{
+    color[0] = (uint8_t)Clampf(0.0f, 255.0f, color[0] - color[0] * percent);
+    color[1] = (uint8_t)Clampf(0.0f, 255.0f, color[1] - color[1] * percent);
+    color[2] = (uint8_t)Clampf(0.0f, 255.0f, color[2] - color[2] * percent);
+}
+
+// The colors only depend on the height, so we store them in a table. The limits are 8 bit, but the
+// table has up to 12 bits, so the lightening within each band still uses the extra height precision.
+#define COLOR_LUT_BITS  (MAPMAKER_HEIGHT_BITS < 12 ? MAPMAKER_HEIGHT_BITS : 12)
+#define COLOR_LUT_SIZE  (1 << COLOR_LUT_BITS)
+
+static void BuildColorLUT(int num_limits, const uint8_t* height_limits, const uint8_t* height_colors, uint8_t* out_lut)
+{
+    const float lighten_percent = 0.2f;
+    const float value_scale = 1.0f / (1 << (COLOR_LUT_BITS - 8)); // same units as the 8 bit limits
+    for( int index = 0; index < COLOR_LUT_SIZE; ++index )
+    {
+        const int value8 = index >> (COLOR_LUT_BITS - 8);
+        const float value = index * value_scale;
+        uint8_t* color = &out_lut[index*4];
+        color[0] = color[1] = color[2] = 0;
+        color[3] = 0xFF;
+        for( int l = 0; l < num_limits; ++l )
+        {
+            if( value8 <= height_limits[l] )
+            {
+                color[0] = height_colors[l*3+0];
+                color[1] = height_colors[l*3+1];
+                color[2] = height_colors[l*3+2];
+
+                // make the height variations visible in the color
+                {
+                    const float maxlimit = float(height_limits[l]);
+                    const float minlimit = float(l == 0 ? 0 : height_limits[l-1]);
+                    const float scale = maxlimit > minlimit ? Clampf(0.0f, 1.0f, (value - minlimit) / (maxlimit - minlimit)) : 0.0f;
+
+                    LightenColor( color, lighten_percent * scale );
+                }
+                break;
+            }
+        }
+    }
+}
+
+#define COLOR_LUT_MAX_LIMITS 8
+
+static uint32_t g_ColorLUT[COLOR_LUT_SIZE];
+static int      g_ColorLUTNumLimits = -1;   // The limits and colors the table was built from, -1 if it's not built yet
+static uint8_t  g_ColorLUTLimits[COLOR_LUT_MAX_LIMITS];
+static uint8_t  g_ColorLUTColors[COLOR_LUT_MAX_LIMITS * 3];
+
+static void ColorizeMapInternal(int width, int height, height_t* heights, int num_limits, uint8_t* height_limits, uint8_t* height_colors, uint8_t* out_colors)
+{
+    // Only rebuild the table when the limits or colors change
+    assert(num_limits >= 0 && num_limits <= COLOR_LUT_MAX_LIMITS);
+    if (num_limits != g_ColorLUTNumLimits ||
+        memcmp(height_limits, g_ColorLUTLimits, num_limits) != 0 ||
+        memcmp(height_colors, g_ColorLUTColors, num_limits * 3) != 0)
+    {
+        BuildColorLUT(num_limits, height_limits, height_colors, (uint8_t*)g_ColorLUT);
+        g_ColorLUTNumLimits = num_limits;
+        memcpy(g_ColorLUTLimits, height_limits, num_limits);
+        memcpy(g_ColorLUTColors, height_colors, num_limits * 3);
+    }
+
+    const uint32_t* lut = g_ColorLUT;
+    uint32_t* out = (uint32_t*)out_colors;
+    size_t size = width * height;
+    for( size_t i = 0; i < size; ++i )
+    {
+        out[i] = lut[heights[i] >> (MAPMAKER_HEIGHT_BITS - COLOR_LUT_BITS)];
+    }
+}
+
+// The shadows are calculated from the nearest point towards the light that is above the sun angle.
+// The map is swept along lines parallel to the light direction. A point p shadows a later point q
+// when h(p) - h(q) >= tan(sun_angle) * (t(q) - t(p)), i.e. when h(p) + tan * t(p) >= h(q) + tan * t(q).
+// Along each line we keep a monotone stack of the points seen so far, where that value decreases
+// towards the top (nearer points with a higher value hide the ones below them), and the nearest
+// shadowing point is found with a binary search in the stack.
+// This is O(width*height*log(length)) regardless of shadow length.
+#define SHADOW_SEA_FALLOFF  0.0625f // The shadows in the sea fade out over this fraction of the map width from the coast
+
+static void ShadeMap(int width, int height,
+                    float light_dir_x, float light_dir_y, float sun_angle,
+                    uint8_t sea_level, float strength, float strength_sea_level,
+                    height_t* heights, const float* coast_distance, uint8_t* out_colors)
+{
+    float light_len = sqrtf(light_dir_x*light_dir_x + light_dir_y*light_dir_y);
+    if (light_len == 0.0f)
+        return; // the light is straight above
+
+    float sea_falloff = width * SHADOW_SEA_FALLOFF;
+    int numsteps = g_MapParams.shadow_step_length;
+    const int sea_level_height = sea_level << MAPMAKER_HEIGHT_SHIFT;
+    const float height_scale = 1.0f / (1 << MAPMAKER_HEIGHT_SHIFT); // same units as the 8 bit heights
+
+    // We walk away from the light, one pixel at a time along the major axis
+    float dx = -light_dir_x / light_len;
+    float dy = -light_dir_y / light_len;
+    bool major_x = fabsf(dx) >= fabsf(dy);
+    int major_size = major_x ? width : height;
+    int minor_size = major_x ? height : width;
+    bool major_reverse = (major_x ? dx : dy) < 0;
+    float slope = major_x ? dy / fabsf(dx) : dx / fabsf(dy); // minor axis movement per step
+    float step_dist = sqrtf(1.0f + slope*slope);
+
+    // The minor axis offset for each step. Since the lines are only shifted by whole pixels,
+    // each pixel is visited exactly once.
+    int* offsets = (int*)malloc(major_size * sizeof(int));
+    float tan_sun = tanf(sun_angle);
+    float* stack_t = (float*)malloc(major_size * sizeof(float));
+    float* stack_h = (float*)malloc(major_size * sizeof(float));
+    float* stack_g = (float*)malloc(major_size * sizeof(float)); // h + tan_sun * t
+    for( int k = 0; k < major_size; ++k )
+        offsets[k] = (int)floorf(slope * k + 0.5f);
+
+    int last_offset = offsets[major_size-1];
+    int line_first = last_offset > 0 ? -last_offset : 0;
+    int line_last = minor_size - 1 - (last_offset < 0 ? last_offset : 0);
+
+    for( int line = line_first; line <= line_last; ++line )
+    {
+        int stack_size = 0;
+        for( int k = 0; k < major_size; ++k )
+        {
+            int minor = line + offsets[k];
+            if (minor < 0 || minor >= minor_size)
+                continue;
+            int major = major_reverse ? major_size - 1 - k : k;
+            int x = major_x ? major : minor;
+            int y = major_x ? minor : major;
+
+            int current = heights[y * width + x];
+            float t = k * step_dist;
+            float h = current * height_scale;
+            float g = h + tan_sun * t;
+
+            // Find the nearest point that is at or above the sun angle (the last one in the stack with stack_g >= g)
+            int lo = 0;
+            int hi = stack_size;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (stack_g[mid] >= g)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if (lo > 0)
+            {
+                float height_diff = stack_h[lo-1] - h; // opposite side
+                float dist = t - stack_t[lo-1];        // adjacent side
+                float dist_steps = dist / step_dist;
+                if (height_diff > 0 && dist_steps < numsteps)
+                {
+                    float angle = atan2f(height_diff, dist);
+                    // Decrease strength further away
+                    float dist_factor = (numsteps - dist_steps) / float(numsteps);
+                    // Lerp between angles. High difference -> higher strength
+                    float angle_factor = Clampf(0.0f, 1.0f, (angle - sun_angle)/(PI_HALF - sun_angle) );
+                    float s = strength;
+                    if (current < sea_level_height)
+                    {
+                        // Deeper water further from the coast hides the shadows
+                        float depth = coast_distance ? coast_distance[y * width + x] / sea_falloff : 0.0f;
+                        s = strength_sea_level * Clampf(0.0f, 1.0f, 1.0f - depth);
+                    }
+                    int index = y * width * 4 + x * 4;
+                    DarkenColor( &out_colors[index], Clampf(0.0f, 1.0f, s + s * angle_factor) * dist_factor);
+                }
+            }
+
+            // The current point is nearer to the following points, so it hides the ones that don't shadow more than it
+            while (stack_size > 0 && stack_g[stack_size-1] <= g)
+                --stack_size;
+            stack_t[stack_size] = t;
+            stack_h[stack_size] = h;
+            stack_g[stack_size] = g;
+            ++stack_size;
+        }
+    }
+
+    free(stack_g);
+    free(stack_h);
+    free(stack_t);
+    free(offsets);
+}
+
+static inline float DegToRad(float degrees)
+{
+    return (degrees * PI) / 180.0f;
+}
+
+void ColorizeMap(height_t* heights, uint8_t* out_colors, int num_limits, uint8_t* height_limits, uint8_t* height_colors)
+{
+    ColorizeMapInternal(g_MapParams.width, g_MapParams.height, heights, num_limits, height_limits, height_colors, out_colors);
+
+    if (g_MapParams.use_shading)
+    {
+        const float* light_dir = g_MapParams.light_dir;
+        float angle = atan2f(light_dir[2], sqrtf(light_dir[0]*light_dir[0] + light_dir[1]*light_dir[1]));
+        ShadeMap(g_MapParams.width, g_MapParams.height,
                     g_MapParams.light_dir[0],
                     g_MapParams.light_dir[1],
                     angle, g_MapParams.sea_level,
                     g_MapParams.shadow_strength, g_MapParams.shadow_strength_sea,
-                    heights, out_colors);
+                    heights, g_CoastDistanceSize == g_MapParams.width * g_MapParams.height ? g_CoastDistance : 0, out_colors);
+    }
+}
+
+// MAP - CELL SETS
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    static inline int Popcount64(uint64_t v) { return (int)__popcnt64(v); }
+    static inline int CountTrailingZeros64(uint64_t v) { unsigned long index; _BitScanForward64(&index, v); return (int)index; }
+#else
+    static inline int Popcount64(uint64_t v) { return __builtin_popcountll(v); }
+    static inline int CountTrailingZeros64(uint64_t v) { return __builtin_ctzll(v); }
+#endif
+
+int BitsetCount(const uint64_t* bits, int count)
+{
+    int num_words = MAPMAKER_BITSET_WORDS(count);
+    int result = 0;
+    for (int i = 0; i < num_words; ++i)
+        result += Popcount64(bits[i]);
+    return result;
+}
+
+int BitsetNext(const uint64_t* bits, int count, int start)
+{
+    if (start >= count)
+        return count;
+    int num_words = MAPMAKER_BITSET_WORDS(count);
+    int word = start >> 6;
+    uint64_t v = bits[word] & (~(uint64_t)0 << (start & 63));
+    while (v == 0)
+    {
+        if (++word == num_words)
+            return count;
+        v = bits[word];
+    }
+    return word * 64 + CountTrailingZeros64(v);
+}
+
+// MAP - CELL ELEVATION
+//
+// The min/mean/max elevation of each cell, from all of its pixels (using the cell id raster).
+// The rows are split into jobs, and the per cell accumulators are shared by all jobs, so the memory
+// is the same for any number of threads. A cell that lies within the rows of one job (from its vertices)
+// is owned by that job, which adds to it without atomics. The rest of the pixels (the cells on the
+// job boundaries, and gap pixels that went to a cell outside the rows) are added to a second set of
+// accumulators with atomics, a run of pixels at a time. There are a few jobs per thread, to keep the
+// boundaries few. The totals are integers, so they don't depend on the order of the jobs.
+
+#define CELL_STATS_JOBS_PER_THREAD  4
+#define CELL_STATS_CELLS            4096    // The number of cells per job, when preparing and writing the results
+
+#if defined(_MSC_VER)
+    static inline void AtomicAdd32(volatile uint32_t* p, uint32_t v) { _InterlockedExchangeAdd((volatile long*)p, (long)v); }
+    static inline uint32_t AtomicCompareExchange32(volatile uint32_t* p, uint32_t expected, uint32_t v) { return (uint32_t)_InterlockedCompareExchange((volatile long*)p, (long)v, (long)expected); }
+#else
+    static inline void AtomicAdd32(volatile uint32_t* p, uint32_t v) { __sync_fetch_and_add(p, v); }
+    static inline uint32_t AtomicCompareExchange32(volatile uint32_t* p, uint32_t expected, uint32_t v) { return __sync_val_compare_and_swap(p, expected, v); }
+#endif
+
+// Only written by the owner job. Kept small, since it's read for every pixel
+struct SCellStatsOwned
+{
+    uint32_t    sum;
+    uint32_t    count;
+    uint8_t     min;
+    uint8_t     max;
+    int16_t     owner;  // The job that owns the cell, or -1
+};
+
+// Only written with atomics (32 bit, so also the min and max)
+struct SCellStatsShared
+{
+    uint32_t    sum;
+    uint32_t    count;
+    uint32_t    min;
+    uint32_t    max;
+};
+
+struct SCellStatsContext
+{
+    const height_t* heights;
+    const uint32_t* cell_ids;
+    const SVoronoiGraph* graph;
+    int             width;
+    int             height;
+    int             num_cells;
+    int             rows_per_job;
+    SCellStatsOwned* owned;     // num_cells
+    SCellStatsShared* shared;   // num_cells
+    SMap*           map;
+};
+
+static SCellStatsOwned*     g_CellStatsOwned = 0;
+static SCellStatsShared*    g_CellStatsShared = 0;
+static int                  g_CellStatsCapacity = 0;
+
+static void PrepareCellStats(void* _ctx, int index)
+{
+    const SCellStatsContext* ctx = (const SCellStatsContext*)_ctx;
+    const SVoronoiGraph* graph = ctx->graph;
+    int begin = index * CELL_STATS_CELLS;
+    int end = begin + CELL_STATS_CELLS < ctx->num_cells ? begin + CELL_STATS_CELLS : ctx->num_cells;
+    for (int i = begin; i < end; ++i)
+    {
+        SCellStatsOwned& owned = ctx->owned[i];
+        owned.sum = 0;
+        owned.count = 0;
+        owned.min = 255;
+        owned.max = 0;
+        owned.owner = -1;
+        SCellStatsShared& shared = ctx->shared[i];
+        shared.sum = 0;
+        shared.count = 0;
+        shared.min = 255;
+        shared.max = 0;
+
+        int e_begin = graph->offsets[i];
+        int e_end = graph->offsets[i+1];
+        if (e_begin == e_end)
+            continue;
+        float min_y = FLT_MAX;
+        float max_y = -FLT_MAX;
+        for (int e = e_begin; e < e_end; ++e)
+        {
+            float y = (float)graph->vertices[e].y;
+            min_y = y < min_y ? y : min_y;
+            max_y = y > max_y ? y : max_y;
+        }
+        // A row more on each side, for the edge pixels
+        int y0 = Clampi(0, ctx->height - 1, (int)floorf(min_y) - 1);
+        int y1 = Clampi(0, ctx->height - 1, (int)floorf(max_y) + 1);
+        if (y0 / ctx->rows_per_job == y1 / ctx->rows_per_job)
+            owned.owner = (int16_t)(y0 / ctx->rows_per_job);
+    }
+}
+
+static void AddCellStatsRun(SCellStatsShared* accum, uint32_t sum, uint32_t count, uint32_t min, uint32_t max)
+{
+    AtomicAdd32(&accum->sum, sum);
+    AtomicAdd32(&accum->count, count);
+    // Only written when it's a new min/max, which is rare after the first few runs
+    uint32_t old = accum->min;
+    while (min < old)
+        old = AtomicCompareExchange32(&accum->min, old, min);
+    old = accum->max;
+    while (max > old)
+        old = AtomicCompareExchange32(&accum->max, old, max);
+}
+
+static void AccumulateCellStatsRows(void* _ctx, int index)
+{
+    const SCellStatsContext* ctx = (const SCellStatsContext*)_ctx;
+    int y0 = index * ctx->rows_per_job;
+    int y1 = y0 + ctx->rows_per_job < ctx->height ? y0 + ctx->rows_per_job : ctx->height;
+    int end = y1 * ctx->width;
+
+    // The pixels of the cells that aren't owned are added a run at a time
+    uint32_t run_id = MAPMAKER_NO_CELL;
+    uint32_t run_sum = 0;
+    uint32_t run_count = 0;
+    uint32_t run_min = 255;
+    uint32_t run_max = 0;
+    for (int i = y0 * ctx->width; i < end; ++i)
+    {
+        uint32_t id = ctx->cell_ids[i];
+        uint8_t h = (uint8_t)(ctx->heights[i] >> MAPMAKER_HEIGHT_SHIFT);
+        SCellStatsOwned& accum = ctx->owned[id];
+        if (accum.owner == index)
+        {
+            accum.sum += h;
+            accum.count++;
+            accum.min = h < accum.min ? h : accum.min;
+            accum.max = h > accum.max ? h : accum.max;
+            continue;
+        }
+        if (id != run_id)
+        {
+            if (run_id != MAPMAKER_NO_CELL)
+                AddCellStatsRun(&ctx->shared[run_id], run_sum, run_count, run_min, run_max);
+            run_id = id;
+            run_sum = 0;
+            run_count = 0;
+            run_min = 255;
+            run_max = 0;
+        }
+        run_sum += h;
+        run_count++;
+        run_min = h < run_min ? h : run_min;
+        run_max = h > run_max ? h : run_max;
+    }
+    if (run_id != MAPMAKER_NO_CELL)
+        AddCellStatsRun(&ctx->shared[run_id], run_sum, run_count, run_min, run_max);
+}
+
+static void WriteCellStats(void* _ctx, int index)
+{
+    const SCellStatsContext* ctx = (const SCellStatsContext*)_ctx;
+    SMap* map = ctx->map;
+    int begin = index * CELL_STATS_CELLS;
+    int end = begin + CELL_STATS_CELLS < ctx->num_cells ? begin + CELL_STATS_CELLS : ctx->num_cells;
+
+    for (int i = begin; i < end; ++i)
+    {
+        const SCellStatsOwned& owned = ctx->owned[i];
+        const SCellStatsShared& shared = ctx->shared[i];
+        uint32_t count = owned.count + shared.count;
+        if (count == 0) // An empty cell (e.g. a duplicate site), or one without any pixel center
+        {
+            map->elevation_min[i] = map->elevation_mean[i] = map->elevation_max[i] = 0;
+            continue;
+        }
+        map->elevation_min[i] = (uint8_t)(owned.min < shared.min ? owned.min : shared.min);
+        map->elevation_mean[i] = (uint8_t)((owned.sum + shared.sum + count / 2) / count);
+        map->elevation_max[i] = (uint8_t)(owned.max > shared.max ? owned.max : shared.max);
+    }
+}
+
+static void CalcCellElevations(const height_t* heights, int width, int height, SMap* map)
+{
+    int num_jobs = JobsNumThreads() * CELL_STATS_JOBS_PER_THREAD;
+    num_jobs = num_jobs < height ? num_jobs : height;
+    assert(num_jobs <= 32767); // The owner is an int16_t
+    if (g_CellStatsCapacity < map->num_cells)
+    {
+        g_CellStatsOwned = (SCellStatsOwned*)realloc(g_CellStatsOwned, sizeof(SCellStatsOwned) * map->num_cells);
+        g_CellStatsShared = (SCellStatsShared*)realloc(g_CellStatsShared, sizeof(SCellStatsShared) * map->num_cells);
+        g_CellStatsCapacity = map->num_cells;
+    }
+
+    SCellStatsContext ctx;
+    ctx.heights = heights;
+    ctx.cell_ids = map->cell_ids;
+    ctx.graph = map->graph;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.num_cells = map->num_cells;
+    ctx.rows_per_job = (height + num_jobs - 1) / num_jobs;
+    ctx.owned = g_CellStatsOwned;
+    ctx.shared = g_CellStatsShared;
+    ctx.map = map;
+    int num_cell_jobs = (map->num_cells + CELL_STATS_CELLS - 1) / CELL_STATS_CELLS;
+    JobsParallelFor(num_cell_jobs, PrepareCellStats, &ctx);
+    JobsParallelFor((height + ctx.rows_per_job - 1) / ctx.rows_per_job, AccumulateCellStatsRows, &ctx);
+    JobsParallelFor(num_cell_jobs, WriteCellStats, &ctx);
+}
+
+// MAP - RIVERS, MOISTURE AND BIOMES
+//
+// The passes from the polygon map generation (see the reading materials at the top), on the cell graph.
+// Each pass is linear in the number of cells and edges (queues over the flat arrays, no sorting):
+// - The ocean is the water connected to the map border, the rest of the water are lakes.
+// - Each land cell flows to its lowest neighbor, where water is lower than any land. Flat areas flow
+//   towards the nearest water, and cells without any lower neighbor (pits) are sinks.
+// - The flow of a cell is the number of land cells upstream, including itself. A land cell with
+//   a flow of at least river_flow is a river.
+// - The moisture spreads from the water and the rivers, and is redistributed by rank, so that the
+//   land cells are evenly spread over [0, 255].
+// - The biome is picked from the elevation above the sea and the moisture (a Whittaker diagram).
+
+static int*         g_CellScratch = 0;
+static int          g_CellScratchCapacity = 0;
+static uint64_t*    g_CellScratchBits = 0;
+static int          g_CellScratchBitsCapacity = 0;
+
+// Scratch space for the passes: 3 * num_cells + 2 ints and 2 bitsets
+static void ReserveCellScratch(int num_cells)
+{
+    int num_words = MAPMAKER_BITSET_WORDS(num_cells);
+    if (g_CellScratchCapacity < num_cells)
+    {
+        g_CellScratch = (int*)realloc(g_CellScratch, sizeof(int) * (3 * num_cells + 2));
+        g_CellScratchCapacity = num_cells;
+    }
+    if (g_CellScratchBitsCapacity < num_words)
+    {
+        g_CellScratchBits = (uint64_t*)realloc(g_CellScratchBits, sizeof(uint64_t) * 2 * num_words);
+        g_CellScratchBitsCapacity = num_words;
+    }
+}
+
+// Multi source breadth first search over the cell graph. The sources get distance 0, and the search
+// only steps into the passable cells (all cells if passable is 0). The cells that aren't reached get -1.
+// Returns the max distance.
+static int CellDistances(const SVoronoiGraph* graph, const uint64_t* sources, const uint64_t* passable, int* queue, int* dist)
+{
+    int num_cells = graph->num_cells;
+    int head = 0;
+    int tail = 0;
+    for (int i = 0; i < num_cells; ++i)
+        dist[i] = -1;
+    for (int i = BitsetNext(sources, num_cells, 0); i < num_cells; i = BitsetNext(sources, num_cells, i + 1))
+    {
+        dist[i] = 0;
+        queue[tail++] = i;
+    }
+
+    int max_dist = 0;
+    while (head < tail)
+    {
+        int i = queue[head++];
+        int d = dist[i] + 1;
+        int end = graph->offsets[i+1];
+        for (int e = graph->offsets[i]; e < end; ++e)
+        {
+            int n = graph->neighbors[e];
+            if (n < 0 || (passable && !BitsetTest(passable, n)) || dist[n] >= 0)
+                continue;
+            dist[n] = d;
+            max_dist = d;
+            queue[tail++] = n;
+        }
+    }
+    return max_dist;
+}
+
+// The number of steps from each cell to the nearest cell on the other side of the coast
+// (i.e. land to water, or water to land), with a BFS from the cells along the coast.
+static void CalcCellCoastDistance(SMap* map)
+{
+    const SVoronoiGraph* graph = map->graph;
+    int num_cells = map->num_cells;
+    int num_words = MAPMAKER_BITSET_WORDS(num_cells);
+
+    ReserveCellScratch(num_cells);
+    uint64_t* coast = g_CellScratchBits;
+    memset(coast, 0, sizeof(uint64_t) * num_words);
+
+    for (int i = 0; i < num_cells; ++i)
+    {
+        bool is_land = BitsetTest(map->is_land, i);
+        int end = graph->offsets[i+1];
+        for (int e = graph->offsets[i]; e < end; ++e)
+        {
+            int n = graph->neighbors[e];
+            if (n >= 0 && BitsetTest(map->is_land, n) != is_land)
+            {
+                BitsetSet(coast, i);
+                break;
+            }
+        }
+    }
+
+    CellDistances(graph, coast, 0, g_CellScratch, map->coast_distance);
+    for (int i = 0; i < num_cells; ++i)
+    {
+        if (map->coast_distance[i] >= 0)
+            map->coast_distance[i]++;
+    }
+}
+
+static uint8_t GetBiome(int elevation, int moisture)
+{
+    // The zones of the diagram, in 1/6ths of the moisture (255)
+    if (elevation > 204) // 0.8
+    {
+        if (moisture > 127) return BIOME_SNOW;
+        if (moisture > 85) return BIOME_TUNDRA;
+        if (moisture > 42) return BIOME_BARE;
+        return BIOME_SCORCHED;
+    }
+    if (elevation > 153) // 0.6
+    {
+        if (moisture > 170) return BIOME_TAIGA;
+        if (moisture > 85) return BIOME_SHRUBLAND;
+        return BIOME_TEMPERATE_DESERT;
+    }
+    if (elevation > 76) // 0.3
+    {
+        if (moisture > 212) return BIOME_TEMPERATE_RAIN_FOREST;
+        if (moisture > 127) return BIOME_TEMPERATE_DECIDUOUS_FOREST;
+        if (moisture > 42) return BIOME_GRASSLAND;
+        return BIOME_TEMPERATE_DESERT;
+    }
+    if (moisture > 170) return BIOME_TROPICAL_RAIN_FOREST;
+    if (moisture > 85) return BIOME_TROPICAL_SEASONAL_FOREST;
+    if (moisture > 42) return BIOME_GRASSLAND;
+    return BIOME_SUBTROPICAL_DESERT;
+}
+
+void GenerateRiversAndBiomes(SMap* map, int sea_level, int river_flow)
+{
+    const SVoronoiGraph* graph = map->graph;
+    int num_cells = map->num_cells;
+    int num_words = MAPMAKER_BITSET_WORDS(num_cells);
+
+    ReserveCellScratch(num_cells);
+    int* queue = g_CellScratch;
+    int* dist = g_CellScratch + num_cells;
+    int* counts = g_CellScratch + 2 * num_cells; // num_cells + 2
+    uint64_t* water = g_CellScratchBits;
+    uint64_t* sources = g_CellScratchBits + num_words;
+
+    for (int w = 0; w < num_words; ++w)
+        water[w] = ~map->is_land[w];
+    if (num_cells & 63)
+        water[num_words - 1] &= ((uint64_t)1 << (num_cells & 63)) - 1;
+
+    // Ocean: the water reachable from the water at the map border
+    for (int w = 0; w < num_words; ++w)
+        sources[w] = map->is_border[w] & water[w];
+    CellDistances(graph, sources, water, queue, dist);
+    for (int i = 0; i < num_cells; ++i)
+    {
+        if (dist[i] >= 0)
+            BitsetSet(map->is_ocean, i);
+    }
+
+    // Downslope: the neighbor with the lowest (elevation, distance to water)
+    int max_dist = CellDistances(graph, water, map->is_land, queue, dist);
+    int* key = dist;
+    for (int i = 0; i < num_cells; ++i)
+    {
+        if (BitsetTest(water, i))
+            key[i] = -1;
+        else
+            key[i] = map->elevation_mean[i] * (max_dist + 2) + (dist[i] < 0 ? max_dist + 1 : dist[i]);
+    }
+    // The land cells next to the ocean are the coast (beaches)
+    uint64_t* coast = sources;
+    memset(coast, 0, sizeof(uint64_t) * num_words);
+    for (int i = 0; i < num_cells; ++i)
+    {
+        int lowest = -1;
+        if (key[i] >= 0)
+        {
+            int lowest_key = key[i];
+            int end = graph->offsets[i+1];
+            for (int e = graph->offsets[i]; e < end; ++e)
+            {
+                int n = graph->neighbors[e];
+                if (n < 0)
+                    continue;
+                if (key[n] < lowest_key)
+                {
+                    lowest = n;
+                    lowest_key = key[n];
+                }
+                if (key[n] < 0 && BitsetTest(map->is_ocean, n))
+                    BitsetSet(coast, i);
+            }
+        }
+        map->downslope[i] = lowest;
+    }
+
+    // Flow: visit the cells in topological order (upstream first), pushing a cell when all the cells
+    // that flow into it are done
+    int* indegree = dist;
+    for (int i = 0; i < num_cells; ++i)
+    {
+        map->flow[i] = BitsetTest(map->is_land, i) ? 1 : 0;
+        indegree[i] = 0;
+    }
+    for (int i = 0; i < num_cells; ++i)
+    {
+        if (map->downslope[i] >= 0)
+            indegree[map->downslope[i]]++;
+    }
+    int head = 0;
+    int tail = 0;
+    for (int i = BitsetNext(map->is_land, num_cells, 0); i < num_cells; i = BitsetNext(map->is_land, num_cells, i + 1))
+    {
+        if (indegree[i] == 0)
+            queue[tail++] = i;
+    }
+    while (head < tail)
+    {
+        int i = queue[head++];
+        int down = map->downslope[i];
+        if (down < 0)
+            continue;
+        map->flow[down] += map->flow[i];
+        if (--indegree[down] == 0 && BitsetTest(map->is_land, down))
+            queue[tail++] = down;
+    }
+    for (int i = BitsetNext(map->is_land, num_cells, 0); i < num_cells; i = BitsetNext(map->is_land, num_cells, i + 1))
+    {
+        if (map->flow[i] >= (uint32_t)river_flow)
+            BitsetSet(map->is_river, i);
+    }
+
+    // Moisture: the distance from the water and rivers, as the rank among the land cells (drier further away)
+    uint64_t* wet = water;
+    for (int w = 0; w < num_words; ++w)
+        wet[w] |= map->is_river[w];
+    max_dist = CellDistances(graph, wet, map->is_land, queue, dist);
+    int unreached = max_dist + 1;
+    memset(counts, 0, sizeof(int) * (max_dist + 2));
+    int num_land = 0;
+    for (int i = BitsetNext(map->is_land, num_cells, 0); i < num_cells; i = BitsetNext(map->is_land, num_cells, i + 1))
+    {
+        if (dist[i] < 0)
+            dist[i] = unreached;
+        counts[dist[i]]++;
+        num_land++;
+    }
+    // The moisture at each distance: the land cells further away, plus half of the ones at the same distance
+    int further = 0;
+    for (int d = unreached; d >= 0; --d)
+    {
+        int count = counts[d];
+        counts[d] = num_land ? (int)((255 * (2 * (int64_t)further + count)) / (2 * (int64_t)num_land)) : 0;
+        further += count;
+    }
+
+    // Biomes
+    int land_range = 255 - sea_level > 0 ? 255 - sea_level : 1;
+    for (int i = 0; i < num_cells; ++i)
+    {
+        if (!BitsetTest(map->is_land, i))
+        {
+            map->moisture[i] = 255;
+            map->biome[i] = BitsetTest(map->is_ocean, i) ? BIOME_OCEAN : BIOME_LAKE;
+            continue;
+        }
+        map->moisture[i] = (uint8_t)counts[dist[i]];
+
+        if (BitsetTest(coast, i))
+        {
+            map->biome[i] = BIOME_BEACH;
+            continue;
+        }
+
+        int elevation = map->elevation_mean[i] - sea_level;
+        elevation = elevation < 0 ? 0 : (elevation * 255) / land_range;
+        map->biome[i] = GetBiome(elevation, map->moisture[i]);
     }
 }
 
@@ -847,71 +3665,104 @@ static inline bool on_edge(float x, float y, int w, int h)
     return false;
 }
 
-void GenerateMap(uint8_t* noisef)
+void GenerateMap(height_t* heights)
 {
     g_Map.points = g_VoronoiPoints;
-    g_Map.voronoi = g_VoronoiDiagram;
+    g_Map.graph = &g_VoronoiGraph;
+    g_Map.cell_ids = g_CellIds;
 
-    if (g_Map.cells && g_Map.num_cells != g_VoronoiNumPoints)
+    if (g_Map.elevation_min && g_Map.num_cells != g_VoronoiNumPoints)
     {
-        free(g_Map.cells);
-        g_Map.cells = 0;
+        free(g_Map.elevation_min);
+        free(g_Map.is_border);
+        free(g_Map.downslope);
+        free(g_Map.flow);
+        g_Map.elevation_min = 0;
     }
 
     g_Map.num_cells = g_VoronoiNumPoints;
-    if (g_Map.cells == 0)
-        g_Map.cells = (SCell*)malloc(sizeof(SCell) * g_Map.num_cells);
-    memset(g_Map.cells, 0, sizeof(SCell) * g_Map.num_cells);
+    int num_words = MAPMAKER_BITSET_WORDS(g_Map.num_cells);
+    if (g_Map.elevation_min == 0)
+    {
+        g_Map.elevation_min = (uint8_t*)malloc(5 * g_Map.num_cells);
+        g_Map.elevation_mean = g_Map.elevation_min + g_Map.num_cells;
+        g_Map.elevation_max = g_Map.elevation_mean + g_Map.num_cells;
+        g_Map.moisture = g_Map.elevation_max + g_Map.num_cells;
+        g_Map.biome = g_Map.moisture + g_Map.num_cells;
+        g_Map.is_border = (uint64_t*)malloc(sizeof(uint64_t) * 5 * num_words);
+        g_Map.is_land = g_Map.is_border + num_words;
+        g_Map.is_shallow = g_Map.is_land + num_words;
+        g_Map.is_ocean = g_Map.is_shallow + num_words;
+        g_Map.is_river = g_Map.is_ocean + num_words;
+        g_Map.downslope = (int*)malloc(sizeof(int) * 2 * g_Map.num_cells);
+        g_Map.coast_distance = g_Map.downslope + g_Map.num_cells;
+        g_Map.flow = (uint32_t*)malloc(sizeof(uint32_t) * g_Map.num_cells);
+    }
+    memset(g_Map.is_border, 0, sizeof(uint64_t) * 5 * num_words);
 
     int width = g_MapParams.width;
     int height = g_MapParams.height;
     int sea_level = g_MapParams.sea_level;
     int border = g_VoronoiParams.border;
 
+    CalcCellElevations(heights, width, height, &g_Map);
+
     // Note that when getting duplicates, the number of sites may be smaller
     // which in turn leaves some cells "empty"
-    const jcv_site* sites = jcv_diagram_get_sites( g_Map.voronoi );
-    for (int i = 0; i < g_Map.voronoi->numsites; ++i)
+    const SVoronoiGraph* graph = g_Map.graph;
+    for (int i = 0; i < g_Map.num_cells; ++i)
     {
-        const jcv_site* site = &sites[i];
-        SCell& cell = g_Map.cells[site->index];
-        cell.site = site;
+        int begin = graph->offsets[i];
+        int end = graph->offsets[i+1];
+        if (begin == end)
+            continue;
 
-        int x = (int)site->p.x;
-        int y = (int)site->p.y;
-        int noiseindex = y * width + x;
+        int x = (int)g_Map.points[i].x;
+        int y = (int)g_Map.points[i].y;
 
-        if (x < border || (width - x) < border ||
-            y < border || (height - y) < border)
-        {
-            cell.is_land = 0;
-        }
-        else
-        {
-            cell.is_land = 1;
-        }
+        bool is_land = !(x < border || (width - x) < border ||
+                         y < border || (height - y) < border);
 
-        cell.elevation = noisef[noiseindex];
-        if (cell.elevation < sea_level)
-        {
-            cell.is_land = 0;
-            cell.is_shallow = cell.elevation > (sea_level*2)/3;
-        }
+        // The average over the whole cell, so a single pixel at the site doesn't decide if it's land
+        if (g_Map.elevation_mean[i] < sea_level)
+            is_land = false;
 
         // Check if this cell is on the border
-        const jcv_graphedge* e = site->edges;
-        while( e )
+        for (int e = begin; e < end; ++e)
         {
-            if (on_edge(e->pos[0].x, e->pos[0].y, width, height))
+            if (on_edge(graph->vertices[e].x, graph->vertices[e].y, width, height))
             {
-                cell.is_border = 1;
-                cell.is_shallow = 0;
+                BitsetSet(g_Map.is_border, i);
                 break;
             }
+        }
+
+        if (is_land)
+            BitsetSet(g_Map.is_land, i);
+    }
+
+    CalcCellCoastDistance(&g_Map);
 
-            e = e->next;
+    // The water close to the coast is shallow
+    for (int i = 0; i < g_Map.num_cells; ++i)
+    {
+        int distance = g_Map.coast_distance[i];
+        if (distance > 0 && distance <= g_MapParams.shallow_distance &&
+            !BitsetTest(g_Map.is_land, i) && !BitsetTest(g_Map.is_border, i))
+        {
+            BitsetSet(g_Map.is_shallow, i);
         }
     }
+
+    if (g_CoastDistanceSize != width * height)
+    {
+        g_CoastDistance = (float*)realloc(g_CoastDistance, sizeof(float) * width * height);
+        g_CoastDistanceSize = width * height;
+    }
+    CalcCoastDistance(width, height, heights, sea_level, g_CoastDistance);
+    g_Map.coast_distance_pixels = g_CoastDistance;
+
+    GenerateRiversAndBiomes(&g_Map, sea_level, g_MapParams.river_flow);
 }
 
 SMap* GetMap()
@@ -1,8 +1,51 @@
 #pragma once
 
 #include <stdint.h>
+
+// The voronoi diagram is generated with floats by default. Define MAPMAKER_VORONOI_DOUBLE
+// to use doubles, which is needed for large maps (e.g. 16384x16384 with a million cells),
+// where the floats give cells with their edges in the wrong order.
+// Define MAPMAKER_VORONOI_SNAP to N (e.g. 256) to also snap the sites to a grid of 1/N pixels.
+// The sites are still stored and processed as doubles, but their coordinates and differences are
+// then exact, which removes the rounding from the site input. It is not an integer sweep: the
+// vertices and the break points are computed in double as usual.
+#if defined(MAPMAKER_VORONOI_SNAP) && !defined(MAPMAKER_VORONOI_DOUBLE)
+    #define MAPMAKER_VORONOI_DOUBLE
+#endif
+
+#if defined(MAPMAKER_VORONOI_DOUBLE)
+    #define JCV_REAL_TYPE   double
+    #define JCV_ATAN2       atan2
+    #define JCV_SQRT        sqrt
+    #define JCV_FABS        fabs
+    #define JCV_FLOOR       floor
+    #define JCV_CEIL        ceil
+    #define JCV_EDGE_INTERSECT_THRESHOLD 0
+#endif
+
 #include "jc_voronoi.h"
 
+// The heights are fixed point, with 16 bits of precision by default. The noise is generated
+// as heights, and the noise processing, the map generation, shading and colorization work on them.
+// Only the erosion works on a float copy (NoiseToElevation), which NormalizeHeights writes back.
+// Define MAPMAKER_HEIGHT_BITS to 8 to get 8 bit heights (the noise is then quantized to 8 bits too).
+#ifndef MAPMAKER_HEIGHT_BITS
+    #define MAPMAKER_HEIGHT_BITS 16
+#endif
+
+#if MAPMAKER_HEIGHT_BITS == 8
+    typedef uint8_t height_t;
+#elif MAPMAKER_HEIGHT_BITS == 16
+    typedef uint16_t height_t;
+#else
+    #error "MAPMAKER_HEIGHT_BITS must be 8 or 16"
+#endif
+
+#define MAPMAKER_HEIGHT_MAX     ((1 << MAPMAKER_HEIGHT_BITS) - 1)
+#define MAPMAKER_HEIGHT_SHIFT   (MAPMAKER_HEIGHT_BITS - 8) // shift to get the 8 bit height (e.g. for the limits or the sea level)
+
+#define MAPMAKER_COAST_DISTANCE_INF 1e20f // The coast distance of the water pixels when there's no land
+
 struct Point2
 {
     float x, y;
@@ -12,9 +55,10 @@ struct SVoronoiParameters
 {
     int seed;
     int num_cells;
-    int generation_type; // 0 random, 1 square, 2 hexagonal
+    int generation_type; // 0 random, 1 hexagonal, 2 poisson disc
     int border;
-    int num_relaxations;
+    int num_relaxations;    // The max number of relaxations
+    float relax_epsilon;    // Stops relaxing when no point moves further than this (in pixels)
 
     int hexagon_density;
 
@@ -52,11 +96,15 @@ struct SNoiseParameters
     bool    use_erosion;
     int     erode_type;         //
     int     erode_iterations;
+    bool    erode_multigrid;    // thermal: run the iterations on a downsampled pyramid, see ErodeMultigrid
     float   erode_rain_amount;  // how much rain falls per iteration
     float   erode_solubility;   // how much soil is eroded by one unit of water
     float   erode_evaporation;  // what percentage of the water evaporates each iteration
     float   erode_capacity;     // how much sediment one unit of water can hold
     float   erode_thermal_talus;
+    float   erode_flow_carve;   // how deep the largest river is carved, relative to the elevation range
+    int     erode_droplets;     // the total number of droplets
+    int     erode_droplet_radius; // the radius (in pixels) that a droplet erodes
 
     bool    apply_radial;
     float   radial_falloff;
@@ -80,6 +128,9 @@ struct SMapParameters
     float   shadow_strength;
     float   shadow_strength_sea;
 
+    int     river_flow;     // The number of upstream land cells needed to make a river
+    int     shallow_distance; // The water cells at most this many cells from the land are shallow
+
     SMapParameters();
 };
 
@@ -89,42 +140,137 @@ void UpdateParams(const SVoronoiParameters* voronoi, const SNoiseParameters* noi
 
 // VORONOI GENERATION
 
+// The voronoi diagram flattened into arrays (CSR), indexed by the cell index (i.e. the index of the center point).
+// The edges of cell i are [offsets[i], offsets[i+1]), in CCW order. Each edge stores its start vertex,
+// and the end vertex is the start of the next edge in the cell (wrapping around). This is asserted
+// when the graph is built (up to a small epsilon).
+// Cells that were removed by the voronoi generation (e.g. duplicate points) have no edges.
+struct SVoronoiGraph
+{
+    int         num_cells;
+    int         num_edges;
+    int         num_open_edges; // The edges whose end didn't match the start of the next edge (broken cells, see FlattenVoronoi)
+    int*        offsets;    // num_cells + 1 offsets into the edge arrays
+    jcv_point*  vertices;   // The start vertex of each edge
+    int*        neighbors;  // The cell on the other side of each edge, or -1 at the map border
+
+    int         capacity_cells; // Allocated sizes of the arrays
+    int         capacity_edges;
+
+    SVoronoiGraph();
+};
+
 void GenerateVoronoi();
+// Flattens the diagram into the graph, reusing the graph's arrays if they're big enough
+void FlattenVoronoi(const jcv_diagram* diagram, int num_cells, SVoronoiGraph* graph);
+// Generates the graph by splitting the rect into vertical strips, which are generated in parallel (see jobs.h).
+// The result is the same as flattening the diagram of all the points (up to the float precision at near degenerate vertices).
+void GenerateVoronoiPartitioned(int num_points, const jcv_point* points, const jcv_rect* rect, SVoronoiGraph* graph);
+void FreeVoronoiGraph(SVoronoiGraph* graph);
+// Writes the cell of each pixel (width * height), in parallel (see jobs.h). The pixels that no cell covers
+// (between cells that don't have bit identical vertices) get a nearby cell.
+void RasterizeCellIds(const SVoronoiGraph* graph, const jcv_point* points, int width, int height, uint32_t* ids);
 
 // NOISE GENERATION
 
-void GenerateNoise(float* noisef, int modify_type);
-void ContrastNoise(float* noisef, float contrast_exponent);
+// Generates the noise (using the current perturb type) for the rows [y_start, y_end), as heights
+// that map [-1, 1] to the full height range (the noise without perturbation is in [0, 1]).
+// Only every 'step' pixel is sampled, and the value is replicated over the step x step block,
+// which gives a quick, low resolution preview. A step of 1 gives the full resolution noise.
+void GenerateNoiseRows(height_t* heights, int y_start, int y_end, int step);
+void ContrastNoise(height_t* heights, float contrast_exponent);
+// The noise heights as floats in [-1, 1], for the erosion
+void NoiseToElevation(int w, int h, const height_t* heights, float* elevation);
 void Erode(int w, int h, float* elevation, float* sediment, float* water);
-void NoiseRadial(int w, int h, float falloff, float* noisef);
-void Blur(int w, int h, float* noisef, float threshold);
-void Perturb1(int w, int h, float* noisef);
-void Perturb2(int w, int h, float* noisef);
-void Normalize(int w, int h, float* elevation);
+// The erosion split into ErodeNumSteps() steps, so it can be spread over several calls (e.g. frames).
+// Running the steps [0, ErodeNumSteps()) in any number of calls gives the same result as Erode()
+int ErodeNumSteps();
+void ErodeSteps(int w, int h, float* elevation, float* sediment, float* water, int step_begin, int step_end);
+// The noise heights above the threshold (in [-1, 1]) are kept
+void Blur(int w, int h, height_t* heights, float threshold);
+// Stretches the elevation (e.g. after the erosion), or the noise heights if elevation is 0, to the full height range,
+// optionally with the radial falloff (and stretched again), into the heights used by the map
+void NormalizeHeights(int w, int h, const float* elevation, bool apply_radial, float radial_falloff, height_t* heights);
 
 // MAP GENERATION
 
-struct SCell
+// A set of cells, with one bit per cell (e.g. the land cells).
+// The bits past the number of cells are zero.
+#define MAPMAKER_BITSET_WORDS(count) (((count) + 63) / 64)
+
+static inline bool BitsetTest(const uint64_t* bits, int i)
+{
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void BitsetSet(uint64_t* bits, int i)
+{
+    bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+// The number of set bits
+int BitsetCount(const uint64_t* bits, int count);
+// The first set bit at or after start, or count if there are no more.
+// E.g. for (int i = BitsetNext(bits, count, 0); i < count; i = BitsetNext(bits, count, i + 1))
+int BitsetNext(const uint64_t* bits, int count, int start);
+
+#define MAPMAKER_NO_CELL 0xFFFFFFFF
+
+enum EBiome
 {
-    const jcv_site* site; // Neighborhood data
-    uint32_t        elevation : 8;
-    uint32_t        is_border : 1;  // The edge around the map
-    uint32_t        is_land : 1;    // if not land, water
-    uint32_t        is_shallow : 1; // If not shallow, deep water
+    BIOME_OCEAN,
+    BIOME_LAKE,
+    BIOME_BEACH,
+    BIOME_SNOW,
+    BIOME_TUNDRA,
+    BIOME_BARE,
+    BIOME_SCORCHED,
+    BIOME_TAIGA,
+    BIOME_SHRUBLAND,
+    BIOME_TEMPERATE_DESERT,
+    BIOME_TEMPERATE_RAIN_FOREST,
+    BIOME_TEMPERATE_DECIDUOUS_FOREST,
+    BIOME_GRASSLAND,
+    BIOME_TROPICAL_RAIN_FOREST,
+    BIOME_TROPICAL_SEASONAL_FOREST,
+    BIOME_SUBTROPICAL_DESERT,
+    BIOME_COUNT
 };
 
+// The cells are stored as arrays, indexed by the cell index (i.e. the index of the center point)
 struct SMap
 {
     jcv_point*      points;     // The centers of each cell
-    jcv_diagram*    voronoi;    // The voronoi diragram between the cells
-    SCell*          cells;      // Each cell has the same index as the center point
+    const SVoronoiGraph* graph; // The voronoi diagram between the cells (neighborhood data)
+    const uint32_t* cell_ids;   // The cell of each pixel (width * height). Built once per voronoi diagram
+    uint8_t*        elevation_min;  // The min/mean/max elevation of the pixels of each cell
+    uint8_t*        elevation_mean;
+    uint8_t*        elevation_max;
+    uint64_t*       is_border;  // Bitset: The edge around the map
+    uint64_t*       is_land;    // Bitset: if not land, water
+    uint64_t*       is_shallow; // Bitset: If not shallow, deep water
+    uint64_t*       is_ocean;   // Bitset: The water connected to the map border. Other water cells are lakes
+    uint64_t*       is_river;   // Bitset: Land cells with a flow of at least SMapParameters::river_flow
+    int*            downslope;  // The neighbor each cell flows to, or -1 for water and sinks
+    int*            coast_distance; // The number of cells to the nearest cell on the other side of the coast, or -1 if there's no coast
+    const float*    coast_distance_pixels; // The distance from each pixel below the sea level to the nearest land pixel (width * height), see CalcCoastDistance
+    uint32_t*       flow;       // The number of land cells flowing through each cell (including itself)
+    uint8_t*        moisture;
+    uint8_t*        biome;      // EBiome
     int             num_cells;
 
     SMap();
 };
 
-void GenerateMap(uint8_t* noisef);
+void GenerateMap(height_t* heights);
+// The ocean, downslope, flow, rivers, moisture and biomes of the cells, from their elevations and
+// the land and border bits (the last step of GenerateMap)
+void GenerateRiversAndBiomes(SMap* map, int sea_level, int river_flow);
+// The distance (in pixels) from each pixel below the sea level to the nearest pixel above it (0 on land),
+// MAPMAKER_COAST_DISTANCE_INF if there's no land. In parallel (see jobs.h)
+void CalcCoastDistance(int width, int height, const height_t* heights, int sea_level, float* distances);
 
-void ColorizeMap(uint8_t* heights, uint8_t* out_colors, int num_limits, uint8_t* height_limits, uint8_t* height_colors);
+// Writes the colors as RGBA
+void ColorizeMap(height_t* heights, uint8_t* out_colors, int num_limits, uint8_t* height_limits, uint8_t* height_colors);
 
 SMap* GetMap();
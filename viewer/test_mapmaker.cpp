@@ -0,0 +1,697 @@
+// Tests and benchmarks the map generation steps that have a faster (e.g. parallel) path,
+// by comparing them to the straightforward version, and checks the generated maps. See test_mapmaker.sh
+// Usage: test_mapmaker [num threads (default 0: one per core)]
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "mapmaker.h"
+#include "jobs.h"
+
+#define JC_VORONOI_IMPLEMENTATION
+#include "jc_voronoi.h"
+
+#define JC_DRAW_IMPLEMENTATION
+#include "jc_draw.h"
+
+static const float WIDTH = 4096.0f;
+static const float HEIGHT = 4096.0f;
+static const float SHORT_EDGE = 0.01f;  // Edges shorter than this are ignored when comparing the cell neighbours
+static const float PIXEL_EDGE_EPSILON = 0.01f; // Pixel centers this close to a cell edge may be filled by either cell
+
+static uint32_t g_Seed = 0;
+
+static uint32_t TestRand()
+{
+    g_Seed = g_Seed * 1664525u + 1013904223u;
+    return g_Seed >> 8;
+}
+
+static float TestRandf(float max)
+{
+    return (float)TestRand() / (float)(1 << 24) * max;
+}
+
+static double TestTime()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static jcv_point* RandomPoints(int count)
+{
+    jcv_point* points = (jcv_point*)malloc(sizeof(jcv_point) * count);
+    g_Seed = (uint32_t)count;
+    for (int i = 0; i < count; ++i)
+    {
+        points[i].x = TestRandf(WIDTH);
+        points[i].y = TestRandf(HEIGHT);
+    }
+    return points;
+}
+
+// The neighbours of a cell, sorted, skipping the (nearly) zero length edges
+static int GetNeighbors(const SVoronoiGraph* graph, int cell, int* out)
+{
+    int begin = graph->offsets[cell];
+    int end = graph->offsets[cell + 1];
+    int count = 0;
+    for (int e = begin; e < end; ++e)
+    {
+        const jcv_point& p0 = graph->vertices[e];
+        const jcv_point& p1 = graph->vertices[e + 1 < end ? e + 1 : begin];
+        float dx = (float)(p1.x - p0.x);
+        float dy = (float)(p1.y - p0.y);
+        if (dx*dx + dy*dy >= SHORT_EDGE*SHORT_EDGE)
+            out[count++] = graph->neighbors[e];
+    }
+    std::sort(out, out + count);
+    return count;
+}
+
+// The number of cells with different neighbours
+static int CompareGraphs(const SVoronoiGraph* a, const SVoronoiGraph* b)
+{
+    int different = 0;
+    int na[256];
+    int nb[256];
+    for (int i = 0; i < a->num_cells; ++i)
+    {
+        if (a->offsets[i + 1] - a->offsets[i] > 256 || b->offsets[i + 1] - b->offsets[i] > 256)
+        {
+            different++;
+            continue;
+        }
+        int count = GetNeighbors(a, i, na);
+        if (count != GetNeighbors(b, i, nb) || memcmp(na, nb, sizeof(int) * count) != 0)
+            different++;
+    }
+    return different;
+}
+
+// VORONOI
+
+#if defined(MAPMAKER_VORONOI_SNAP)
+    #define VORONOI_MODE "snapped"
+#elif defined(MAPMAKER_VORONOI_DOUBLE)
+    #define VORONOI_MODE "double"
+#else
+    #define VORONOI_MODE "float"
+#endif
+
+// The cells, the closed cells (each edge ends where the next one starts) and the total area of the cells
+static void GetDiagramStats(const jcv_diagram* diagram, int* num_cells, int* num_closed, double* area)
+{
+    *num_cells = 0;
+    *num_closed = 0;
+    *area = 0;
+    const jcv_site* sites = jcv_diagram_get_sites(diagram);
+    for (int i = 0; i < diagram->numsites; ++i)
+    {
+        const jcv_site* site = &sites[i];
+        if (!site->edges)
+            continue;
+        bool closed = true;
+        double cell_area = 0;
+        for (const jcv_graphedge* e = site->edges; e; e = e->next)
+        {
+            const jcv_graphedge* next = e->next ? e->next : site->edges;
+            if (fabs((double)(e->pos[1].x - next->pos[0].x)) > 0.05 || fabs((double)(e->pos[1].y - next->pos[0].y)) > 0.05)
+                closed = false;
+            cell_area += (double)e->pos[0].x * (double)e->pos[1].y - (double)e->pos[1].x * (double)e->pos[0].y;
+        }
+        *num_cells += 1;
+        *num_closed += closed ? 1 : 0;
+        *area += cell_area * 0.5;
+    }
+}
+
+// Generates the diagram with the voronoi mode of this build (see MAPMAKER_VORONOI_DOUBLE in mapmaker.h)
+static bool TestVoronoiMode(int count, float size)
+{
+    jcv_point* points = (jcv_point*)malloc(sizeof(jcv_point) * count);
+    g_Seed = (uint32_t)count;
+    for (int i = 0; i < count; ++i)
+    {
+        points[i].x = TestRandf(size);
+        points[i].y = TestRandf(size);
+#if defined(MAPMAKER_VORONOI_SNAP)
+        points[i].x = floor(points[i].x * MAPMAKER_VORONOI_SNAP + 0.5) / MAPMAKER_VORONOI_SNAP;
+        points[i].y = floor(points[i].y * MAPMAKER_VORONOI_SNAP + 0.5) / MAPMAKER_VORONOI_SNAP;
+#endif
+    }
+    jcv_rect rect = { { 0, 0 }, { size, size } };
+
+    jcv_diagram diagram;
+    memset(&diagram, 0, sizeof(diagram));
+    double t = TestTime();
+    jcv_diagram_generate(count, points, &rect, &diagram);
+    t = TestTime() - t;
+
+    int num_cells, num_closed;
+    double area;
+    GetDiagramStats(&diagram, &num_cells, &num_closed, &area);
+    area /= (double)size * (double)size;
+    printf("voronoi %-7s  %8d points  cells %d  closed %d  area %.6f  %.2f M points/s\n",
+            VORONOI_MODE, count, num_cells, num_closed, area, count / t / 1000000.0);
+
+    jcv_diagram_free(&diagram);
+    free(points);
+
+    // The float diagrams have some broken cells at 1M points, that's what the double modes are for
+    if (sizeof(jcv_real) == sizeof(float) && count > 200000)
+        return true;
+    return num_cells == count && num_closed == num_cells && fabs(area - 1.0) < 1e-4;
+}
+
+// GenerateVoronoiPartitioned should give the same cells as flattening the full diagram
+static bool TestVoronoiPartitioned(int count)
+{
+    jcv_point* points = RandomPoints(count);
+    jcv_rect rect = { { 0, 0 }, { WIDTH, HEIGHT } };
+
+    double t = TestTime();
+    jcv_diagram diagram;
+    memset(&diagram, 0, sizeof(diagram));
+    jcv_diagram_generate(count, points, &rect, &diagram);
+    SVoronoiGraph reference;
+    FlattenVoronoi(&diagram, count, &reference);
+    double time_full = TestTime() - t;
+    jcv_diagram_free(&diagram);
+
+    t = TestTime();
+    SVoronoiGraph graph;
+    GenerateVoronoiPartitioned(count, points, &rect, &graph);
+    double time_partitioned = TestTime() - t;
+
+    int different = CompareGraphs(&reference, &graph);
+    int open_edges = graph.num_open_edges;
+    printf("voronoi partitioned  %8d points  different cells %d  open edges %d  full %.1f ms  partitioned %.1f ms\n",
+            count, different, open_edges, time_full * 1000.0, time_partitioned * 1000.0);
+
+    FreeVoronoiGraph(&graph);
+    FreeVoronoiGraph(&reference);
+    free(points);
+    return different == 0 && open_edges == 0;
+}
+
+// RASTER
+
+// The reference for the polygon filler: tests the center of each pixel in the bounding box against every edge of the cell
+static void FillCellReference(const SVoronoiGraph* graph, int cell, uint32_t* ids, int width, int height)
+{
+    int begin = graph->offsets[cell];
+    int end = graph->offsets[cell + 1];
+    if (end - begin < 3)
+        return;
+    float minx = WIDTH, miny = HEIGHT, maxx = 0, maxy = 0;
+    for (int e = begin; e < end; ++e)
+    {
+        minx = std::min(minx, (float)graph->vertices[e].x);
+        miny = std::min(miny, (float)graph->vertices[e].y);
+        maxx = std::max(maxx, (float)graph->vertices[e].x);
+        maxy = std::max(maxy, (float)graph->vertices[e].y);
+    }
+    int x0 = std::max(0, (int)floorf(minx));
+    int y0 = std::max(0, (int)floorf(miny));
+    int x1 = std::min(width - 1, (int)ceilf(maxx));
+    int y1 = std::min(height - 1, (int)ceilf(maxy));
+    for (int y = y0; y <= y1; ++y)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            float px = x + 0.5f;
+            float py = y + 0.5f;
+            bool inside = true;
+            for (int e = begin; e < end && inside; ++e)
+            {
+                const jcv_point& a = graph->vertices[e];
+                const jcv_point& b = graph->vertices[e + 1 < end ? e + 1 : begin];
+                // CCW, so the inside is to the left of each edge
+                float orient = (float)(b.x - a.x) * (py - (float)a.y) - (float)(b.y - a.y) * (px - (float)a.x);
+                inside = orient > 0;
+            }
+            if (inside)
+                ids[y * width + x] = (uint32_t)cell;
+        }
+    }
+}
+
+// The distance from a point to the nearest edge of the cell
+static float DistanceToCellEdge(const SVoronoiGraph* graph, int cell, float px, float py)
+{
+    int begin = graph->offsets[cell];
+    int end = graph->offsets[cell + 1];
+    float best = 1e30f;
+    for (int e = begin; e < end; ++e)
+    {
+        const jcv_point& a = graph->vertices[e];
+        const jcv_point& b = graph->vertices[e + 1 < end ? e + 1 : begin];
+        float dx = (float)(b.x - a.x);
+        float dy = (float)(b.y - a.y);
+        float len_sq = dx*dx + dy*dy;
+        float t = len_sq > 0 ? ((px - (float)a.x) * dx + (py - (float)a.y) * dy) / len_sq : 0.0f;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        float ex = (float)a.x + t * dx - px;
+        float ey = (float)a.y + t * dy - py;
+        best = std::min(best, sqrtf(ex*ex + ey*ey));
+    }
+    return best;
+}
+
+// Fills the voronoi cells with jcd_fill_convex_polygon, and compares the pixels with the reference
+static bool TestFillCells(int count, int size)
+{
+    jcv_point* points = (jcv_point*)malloc(sizeof(jcv_point) * count);
+    g_Seed = (uint32_t)count;
+    for (int i = 0; i < count; ++i)
+    {
+        points[i].x = TestRandf((float)size);
+        points[i].y = TestRandf((float)size);
+    }
+    jcv_rect rect = { { 0, 0 }, { (jcv_real)size, (jcv_real)size } };
+    jcv_diagram diagram;
+    memset(&diagram, 0, sizeof(diagram));
+    jcv_diagram_generate(count, points, &rect, &diagram);
+    SVoronoiGraph graph;
+    FlattenVoronoi(&diagram, count, &graph);
+    jcv_diagram_free(&diagram);
+
+    int num_pixels = size * size;
+    uint32_t* ids = (uint32_t*)malloc(sizeof(uint32_t) * num_pixels);
+    uint32_t* reference = (uint32_t*)malloc(sizeof(uint32_t) * num_pixels);
+    uint32_t* raster = (uint32_t*)malloc(sizeof(uint32_t) * num_pixels);
+    jcd_point* polygon = (jcd_point*)malloc(sizeof(jcd_point) * graph.num_edges);
+
+    double t = TestTime();
+    memset(ids, 0xFF, sizeof(uint32_t) * num_pixels);
+    for (int i = 0; i < count; ++i)
+    {
+        int begin = graph.offsets[i];
+        int num_vertices = graph.offsets[i + 1] - begin;
+        for (int e = 0; e < num_vertices; ++e)
+        {
+            polygon[e].x = (float)graph.vertices[begin + e].x;
+            polygon[e].y = (float)graph.vertices[begin + e].y;
+        }
+        uint32_t color = (uint32_t)i;
+        jcd_fill_convex_polygon(num_vertices, polygon, (uint8_t*)ids, size, size, 4, (const uint8_t*)&color);
+    }
+    double time_fill = TestTime() - t;
+
+    t = TestTime();
+    memset(reference, 0xFF, sizeof(uint32_t) * num_pixels);
+    for (int i = 0; i < count; ++i)
+        FillCellReference(&graph, i, reference, size, size);
+    double time_reference = TestTime() - t;
+
+    // The parallel raster should fill the same pixels as the serial fill, and the gaps between them
+    t = TestTime();
+    RasterizeCellIds(&graph, points, size, size, raster);
+    double time_raster = TestTime() - t;
+
+    // The neighbouring cells don't have bit identical vertices, so the pixels (nearly) on an edge may go to
+    // either cell, or to none (the gaps are filled in RasterizeCellIds)
+    int uncovered = 0;
+    int different = 0;
+    int raster_different = 0;
+    for (int i = 0; i < num_pixels; ++i)
+    {
+        uncovered += ids[i] == MAPMAKER_NO_CELL ? 1 : 0;
+        if (raster[i] == MAPMAKER_NO_CELL || (raster[i] != ids[i] && ids[i] != MAPMAKER_NO_CELL))
+            raster_different++;
+        if (ids[i] != reference[i] && reference[i] != MAPMAKER_NO_CELL)
+        {
+            if (DistanceToCellEdge(&graph, (int)reference[i], (i % size) + 0.5f, (i / size) + 0.5f) > PIXEL_EDGE_EPSILON)
+                different++;
+        }
+    }
+    printf("fill cells  %6d cells  %dx%d  uncovered %d  different %d  raster different %d  fill %.1f ms  reference %.1f ms  raster %.1f ms\n",
+            count, size, size, uncovered, different, raster_different, time_fill * 1000.0, time_reference * 1000.0, time_raster * 1000.0);
+
+    free(raster);
+    free(polygon);
+    free(reference);
+    free(ids);
+    FreeVoronoiGraph(&graph);
+    free(points);
+    return different == 0 && raster_different == 0;
+}
+
+// EROSION
+
+// The droplet erosion splits the droplets into a fixed number of jobs, so it should give the same
+// elevation with one thread as with several. main's thread count is restored afterwards
+static bool TestErodeDroplets(int size, int num_droplets, int num_threads, int restore_threads)
+{
+    SVoronoiParameters voronoi_params;
+    SNoiseParameters noise_params;
+    SMapParameters map_params;
+    noise_params.erode_type = 3; // droplets
+    noise_params.erode_droplets = num_droplets;
+    map_params.width = size;
+    map_params.height = size;
+    UpdateParams(&voronoi_params, &noise_params, &map_params);
+
+    float* initial = (float*)malloc(sizeof(float) * size * size);
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            float dx = (x - size * 0.5f) / (size * 0.5f);
+            float dy = (y - size * 0.5f) / (size * 0.5f);
+            initial[y * size + x] = 1.0f - sqrtf(dx*dx + dy*dy) + 0.1f * sinf(x * 0.05f) * sinf(y * 0.07f);
+        }
+    }
+
+    float* elevation[2];
+    double times[2];
+    int threads[2] = { 1, num_threads };
+    for (int i = 0; i < 2; ++i)
+    {
+        JobsInit(threads[i]);
+        elevation[i] = (float*)malloc(sizeof(float) * size * size);
+        memcpy(elevation[i], initial, sizeof(float) * size * size);
+        double t = TestTime();
+        Erode(size, size, elevation[i], 0, 0);
+        times[i] = TestTime() - t;
+    }
+    JobsInit(restore_threads);
+
+    int different = 0;
+    int changed = 0;
+    for (int i = 0; i < size * size; ++i)
+    {
+        different += elevation[0][i] != elevation[1][i] ? 1 : 0;
+        changed += elevation[0][i] != initial[i] ? 1 : 0;
+    }
+
+    printf("erode droplets  %dx%d  %d droplets  changed pixels %d  different %d  1 thread %.1f ms  %d threads %.1f ms\n",
+            size, size, num_droplets, changed, different, times[0] * 1000.0, num_threads, times[1] * 1000.0);
+
+    free(elevation[0]);
+    free(elevation[1]);
+    free(initial);
+    return different == 0 && changed > 0;
+}
+
+// The viewer spreads the erosion steps over several frames, which should give the same elevation as Erode
+static bool TestErodeSteps(int size, int erode_type)
+{
+    SVoronoiParameters voronoi_params;
+    SNoiseParameters noise_params;
+    SMapParameters map_params;
+    noise_params.erode_type = erode_type;
+    noise_params.erode_iterations = 5;
+    noise_params.erode_droplets = 20000;
+    map_params.width = size;
+    map_params.height = size;
+    UpdateParams(&voronoi_params, &noise_params, &map_params);
+
+    int area = size * size;
+    float* buffers = (float*)malloc(sizeof(float) * area * 7);
+    float* initial = buffers;
+    float* elevation[2] = { buffers + area, buffers + area * 2 };
+    float* sediment[2] = { buffers + area * 3, buffers + area * 4 };
+    float* water[2] = { buffers + area * 5, buffers + area * 6 };
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            float dx = (x - size * 0.5f) / (size * 0.5f);
+            float dy = (y - size * 0.5f) / (size * 0.5f);
+            initial[y * size + x] = 1.0f - sqrtf(dx*dx + dy*dy) + 0.1f * sinf(x * 0.05f) * sinf(y * 0.07f);
+        }
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        memcpy(elevation[i], initial, sizeof(float) * area);
+        memset(sediment[i], 0, sizeof(float) * area);
+        memset(water[i], 0, sizeof(float) * area);
+    }
+
+    Erode(size, size, elevation[0], sediment[0], water[0]);
+    int num_steps = ErodeNumSteps();
+    for (int step = 0; step < num_steps; ++step)
+        ErodeSteps(size, size, elevation[1], sediment[1], water[1], step, step + 1);
+
+    int different = 0;
+    int changed = 0;
+    for (int i = 0; i < area; ++i)
+    {
+        // The bits are compared, since the hydraulic erosion can give NaNs
+        different += memcmp(&elevation[0][i], &elevation[1][i], sizeof(float)) != 0 ||
+                     memcmp(&sediment[0][i], &sediment[1][i], sizeof(float)) != 0 ||
+                     memcmp(&water[0][i], &water[1][i], sizeof(float)) != 0 ? 1 : 0;
+        changed += elevation[0][i] != initial[i] ? 1 : 0;
+    }
+
+    printf("erode steps  type %d  %dx%d  %d steps  changed pixels %d  different %d\n",
+            erode_type, size, size, num_steps, changed, different);
+
+    free(buffers);
+    return different == 0 && changed > 0 && num_steps > 1;
+}
+
+// COAST DISTANCE
+
+// CalcCoastDistance should be the exact distance to the nearest land pixel, checked against all the land pixels.
+// The width isn't a multiple of the column blocks. With no land, every pixel should stay at MAPMAKER_COAST_DISTANCE_INF
+static bool TestCoastDistance(int width, int height, int num_islands)
+{
+    const int sea_level = 128;
+    height_t* heights = (height_t*)calloc(width * height, sizeof(height_t));
+    g_Seed = (uint32_t)(width * height + num_islands);
+    for (int i = 0; i < num_islands; ++i)
+    {
+        float cx = TestRandf((float)width);
+        float cy = TestRandf((float)height);
+        float r = 1.0f + TestRandf(8.0f);
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r)
+                    heights[y * width + x] = (height_t)(sea_level << MAPMAKER_HEIGHT_SHIFT);
+            }
+        }
+    }
+
+    int* land = (int*)malloc(sizeof(int) * width * height);
+    int num_land = 0;
+    for (int i = 0; i < width * height; ++i)
+    {
+        if (heights[i] >= (sea_level << MAPMAKER_HEIGHT_SHIFT))
+            land[num_land++] = i;
+    }
+
+    float* distances = (float*)malloc(sizeof(float) * width * height);
+    double t = TestTime();
+    CalcCoastDistance(width, height, heights, sea_level, distances);
+    t = TestTime() - t;
+
+    float max_error = 0;
+    int different = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            float expected = MAPMAKER_COAST_DISTANCE_INF;
+            for (int i = 0; i < num_land; ++i)
+            {
+                float dx = (float)(land[i] % width - x);
+                float dy = (float)(land[i] / width - y);
+                float d = sqrtf(dx * dx + dy * dy);
+                if (d < expected)
+                    expected = d;
+            }
+            float d = distances[y * width + x];
+            if (expected == MAPMAKER_COAST_DISTANCE_INF ? d != expected : fabsf(d - expected) > 1e-3f)
+                different++;
+            else if (expected != MAPMAKER_COAST_DISTANCE_INF && fabsf(d - expected) > max_error)
+                max_error = fabsf(d - expected);
+        }
+    }
+
+    printf("coast distance  %dx%d  land pixels %d  different %d  max error %g  %.2f ms\n",
+            width, height, num_land, different, max_error, t * 1000.0);
+
+    free(distances);
+    free(land);
+    free(heights);
+    return different == 0;
+}
+
+static bool IsNeighbor(const SVoronoiGraph* graph, int cell, int neighbor)
+{
+    for (int e = graph->offsets[cell]; e < graph->offsets[cell + 1]; ++e)
+    {
+        if (graph->neighbors[e] == neighbor)
+            return true;
+    }
+    return false;
+}
+
+// Generates a map of an island, and checks the rivers and biomes against their definitions (see GenerateRiversAndBiomes)
+static bool TestGenerateMap(int num_cells, int size)
+{
+    SVoronoiParameters voronoi_params;
+    SNoiseParameters noise_params;
+    SMapParameters map_params;
+    voronoi_params.num_cells = num_cells;
+    map_params.width = size;
+    map_params.height = size;
+    UpdateParams(&voronoi_params, &noise_params, &map_params);
+
+    double t = TestTime();
+    GenerateVoronoi();
+    double time_voronoi = TestTime() - t;
+
+    // A cone with ripples, so there are lakes and several rivers
+    height_t* heights = (height_t*)malloc(sizeof(height_t) * size * size);
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            float dx = (x - size * 0.5f) / (size * 0.5f);
+            float dy = (y - size * 0.5f) / (size * 0.5f);
+            float v = 1.0f - sqrtf(dx*dx + dy*dy) + 0.1f * sinf(x * 0.02f) * sinf(y * 0.03f);
+            v = v < 0 ? 0 : (v > 1 ? 1 : v);
+            heights[y * size + x] = (height_t)(v * MAPMAKER_HEIGHT_MAX);
+        }
+    }
+
+    t = TestTime();
+    GenerateMap(heights);
+    double time_map = TestTime() - t;
+
+    // The best of a few runs, the cells stay the same
+    SMap* map = GetMap();
+    double time_biomes = 0;
+    for (int run = 0; run < 5; ++run)
+    {
+        t = TestTime();
+        GenerateRiversAndBiomes(map, map_params.sea_level, map_params.river_flow);
+        t = TestTime() - t;
+        if (run == 0 || t < time_biomes)
+            time_biomes = t;
+    }
+
+    // The elevations of the cells, with a serial pass over the pixels (GenerateMap accumulates them in parallel)
+    uint32_t* elevation_sum = (uint32_t*)calloc(map->num_cells * 4, sizeof(uint32_t));
+    uint32_t* elevation_count = elevation_sum + map->num_cells;
+    uint32_t* elevation_min = elevation_count + map->num_cells;
+    uint32_t* elevation_max = elevation_min + map->num_cells;
+    for (int i = 0; i < map->num_cells; ++i)
+        elevation_min[i] = 255;
+    for (int i = 0; i < size * size; ++i)
+    {
+        uint32_t cell = map->cell_ids[i];
+        uint32_t h = heights[i] >> MAPMAKER_HEIGHT_SHIFT;
+        elevation_sum[cell] += h;
+        elevation_count[cell]++;
+        elevation_min[cell] = h < elevation_min[cell] ? h : elevation_min[cell];
+        elevation_max[cell] = h > elevation_max[cell] ? h : elevation_max[cell];
+    }
+    int elevation_different = 0;
+    for (int i = 0; i < map->num_cells; ++i)
+    {
+        uint32_t count = elevation_count[i];
+        uint32_t mean = count ? (elevation_sum[i] + count / 2) / count : 0;
+        if (count == 0)
+            elevation_min[i] = elevation_max[i] = 0;
+        if (map->elevation_min[i] != elevation_min[i] || map->elevation_mean[i] != mean || map->elevation_max[i] != elevation_max[i])
+            elevation_different++;
+    }
+    free(elevation_sum);
+
+    const SVoronoiGraph* graph = map->graph;
+    uint32_t* flow = (uint32_t*)calloc(map->num_cells, sizeof(uint32_t));
+    for (int i = 0; i < map->num_cells; ++i)
+    {
+        if (BitsetTest(map->is_land, i))
+            flow[i] += 1;
+        if (map->downslope[i] >= 0)
+            flow[map->downslope[i]] += map->flow[i];
+    }
+
+    int num_land = 0;
+    int num_lakes = 0;
+    int errors = graph->num_open_edges + elevation_different; // The broken cells are closed, but shouldn't be there
+    for (int i = 0; i < map->num_cells; ++i)
+    {
+        bool land = BitsetTest(map->is_land, i);
+        bool ocean = BitsetTest(map->is_ocean, i);
+        int down = map->downslope[i];
+        num_land += land ? 1 : 0;
+        num_lakes += !land && !ocean ? 1 : 0;
+
+        // The water flows nowhere, the land flows to a neighbor that is water, or not higher
+        if (down >= 0 && (!land || !IsNeighbor(graph, i, down) ||
+                          (BitsetTest(map->is_land, down) && map->elevation_mean[down] > map->elevation_mean[i])))
+            errors++;
+        // The flow is the cell itself and all the cells flowing into it
+        if (map->flow[i] != flow[i])
+            errors++;
+        if (BitsetTest(map->is_river, i) != (land && map->flow[i] >= (uint32_t)map_params.river_flow))
+            errors++;
+        // The ocean is the water connected to the border
+        if (ocean && land)
+            errors++;
+        if (!land && BitsetTest(map->is_border, i) && !ocean && graph->offsets[i] != graph->offsets[i + 1])
+            errors++;
+        for (int e = graph->offsets[i]; e < graph->offsets[i + 1]; ++e)
+        {
+            int n = graph->neighbors[e];
+            if (ocean && n >= 0 && !BitsetTest(map->is_land, n) && !BitsetTest(map->is_ocean, n))
+                errors++;
+        }
+        bool water_biome = map->biome[i] == BIOME_OCEAN || map->biome[i] == BIOME_LAKE;
+        if (land == water_biome || (!land && (map->biome[i] == BIOME_OCEAN) != ocean))
+            errors++;
+    }
+
+    printf("generate map  %6d cells  %dx%d  land %d  lakes %d  rivers %d  open edges %d  elevation different %d  errors %d  voronoi %.1f ms  map %.1f ms  rivers and biomes %.2f ms\n",
+            map->num_cells, size, size, num_land, num_lakes, BitsetCount(map->is_river, map->num_cells), graph->num_open_edges, elevation_different, errors,
+            time_voronoi * 1000.0, time_map * 1000.0, time_biomes * 1000.0);
+
+    free(flow);
+    free(heights);
+    return errors == 0 && num_land > 0;
+}
+
+int main(int argc, const char** argv)
+{
+    int num_threads = argc > 1 ? atoi(argv[1]) : 0;
+    JobsInit(num_threads);
+    printf("threads %d\n", JobsNumThreads());
+
+    bool ok = true;
+    ok &= TestVoronoiMode(100000, 4096.0f);
+    ok &= TestVoronoiMode(1000000, 16384.0f);
+    ok &= TestVoronoiPartitioned(40000);
+    ok &= TestVoronoiPartitioned(200000);
+    ok &= TestFillCells(1000, 2048);
+    ok &= TestFillCells(10000, 2048);
+    ok &= TestFillCells(100000, 2048);
+    ok &= TestErodeDroplets(512, 70000, 4, num_threads);
+    ok &= TestErodeSteps(256, 0);
+    ok &= TestErodeSteps(256, 1);
+    ok &= TestErodeSteps(256, 3);
+    ok &= TestCoastDistance(200, 150, 20);
+    ok &= TestCoastDistance(200, 150, 0);
+    ok &= TestGenerateMap(10000, 1024);
+    ok &= TestGenerateMap(16000, 1024);
+    ok &= TestGenerateMap(100000, 2048);
+
+    JobsShutdown();
+    if (!ok)
+        printf("FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+#! /usr/bin/env bash
+# Builds test_mapmaker.cpp for each voronoi mode (see mapmaker.h), and runs them once for each thread count
+# Usage: THREADS="1 2 4 8 16 32" ./test_mapmaker.sh
+
+set -e
+
+CXX=${CXX:-clang++}
+CCFLAGS="-O3 -g -Iexternal -I../src"
+BUILDDIR="./build"
+THREADS=${THREADS:-"1 0"}
+
+mkdir -p $BUILDDIR
+
+MODES=("float:" "double:-DMAPMAKER_VORONOI_DOUBLE" "snapped:-DMAPMAKER_VORONOI_SNAP=256")
+
+for mode in "${MODES[@]}"; do
+    name=${mode%%:*}
+    defines=${mode#*:}
+    $CXX $CCFLAGS $defines -o $BUILDDIR/test_mapmaker_$name test_mapmaker.cpp mapmaker.cpp jobs.cpp -lpthread
+done
+
+for threads in $THREADS; do
+    for mode in "${MODES[@]}"; do
+        name=${mode%%:*}
+        $BUILDDIR/test_mapmaker_$name $threads
+    done
+done
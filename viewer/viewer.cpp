@@ -23,15 +23,34 @@
 #include "HandmadeMath.h"
 
 #include "mapmaker.h"
+#include "jobs.h"
 
 #define JC_VORONOI_IMPLEMENTATION
 #include "jc_voronoi.h"
 
+#define JC_DRAW_IMPLEMENTATION
+#include "jc_draw.h"
+
+static inline int min2(int a, int b)
+{
+    return (a < b) ? a : b;
+}
+
+static inline int max2(int a, int b)
+{
+    return (a > b) ? a : b;
+}
+
 extern void imgui_sokol_event(const sapp_event* event);
 extern void imgui_setup();
 extern void imgui_teardown();
 
 static void draw_voronoi(uint8_t* pixels, const SMap* map);
+static void GenerateNoiseParallel(height_t* noise, int y_start, int y_end);
+static void ProcessNoise(height_t* noise);
+static void StartErosion(const height_t* noise, bool use_erosion);
+static void NormalizeNoise(height_t* noise, bool eroded);
+static void RefineNoise();
 
 static SVoronoiParameters   g_VoronoiParams;
 static SNoiseParameters     g_NoiseParams;
@@ -45,11 +64,12 @@ int image_area_width = 512;
 int image_area_height = 512;
 int imgui_width = 256;
 
-float* noisef = 0;
+float* elevation = 0; // the float copy of the heights for the erosion
 float* sediment = 0;
 float* water = 0;
 
-uint8_t* heights = 0;
+height_t* heights = 0; // the noise, and after the processing, the map heights
+height_t* heights_refined = 0; // the full resolution noise, while it's being generated and processed
 uint8_t* colors = 0;
 uint8_t* pixels = 0;
 
@@ -66,6 +86,25 @@ uint8_t height_colors[] = { 8, 134, 255,   // deep water
                         255, 255, 255   // snow
 };
 
+// The voronoi overlay colors of the biomes (EBiome). The ocean uses the water colors above
+uint8_t biome_colors[] = {  68, 68, 122,    // ocean
+                            51, 102, 153,   // lake
+                            160, 144, 119,  // beach
+                            255, 255, 255,  // snow
+                            187, 187, 170,  // tundra
+                            136, 136, 136,  // bare
+                            85, 85, 85,     // scorched
+                            153, 170, 119,  // taiga
+                            136, 153, 119,  // shrubland
+                            201, 210, 155,  // temperate desert
+                            68, 136, 85,    // temperate rain forest
+                            103, 148, 89,   // temperate deciduous forest
+                            136, 170, 85,   // grassland
+                            51, 119, 85,    // tropical rain forest
+                            85, 153, 68,    // tropical seasonal forest
+                            210, 185, 139   // subtropical desert
+};
+
 uint64_t last_time = 0;
 
 typedef struct {
@@ -80,6 +119,39 @@ float rx = 0.0f;
 float ry = 0.0f;
 int update_count = 0;
 
+bool progressive_noise = true;
+int noise_preview_step = 8;         // pixels per sample in the preview
+double noise_refine_budget_ms = 12.0; // time spent refining the noise each frame
+
+// The full resolution noise is refined over several frames, one stage at a time, while the preview is shown
+enum ENoiseStage
+{
+    NOISE_STAGE_DONE,
+    NOISE_STAGE_GENERATE,   // the rows of the full resolution noise, within the budget
+    NOISE_STAGE_PROCESS,    // the blur and contrast
+    NOISE_STAGE_ERODE,      // the erosion steps, within the budget
+    NOISE_STAGE_NORMALIZE,  // into the map heights, which then replace the preview
+    NOISE_STAGE_MAP,        // the cells of the new heights
+    NOISE_STAGE_COLORIZE,
+};
+
+int noise_stage = NOISE_STAGE_DONE;
+int noise_refine_row = 0;           // next row to generate
+int noise_erode_step = 0;           // next erosion step
+
+enum EDisplayMode
+{
+    DISPLAY_MAP,
+    DISPLAY_NOISE,
+    DISPLAY_VORONOI,
+    DISPLAY_SEDIMENT,
+    DISPLAY_WATER,
+};
+
+uint32_t content_version = 0;           // increased each time the map/noise is regenerated
+uint32_t uploaded_content_version = 0;  // the content version currently in the texture
+int uploaded_display_mode = -1;         // the display mode currently in the texture
+
 extern const char *vs_src, *fs_src;
 
 static void init(void) {
@@ -94,6 +166,8 @@ static void init(void) {
     };
     sg_setup(&desc);
 
+    JobsInit(0);
+
     pass_action = (sg_pass_action) {
         .colors[0] = { .action=SG_ACTION_CLEAR, .val={0.34f, 0.34f, 0.34f, 1.0f} }
     };
@@ -155,7 +229,7 @@ static void init(void) {
         .width = g_MapParams.width,
         .height = g_MapParams.height,
         .pixel_format = SG_PIXELFORMAT_RGBA8,
-        .usage = SG_USAGE_STREAM,
+        .usage = SG_USAGE_DYNAMIC, // only updated when the content changes
         .min_filter = SG_FILTER_LINEAR,
         .mag_filter = SG_FILTER_LINEAR,
         .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
@@ -178,14 +252,17 @@ static void init(void) {
     pixels = (uint8_t*)malloc(size*4);
     memset(pixels, 0xFF, size*4);
 
-    colors = (uint8_t*)malloc(size*3);
-    memset(colors, 0xFF, size*3);
+    colors = (uint8_t*)malloc(size*4);
+    memset(colors, 0xFF, size*4);
 
-    heights = (uint8_t*)malloc(size);
-    memset(heights, 0, size);
+    heights = (height_t*)malloc(size*sizeof(height_t));
+    memset(heights, 0, size*sizeof(height_t));
 
-    noisef = (float*)malloc(size*sizeof(float));
-    memset(noisef, 0, size*sizeof(float));
+    heights_refined = (height_t*)malloc(size*sizeof(height_t));
+    memset(heights_refined, 0, size*sizeof(height_t));
+
+    elevation = (float*)malloc(size*sizeof(float));
+    memset(elevation, 0, size*sizeof(float));
 
     sediment = (float*)malloc(size*sizeof(float));
     memset(sediment, 0, size*sizeof(float));
@@ -228,6 +305,7 @@ static void frame(void) {
     static bool show_sediment = false;
     static bool show_water = false;
     static int noise_type = 0;
+    bool noise_refine_changed = false;
 
     ImGuiIO& io = ImGui::GetIO();
     io.DisplaySize = ImVec2(w, h);
@@ -251,6 +329,21 @@ static void frame(void) {
 
         ImGui::Combo("Noise Type", &noise_type, "Perlin\0Simplex (not implemented)\0");
 
+        // These aren't part of the noise parameters, so they trigger a new noise themselves
+        if (ImGui::Checkbox("Time-sliced refine", &progressive_noise))
+            noise_refine_changed = true;
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("Show a preview, and refine and erode it over the next frames, %.0f ms per frame", noise_refine_budget_ms);
+        if (progressive_noise)
+        {
+            int preview = noise_preview_step == 4 ? 0 : 1;
+            if (ImGui::Combo("Preview", &preview, "1/4\01/8\0"))
+            {
+                noise_preview_step = preview == 0 ? 4 : 8;
+                noise_refine_changed = true;
+            }
+        }
+
         if (ImGui::CollapsingHeader("fBm")) {
             ImGui::Text("fBm");
             ImGui::InputInt("octaves", &g_NoiseParams.fbm_octaves);
@@ -294,11 +387,14 @@ static void frame(void) {
     if (ImGui::CollapsingHeader("Erosion")) {
         ImGui::Checkbox("Use Erosion", &g_NoiseParams.use_erosion);
 
-        ImGui::Combo("Erosion Type", &g_NoiseParams.erode_type, "Thermal\0Hydraulic\0");
-        ImGui::InputInt("Iterations", &g_NoiseParams.erode_iterations);
+        ImGui::Combo("Erosion Type", &g_NoiseParams.erode_type, "Thermal\0Hydraulic\0Flow\0Droplets\0");
+        // The flow and droplet erosions don't iterate
+        if (g_NoiseParams.erode_type == 0 || g_NoiseParams.erode_type == 1)
+            ImGui::InputInt("Iterations", &g_NoiseParams.erode_iterations);
 
         if (g_NoiseParams.erode_type == 0)
         {
+            ImGui::Checkbox("Multigrid", &g_NoiseParams.erode_multigrid);
             ImGui::SliderFloat("Talus", &g_NoiseParams.erode_thermal_talus, 0.0f, 16.0f);
         }
         else if (g_NoiseParams.erode_type == 1)
@@ -310,6 +406,17 @@ static void frame(void) {
             ImGui::Checkbox("Show Sediment", &show_sediment);
             ImGui::Checkbox("Show Water", &show_water);
         }
+        else if (g_NoiseParams.erode_type == 2)
+        {
+            ImGui::SliderFloat("Carve", &g_NoiseParams.erode_flow_carve, 0.0f, 1.0f);
+            ImGui::Checkbox("Show Filled", &show_sediment);
+            ImGui::Checkbox("Show Flow", &show_water);
+        }
+        else if (g_NoiseParams.erode_type == 3)
+        {
+            ImGui::InputInt("Droplets", &g_NoiseParams.erode_droplets, 1000, 10000);
+            ImGui::SliderInt("Droplet Radius", &g_NoiseParams.erode_droplet_radius, 1, 8);
+        }
     }
 
     if (ImGui::CollapsingHeader("Voronoi"))
@@ -323,22 +430,33 @@ static void frame(void) {
 
         ImGui::SliderInt("Border", &g_VoronoiParams.border, 0, g_MapParams.width/2);
 
-        ImGui::Combo("Cell Type", &g_VoronoiParams.generation_type, "Random\0Hexagonal\0");
+        ImGui::Combo("Cell Type", &g_VoronoiParams.generation_type, "Random\0Hexagonal\0Poisson Disc\0");
 
         if (g_VoronoiParams.generation_type == 0) // random
         {
             ImGui::SliderInt("Num Cells", &g_VoronoiParams.num_cells, 1, 16*1024);
             ImGui::SliderInt("Relax", &g_VoronoiParams.num_relaxations, 0, 100);
+            ImGui::SliderFloat("Relax Epsilon", &g_VoronoiParams.relax_epsilon, 0.0f, 2.0f);
         }
         else if(g_VoronoiParams.generation_type == 1) // hexagonal
         {
             ImGui::SliderInt("Density", &g_VoronoiParams.hexagon_density, 1, 128);
         }
+        else if(g_VoronoiParams.generation_type == 2) // poisson disc
+        {
+            ImGui::SliderInt("Num Cells", &g_VoronoiParams.num_cells, 1, 16*1024);
+        }
     }
 
     if (ImGui::CollapsingHeader("Map")) {
 
         ImGui::SliderInt("Sea Level", &g_MapParams.sea_level, 0, 255);
+        const SMap* map = GetMap();
+        ImGui::Text("Land cells %d of %d", BitsetCount(map->is_land, map->num_cells), map->num_cells);
+        if (map->graph && map->graph->num_open_edges > 0)
+            ImGui::Text("Open cell edges %d (see MAPMAKER_VORONOI_DOUBLE)", map->graph->num_open_edges);
+        ImGui::SliderInt("River Flow", &g_MapParams.river_flow, 1, 256);
+        ImGui::SliderInt("Shallow Cells", &g_MapParams.shallow_distance, 0, 16);
 
         if (ImGui::CollapsingHeader("Colors")) {
             ImGui::Text("Elevation limits and their colors");
@@ -369,7 +487,9 @@ static void frame(void) {
             }
         }
         ImGui::Checkbox("Use Shading", &g_MapParams.use_shading);
-        ImGui::SliderInt("Shadow Step Length", &g_MapParams.shadow_step_length, 1, 16);
+        ImGui::SliderFloat2("Light Dir", g_MapParams.light_dir, -1.0f, 1.0f);
+        ImGui::SliderFloat("Light Height", &g_MapParams.light_dir[2], 0.01f, 4.0f);
+        ImGui::SliderInt("Shadow Step Length", &g_MapParams.shadow_step_length, 1, 256);
         ImGui::SliderFloat("Shadow Strength", &g_MapParams.shadow_strength, 0.0f, 1.0f);
         ImGui::SliderFloat("Shadow Strength Sea", &g_MapParams.shadow_strength_sea, 0.0f, 1.0f);
     }
@@ -388,7 +508,7 @@ static void frame(void) {
     g_NoiseParamsHash = Hash((void*)&g_NoiseParams, sizeof(g_NoiseParams));
     g_MapParamsHash = Hash((void*)&g_MapParams, sizeof(g_MapParams));
     bool update_voronoi = prev_voronoi_param_hash != g_VoronoiParamsHash;
-    bool update_noise = prev_noise_param_hash != g_NoiseParamsHash;
+    bool update_noise = prev_noise_param_hash != g_NoiseParamsHash || noise_refine_changed;
     bool update_map = update_noise || update_voronoi || prev_map_param_hash != g_MapParamsHash;
 
     if (update_map)
@@ -401,93 +521,111 @@ static void frame(void) {
         GenerateVoronoi();
     }
 
+    bool update_colors = update_map;
     if (update_noise)
     {
-        int size = g_MapParams.width*g_MapParams.height;
-        memset(sediment, 0, size*sizeof(float));
-        memset(water, 0, size*sizeof(float));
-
-        if (g_NoiseParams.perturb_type == 0)
-            GenerateNoise(noisef, g_NoiseParams.noise_modify_type);
-        else if(g_NoiseParams.perturb_type == 1)
-            Perturb1(g_MapParams.width, g_MapParams.height, noisef);
-        else if(g_NoiseParams.perturb_type == 2)
-            Perturb2(g_MapParams.width, g_MapParams.height, noisef);
-
-        if (g_NoiseParams.perturb_type != 0)
+        if (progressive_noise)
         {
-            Blur(g_MapParams.width, g_MapParams.height, noisef, 255.0f);
-            Blur(g_MapParams.width, g_MapParams.height, noisef, 255.0f);
-            Blur(g_MapParams.width, g_MapParams.height, noisef, 255.0f);
-            Blur(g_MapParams.width, g_MapParams.height, noisef, 255.0f);
+            // Show a low resolution version (without erosion) right away, and refine it over the next frames
+            GenerateNoiseRows(heights, 0, g_MapParams.height, noise_preview_step);
+            ProcessNoise(heights);
+            StartErosion(heights, false);
+            NormalizeNoise(heights, false);
+            noise_stage = NOISE_STAGE_GENERATE;
+            noise_refine_row = 0;
+        }
+        else
+        {
+            GenerateNoiseParallel(heights, 0, g_MapParams.height);
+            ProcessNoise(heights);
+            StartErosion(heights, g_NoiseParams.use_erosion);
+            if (g_NoiseParams.use_erosion)
+                Erode(g_MapParams.width, g_MapParams.height, elevation, sediment, water);
+            NormalizeNoise(heights, g_NoiseParams.use_erosion);
+            noise_stage = NOISE_STAGE_DONE;
         }
-
-        ContrastNoise(noisef, g_NoiseParams.contrast_exponent);
-        if (g_NoiseParams.use_erosion)
-            Erode(g_MapParams.width, g_MapParams.height, noisef, sediment, water);
-
-        Normalize(g_MapParams.width, g_MapParams.height, noisef);
-
-        if (g_NoiseParams.apply_radial)
-            NoiseRadial(g_MapParams.width, g_MapParams.height, g_NoiseParams.radial_falloff, noisef);
-
-        Normalize(g_MapParams.width, g_MapParams.height, noisef);
     }
-
-    if (update_map)
+    else if (noise_stage == NOISE_STAGE_MAP)
+    {
+        // The refined map and its colors are updated in separate frames
+        update_map = true;
+        noise_stage = NOISE_STAGE_COLORIZE;
+    }
+    else if (noise_stage == NOISE_STAGE_COLORIZE)
     {
-        for( int i = 0; i < g_MapParams.width * g_MapParams.height; ++i )
-            heights[i] = (uint8_t)255.0f * noisef[i];
+        update_colors = true;
+        noise_stage = NOISE_STAGE_DONE;
+    }
+    else if (noise_stage != NOISE_STAGE_DONE)
+    {
+        RefineNoise();
+    }
 
+    if (update_map)
         GenerateMap(heights);
+    if (update_colors)
         ColorizeMap(heights, colors, sizeof(height_limits)/sizeof(height_limits[0]), g_MapParams.limits, g_MapParams.colors);
-    }
 
-    if (show_water) {
-        for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
-            pixels[i*4 + 0] = (uint8_t)(255.0f * water[i]);
-            pixels[i*4 + 1] = (uint8_t)(255.0f * water[i]);
-            pixels[i*4 + 2] = (uint8_t)(255.0f * water[i]);
-            pixels[i*4 + 3] = 0xFF;
+    // Only rebuild and upload the texture when the content, or what we show, has changed
+    int display_mode = DISPLAY_MAP;
+    if (show_water)
+        display_mode = DISPLAY_WATER;
+    else if (show_sediment)
+        display_mode = DISPLAY_SEDIMENT;
+    else if (show_noise)
+        display_mode = DISPLAY_NOISE;
+    else if (show_voronoi)
+        display_mode = DISPLAY_VORONOI;
+
+    if (update_colors)
+        ++content_version;
+
+    if (display_mode != uploaded_display_mode || content_version != uploaded_content_version)
+    {
+        // The map colors are already in RGBA, so they're uploaded directly
+        const uint8_t* upload = display_mode == DISPLAY_MAP ? colors : pixels;
+
+        if (display_mode == DISPLAY_WATER) {
+            for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
+                pixels[i*4 + 0] = (uint8_t)(255.0f * water[i]);
+                pixels[i*4 + 1] = (uint8_t)(255.0f * water[i]);
+                pixels[i*4 + 2] = (uint8_t)(255.0f * water[i]);
+                pixels[i*4 + 3] = 0xFF;
+            }
         }
-    }
-    else if (show_sediment) {
-        for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
-            pixels[i*4 + 0] = (uint8_t)(255.0f * sediment[i]);
-            pixels[i*4 + 1] = (uint8_t)(255.0f * sediment[i]);
-            pixels[i*4 + 2] = (uint8_t)(255.0f * sediment[i]);
-            pixels[i*4 + 3] = 0xFF;
+        else if (display_mode == DISPLAY_SEDIMENT) {
+            for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
+                pixels[i*4 + 0] = (uint8_t)(255.0f * sediment[i]);
+                pixels[i*4 + 1] = (uint8_t)(255.0f * sediment[i]);
+                pixels[i*4 + 2] = (uint8_t)(255.0f * sediment[i]);
+                pixels[i*4 + 3] = 0xFF;
+            }
         }
-    }
-    else if (show_noise) {
-        for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
-            pixels[i*4 + 0] = heights[i];
-            pixels[i*4 + 1] = heights[i];
-            pixels[i*4 + 2] = heights[i];
-            pixels[i*4 + 3] = 0xFF;
+        else if (display_mode == DISPLAY_NOISE) {
+            for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
+                uint8_t h = heights[i] >> MAPMAKER_HEIGHT_SHIFT;
+                pixels[i*4 + 0] = h;
+                pixels[i*4 + 1] = h;
+                pixels[i*4 + 2] = h;
+                pixels[i*4 + 3] = 0xFF;
+            }
         }
-    }
-    else if (show_voronoi) {
-        SMap* map = GetMap();
-        draw_voronoi(pixels, map);
-    }
-    else
-    {
-        for(int i = 0; i < g_MapParams.width * g_MapParams.height; ++i) {
-            pixels[i*4 + 0] = colors[i*3 + 0];
-            pixels[i*4 + 1] = colors[i*3 + 1];
-            pixels[i*4 + 2] = colors[i*3 + 2];
-            pixels[i*4 + 3] = 0xFF;
+        else if (display_mode == DISPLAY_VORONOI) {
+            SMap* map = GetMap();
+            draw_voronoi(pixels, map);
         }
-    }
 
-    sg_image_content img_content = (sg_image_content){
-        .subimage[0][0] = {
-            .ptr = pixels,
-            .size = g_MapParams.width*g_MapParams.height*4
-        }
-    };
-    sg_update_image(draw_state.fs_images[0], &img_content);
+        sg_image_content img_content = (sg_image_content){
+            .subimage[0][0] = {
+                .ptr = upload,
+                .size = g_MapParams.width*g_MapParams.height*4
+            }
+        };
+        sg_update_image(draw_state.fs_images[0], &img_content);
+
+        uploaded_display_mode = display_mode;
+        uploaded_content_version = content_version;
+    }
 
     hmm_mat4 proj = HMM_Orthographic(-1, 2, -1, 1, 0.01f, 5.0f);
     hmm_mat4 view = HMM_LookAt(HMM_Vec3(0.0f, 0.0f, 4.0f), HMM_Vec3(0.0f, 0.0f, 0.0f), HMM_Vec3(0.0f, 1.0f, 0.0f));
@@ -507,12 +645,134 @@ static void frame(void) {
     sg_commit();
 }
 
+// The full resolution noise is generated in jobs of rows, in parallel. With the time-sliced refine, the rows
+// and the erosion steps are run until the frame's budget is spent, and the rest of the stages take a frame each,
+// so the preview stays responsive until the refined heights replace it.
+
+#define NOISE_ROWS_PER_JOB    16
+#define NOISE_JOBS_PER_THREAD 4  // Between the checks of the refine budget
+
+struct SNoiseRowsContext
+{
+    height_t*   noise;
+    int         y_start;
+    int         y_end;
+};
+
+static void GenerateNoiseRowsJob(void* _ctx, int job)
+{
+    const SNoiseRowsContext* ctx = (const SNoiseRowsContext*)_ctx;
+    int y = ctx->y_start + job * NOISE_ROWS_PER_JOB;
+    GenerateNoiseRows(ctx->noise, y, min2(y + NOISE_ROWS_PER_JOB, ctx->y_end), 1);
+}
+
+// The full resolution noise of the rows [y_start, y_end), in parallel
+static void GenerateNoiseParallel(height_t* noise, int y_start, int y_end)
+{
+    SNoiseRowsContext ctx;
+    ctx.noise = noise;
+    ctx.y_start = y_start;
+    ctx.y_end = min2(y_end, g_MapParams.height);
+    if (ctx.y_end <= ctx.y_start)
+        return;
+    JobsParallelFor((ctx.y_end - ctx.y_start + NOISE_ROWS_PER_JOB - 1) / NOISE_ROWS_PER_JOB, GenerateNoiseRowsJob, &ctx);
+}
+
+static void ProcessNoise(height_t* noise)
+{
+    if (g_NoiseParams.perturb_type != 0)
+    {
+        Blur(g_MapParams.width, g_MapParams.height, noise, 255.0f);
+        Blur(g_MapParams.width, g_MapParams.height, noise, 255.0f);
+        Blur(g_MapParams.width, g_MapParams.height, noise, 255.0f);
+        Blur(g_MapParams.width, g_MapParams.height, noise, 255.0f);
+    }
+
+    ContrastNoise(noise, g_NoiseParams.contrast_exponent);
+}
+
+// Clears the sediment and water, and (only the erosion works on floats) decodes the noise for the erosion
+static void StartErosion(const height_t* noise, bool use_erosion)
+{
+    int size = g_MapParams.width*g_MapParams.height;
+    memset(sediment, 0, size*sizeof(float));
+    memset(water, 0, size*sizeof(float));
+
+    if (use_erosion)
+        NoiseToElevation(g_MapParams.width, g_MapParams.height, noise, elevation);
+}
+
+static void NormalizeNoise(height_t* noise, bool eroded)
+{
+    NormalizeHeights(g_MapParams.width, g_MapParams.height, eroded ? elevation : 0,
+                     g_NoiseParams.apply_radial, g_NoiseParams.radial_falloff, noise);
+}
+
+// Runs the current stage of the full resolution noise (in heights_refined), within the budget for the
+// generation and the erosion. Each of the other stages takes one frame.
+// After the normalization, the refined heights replace the preview, and the frame updates the map.
+static void RefineNoise()
+{
+    uint64_t refine_start = stm_now();
+    switch (noise_stage)
+    {
+    case NOISE_STAGE_GENERATE:
+        {
+            int rows_per_batch = NOISE_ROWS_PER_JOB * NOISE_JOBS_PER_THREAD * JobsNumThreads();
+            while (noise_refine_row < g_MapParams.height && stm_ms(stm_since(refine_start)) < noise_refine_budget_ms)
+            {
+                GenerateNoiseParallel(heights_refined, noise_refine_row, noise_refine_row + rows_per_batch);
+                noise_refine_row += rows_per_batch;
+            }
+            if (noise_refine_row >= g_MapParams.height)
+                noise_stage = NOISE_STAGE_PROCESS;
+        }
+        break;
+
+    case NOISE_STAGE_PROCESS:
+        ProcessNoise(heights_refined);
+        StartErosion(heights_refined, g_NoiseParams.use_erosion);
+        noise_erode_step = 0;
+        noise_stage = g_NoiseParams.use_erosion ? NOISE_STAGE_ERODE : NOISE_STAGE_NORMALIZE;
+        break;
+
+    case NOISE_STAGE_ERODE:
+        {
+            // The flow and the multigrid erosion are a single step
+            int num_steps = ErodeNumSteps();
+            while (noise_erode_step < num_steps && stm_ms(stm_since(refine_start)) < noise_refine_budget_ms)
+            {
+                ErodeSteps(g_MapParams.width, g_MapParams.height, elevation, sediment, water, noise_erode_step, noise_erode_step + 1);
+                ++noise_erode_step;
+            }
+            if (noise_erode_step >= num_steps)
+                noise_stage = NOISE_STAGE_NORMALIZE;
+        }
+        break;
+
+    case NOISE_STAGE_NORMALIZE:
+        {
+            NormalizeNoise(heights_refined, g_NoiseParams.use_erosion);
+            height_t* preview = heights;
+            heights = heights_refined;
+            heights_refined = preview;
+            noise_stage = NOISE_STAGE_MAP;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
 static void cleanup(void) {
     imgui_teardown();
     sg_shutdown();
+    JobsShutdown();
     free(pixels);
     free(heights);
-    free(noisef);
+    free(heights_refined);
+    free(elevation);
 }
 
 static void log_msg(const char* msg) {
@@ -636,145 +896,214 @@ const char* fs_src =
 #endif
 
 
-// temp test
-static void draw_point(int x, int y, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
-{
-    if( x < 0 || y < 0 || x > (width-1) || y > (height-1) )
-        return;
-    int index = y * width * nchannels + x * nchannels;
-    for( int i = 0; i < nchannels; ++i )
-    {
-        image[index+i] = color[i];
-    }
-}
-
-// http://members.chello.at/~easyfilter/bresenham.html
-static void draw_line(int x0, int y0, int x1, int y1, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
-{
-    int dx =  abs(x1-x0), sx = x0<x1 ? 1 : -1;
-    int dy = -abs(y1-y0), sy = y0<y1 ? 1 : -1;
-    int err = dx+dy, e2; // error value e_xy
-
-    for(;;)
-    {  // loop
-        draw_point(x0,y0, image, width, height, nchannels, color);
-        if (x0==x1 && y0==y1) break;
-        e2 = 2*err;
-        if (e2 >= dy) { err += dy; x0 += sx; } // e_xy+e_x > 0
-        if (e2 <= dx) { err += dx; y0 += sy; } // e_xy+e_y < 0
-    }
-}
-
-static inline int orient2d(const jcv_point* a, const jcv_point* b, const jcv_point* c)
-{
-    return ((int)b->x - (int)a->x)*((int)c->y - (int)a->y) - ((int)b->y - (int)a->y)*((int)c->x - (int)a->x);
-}
+// The voronoi overlay is drawn in bands of rows, in parallel. The cells are filled by looking up the color
+// of each pixel's cell (map->cell_ids), so the cells aren't rasterized again when only the colors change.
+// Each cell is binned to the bands that its bounding box touches, and each band draws the edges and sites
+// of its cells (in the same order as the serial drawing) clipped to the band. The bands don't share any
+// pixels, so the result is the same as drawing the cells one after the other.
 
-static inline int min2(int a, int b)
-{
-    return (a < b) ? a : b;
-}
+#define VORONOI_BAND_HEIGHT 32
 
-static inline int max2(int a, int b)
+struct SVoronoiDrawContext
 {
-    return (a > b) ? a : b;
-}
+    const SMap*     map;
+    uint8_t*        pixels;
+    int             width;
+    int             height;
+    int             num_channels;
+    const int*      band_offsets;   // num_bands + 1 offsets into band_cells
+    const int*      band_cells;
+    const jcd_point* vertices;      // The graph vertices, as floats
+    const uint32_t* cell_colors;    // The (rgba) color of each cell
+};
 
-static inline int min3(int a, int b, int c)
+static jcd_point*   g_VoronoiDrawVertices = 0;
+static int          g_VoronoiDrawVerticesCapacity = 0;
+static int*         g_VoronoiBandOffsets = 0;
+static int          g_VoronoiBandOffsetsCapacity = 0;
+static int*         g_VoronoiBandCells = 0;
+static int          g_VoronoiBandCellsCapacity = 0;
+static int*         g_VoronoiCellBands = 0;     // The first and last band of each cell
+static int          g_VoronoiCellBandsCapacity = 0;
+static uint32_t*    g_VoronoiCellColors = 0;
+static int          g_VoronoiCellColorsCapacity = 0;
+
+static void draw_voronoi_band(void* _ctx, int band)
 {
-    return min2(a, min2(b, c));
-}
-static inline int max3(int a, int b, int c)
-{
-    return max2(a, max2(b, c));
-}
+    const SVoronoiDrawContext* ctx = (const SVoronoiDrawContext*)_ctx;
+    const SMap* map = ctx->map;
+    const SVoronoiGraph* graph = map->graph;
+    uint8_t colorline[] = { 200, 200, 200, 255 };
+    uint8_t colorwhite[] = { 255, 255, 255, 255 };
+    uint8_t colorriver[] = { 34, 85, 136, 255 };
+
+    jcd_rect clip;
+    clip.x0 = 0;
+    clip.x1 = ctx->width;
+    clip.y0 = band * VORONOI_BAND_HEIGHT;
+    clip.y1 = min2(clip.y0 + VORONOI_BAND_HEIGHT, ctx->height);
+
+    // Every pixel has a cell, so the gather covers the whole band
+    const uint32_t* ids = map->cell_ids + clip.y0 * ctx->width;
+    uint32_t* pixels = (uint32_t*)ctx->pixels + clip.y0 * ctx->width;
+    int num_pixels = (clip.y1 - clip.y0) * ctx->width;
+    for( int p = 0; p < num_pixels; ++p )
+        pixels[p] = ctx->cell_colors[ids[p]];
+
+    const int* cells = ctx->band_cells + ctx->band_offsets[band];
+    int num_cells = ctx->band_offsets[band + 1] - ctx->band_offsets[band];
+
+    // The edges are drawn on top of all the cells, once per edge (not by the cell with the lower index)
+    for( int c = 0; c < num_cells; ++c )
+    {
+        int i = cells[c];
+        int begin = graph->offsets[i];
+        int end = graph->offsets[i+1];
+        for( int e = begin; e < end; ++e )
+        {
+            if (graph->neighbors[e] > i)
+                continue;
+            const jcd_point& p0 = ctx->vertices[e];
+            const jcd_point& p1 = ctx->vertices[e + 1 < end ? e + 1 : begin];
+            jcd_draw_line_clip(p0.x, p0.y, p1.x, p1.y, &clip, ctx->pixels, ctx->width, ctx->num_channels, colorline);
+        }
+    }
 
-static void draw_triangle(const jcv_point* v0, const jcv_point* v1, const jcv_point* v2, uint8_t* image, int width, int height, int nchannels, const uint8_t* color)
-{
-    int area = orient2d(v0, v1, v2);
-    if( area == 0 )
-        return;
+    // The rivers, from each river cell to the cell it flows to
+    for( int c = 0; c < num_cells; ++c )
+    {
+        int i = cells[c];
+        int down = map->downslope[i];
+        if (!BitsetTest(map->is_river, i) || down < 0)
+            continue;
+        jcd_draw_line_clip(map->points[i].x, map->points[i].y, map->points[down].x, map->points[down].y, &clip, ctx->pixels, ctx->width, ctx->num_channels, colorriver);
+    }
 
-    // Compute triangle bounding box
-    int minX = min3((int)v0->x, (int)v1->x, (int)v2->x);
-    int minY = min3((int)v0->y, (int)v1->y, (int)v2->y);
-    int maxX = max3((int)v0->x, (int)v1->x, (int)v2->x);
-    int maxY = max3((int)v0->y, (int)v1->y, (int)v2->y);
-
-    // Clip against screen bounds
-    minX = max2(minX, 0);
-    minY = max2(minY, 0);
-    maxX = min2(maxX, width - 1);
-    maxY = min2(maxY, height - 1);
-
-    // Rasterize
-    jcv_point p;
-    for (p.y = minY; p.y <= maxY; p.y++) {
-        for (p.x = minX; p.x <= maxX; p.x++) {
-            // Determine barycentric coordinates
-            int w0 = orient2d(v1, v2, &p);
-            int w1 = orient2d(v2, v0, &p);
-            int w2 = orient2d(v0, v1, &p);
-
-            // If p is on or inside all edges, render pixel.
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0)
-            {
-                draw_point((int)p.x, (int)p.y, image, width, height, nchannels, color);
-            }
-        }
+    for( int c = 0; c < num_cells; ++c )
+    {
+        int i = cells[c];
+        jcd_draw_point_clip(map->points[i].x, map->points[i].y, &clip, ctx->pixels, ctx->width, ctx->num_channels, colorwhite);
     }
 }
 
 static void draw_voronoi(uint8_t* pixels, const SMap* map)
 {
-    uint8_t colorline[] = { 200, 200, 200, 255 };
-    uint8_t colorwhite[] = { 255, 255, 255, 255 };
-    uint8_t colorvertex[] = { 80, 200, 127, 255 };
-    int num_channels = 4;
-    uint8_t color_beach[] = {height_colors[6], height_colors[7], height_colors[8], 255};
+    int num_channels = 4; // The gather writes a pixel as one uint32_t
     uint8_t color_water_shallow[] = {height_colors[3], height_colors[4], height_colors[5], 255};
     uint8_t color_water_deep[] = {height_colors[0], height_colors[1], height_colors[2], 255};
 
     int width = g_MapParams.width;
     int height = g_MapParams.height;
-    memset(pixels, 255, width*height*num_channels );
+    int num_bands = (height + VORONOI_BAND_HEIGHT - 1) / VORONOI_BAND_HEIGHT;
+    const SVoronoiGraph* graph = map->graph;
+    int num_cells = map->num_cells;
+    int num_edges = graph->offsets[num_cells];
 
-    jcv_point* points = map->points;
-    for( int i = 0; i < map->num_cells; ++i )
+    if (g_VoronoiDrawVerticesCapacity < num_edges)
     {
-        const SCell& cell = map->cells[i];
-        if (cell.site == 0)
-            continue;
-
-        jcv_point p = points[i];
-
-        const jcv_graphedge* e = cell.site->edges;
-        while( e )
-        {
-            const jcv_point& p0 = e->pos[0];
-            const jcv_point& p1 = e->pos[1];
+        g_VoronoiDrawVertices = (jcd_point*)realloc(g_VoronoiDrawVertices, sizeof(jcd_point) * num_edges);
+        g_VoronoiDrawVerticesCapacity = num_edges;
+    }
+    if (g_VoronoiCellBandsCapacity < num_cells)
+    {
+        g_VoronoiCellBands = (int*)realloc(g_VoronoiCellBands, sizeof(int) * 2 * num_cells);
+        g_VoronoiCellBandsCapacity = num_cells;
+    }
+    if (g_VoronoiCellColorsCapacity < num_cells)
+    {
+        g_VoronoiCellColors = (uint32_t*)realloc(g_VoronoiCellColors, sizeof(uint32_t) * num_cells);
+        g_VoronoiCellColorsCapacity = num_cells;
+    }
+    if (g_VoronoiBandOffsetsCapacity < num_bands + 1)
+    {
+        g_VoronoiBandOffsets = (int*)realloc(g_VoronoiBandOffsets, sizeof(int) * (num_bands + 1));
+        g_VoronoiBandOffsetsCapacity = num_bands + 1;
+    }
+    int* band_offsets = g_VoronoiBandOffsets;
+    memset(band_offsets, 0, sizeof(int) * (num_bands + 1));
 
-            const uint8_t* color = color_water_shallow;
-            if(cell.is_land)
-            {
-                color = color_beach;
-            }
-            else
-            {
-                if (cell.is_shallow)
-                    color = color_water_shallow;
-                else
-                    color = color_water_deep;
-            }
+    uint32_t colors[BIOME_COUNT];
+    for( int b = 0; b < BIOME_COUNT; ++b )
+    {
+        uint8_t color[] = {biome_colors[b*3+0], biome_colors[b*3+1], biome_colors[b*3+2], 255};
+        memcpy(&colors[b], color, sizeof(uint32_t));
+    }
+    memcpy(&colors[BIOME_OCEAN], color_water_deep, sizeof(uint32_t));
+    uint32_t color_shallow;
+    memcpy(&color_shallow, color_water_shallow, sizeof(uint32_t));
 
-            draw_triangle( &p, &p0, &p1, pixels, width, height, num_channels, color);
-            draw_line(p0.x, p0.y, p1.x, p1.y, pixels, width, height, num_channels, colorline);
+    for( int i = 0; i < num_cells; ++i )
+        g_VoronoiCellColors[i] = colors[map->biome[i]];
+    for( int i = BitsetNext(map->is_shallow, num_cells, 0); i < num_cells; i = BitsetNext(map->is_shallow, num_cells, i + 1) )
+    {
+        if (map->biome[i] == BIOME_OCEAN)
+            g_VoronoiCellColors[i] = color_shallow;
+    }
 
-            //printf("s: %f, %f:  e: %f, %f -> %f, %f\n", p.x, p.y, p0.x, p0.y, p1.x, p1.y);
+    // The vertical extent covers the pixels of the edges (which are at the truncated vertex positions),
+    // the site and the river to the downslope site
+    for( int i = 0; i < num_cells; ++i )
+    {
+        int begin = graph->offsets[i];
+        int end = graph->offsets[i+1];
+        int* bands = g_VoronoiCellBands + i * 2;
+        if (begin == end)
+        {
+            bands[0] = 0;
+            bands[1] = -1;
+            continue;
+        }
 
-            e = e->next;
+        float min_y = map->points[i].y;
+        float max_y = min_y;
+        for( int e = begin; e < end; ++e )
+        {
+            jcd_point& v = g_VoronoiDrawVertices[e];
+            v.x = graph->vertices[e].x;
+            v.y = graph->vertices[e].y;
+            min_y = v.y < min_y ? v.y : min_y;
+            max_y = v.y > max_y ? v.y : max_y;
+        }
+        if (BitsetTest(map->is_river, i) && map->downslope[i] >= 0)
+        {
+            float y = map->points[map->downslope[i]].y;
+            min_y = y < min_y ? y : min_y;
+            max_y = y > max_y ? y : max_y;
         }
+        bands[0] = max2(0, (int)floorf(min_y) / VORONOI_BAND_HEIGHT);
+        bands[1] = min2(num_bands - 1, (int)max_y / VORONOI_BAND_HEIGHT);
+        for( int b = bands[0]; b <= bands[1]; ++b )
+            band_offsets[b + 1]++;
+    }
 
-        draw_point( p.x, p.y, pixels, width, height, num_channels, colorwhite);
+    for( int b = 0; b < num_bands; ++b )
+        band_offsets[b + 1] += band_offsets[b];
+    if (g_VoronoiBandCellsCapacity < band_offsets[num_bands])
+    {
+        g_VoronoiBandCells = (int*)realloc(g_VoronoiBandCells, sizeof(int) * band_offsets[num_bands]);
+        g_VoronoiBandCellsCapacity = band_offsets[num_bands];
+    }
+
+    // The cells are added in order, which moves each offset to the start of the next band
+    for( int i = 0; i < num_cells; ++i )
+    {
+        const int* bands = g_VoronoiCellBands + i * 2;
+        for( int b = bands[0]; b <= bands[1]; ++b )
+            g_VoronoiBandCells[band_offsets[b]++] = i;
     }
+    for( int b = num_bands; b > 0; --b )
+        band_offsets[b] = band_offsets[b - 1];
+    band_offsets[0] = 0;
+
+    SVoronoiDrawContext ctx;
+    ctx.map = map;
+    ctx.pixels = pixels;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.num_channels = num_channels;
+    ctx.band_offsets = band_offsets;
+    ctx.band_cells = g_VoronoiBandCells;
+    ctx.vertices = g_VoronoiDrawVertices;
+    ctx.cell_colors = g_VoronoiCellColors;
+    JobsParallelFor(num_bands, draw_voronoi_band, &ctx);
 }